@@ -323,7 +323,9 @@ LUA_API lua_Number lua_tonumber (lua_State *L, int idx) {
 LUA_API lua_Integer lua_tointeger (lua_State *L, int idx) {
   TValue n;
   const TValue *o = index2adr(L, idx);
-  if (tonumber(o, &n)) {
+  if (ttisint(o))
+    return ivalue(o);
+  else if (tonumber(o, &n)) {
     lua_Integer res;
     lua_Number num = nvalue(o);
     lua_number2integer(res, num);
@@ -436,7 +438,10 @@ LUA_API void lua_pushnumber (lua_State *L, lua_Number n) {
 
 LUA_API void lua_pushinteger (lua_State *L, lua_Integer n) {
   lua_lock(L);
-  setnvalue(L->top, cast_num(n));
+  if (cast(lua_Integer, cast_int(n)) == n)  /* fits in an int? */
+    setivalue(L->top, cast_int(n))
+  else
+    setnvalue(L->top, cast_num(n));
   api_incr_top(L);
   lua_unlock(L);
 }
@@ -510,6 +515,9 @@ LUA_API void lua_pushboolean (lua_State *L, int b) {
 
 LUA_API void lua_pushlightuserdata (lua_State *L, void *p) {
   lua_lock(L);
+#if defined(LUA_NANBOX)
+  api_check(L, (cast(LUAI_UINT64, cast(size_t, p)) & ~NANBOX_PAYLOAD) == 0);
+#endif
   setpvalue(L->top, p);
   api_incr_top(L);
   lua_unlock(L);
@@ -872,14 +880,43 @@ LUA_API int lua_load (lua_State *L, lua_Reader reader, void *data,
 }
 
 
+/*
+** load a chunk from `buff', which is owned by the userdata on the top
+** of the stack; loaded functions may keep pointers into `buff' (and a
+** reference to the userdata), so it must not change while that
+** userdata is alive
+*/
+LUA_API int lua_loadimage (lua_State *L, const char *buff, size_t size,
+                           const char *chunkname) {
+  ZIO z;
+  int status;
+  lua_lock(L);
+  api_checknelems(L, 1);
+  api_check(L, ttisuserdata(L->top - 1));
+  if (!chunkname) chunkname = "?";
+  luaZ_initimage(L, &z, buff, size, gcvalue(L->top - 1));
+  status = luaD_protectedparser(L, &z, chunkname);
+  lua_unlock(L);
+  return status;
+}
+
+
 LUA_API int lua_dump (lua_State *L, lua_Writer writer, void *data) {
+  return lua_dumpx(L, writer, data, 0);
+}
+
+
+LUA_API int lua_dumpx (lua_State *L, lua_Writer writer, void *data,
+                       int options) {
   int status;
   TValue *o;
   lua_lock(L);
   api_checknelems(L, 1);
   o = L->top - 1;
-  if (isLfunction(o))
-    status = luaU_dump(L, clvalue(o)->l.p, writer, data, 0);
+  if (isLfunction(o)) {
+    luaU_materializeall(L, clvalue(o)->l.p);  /* dump whole functions */
+    status = luaU_dump(L, clvalue(o)->l.p, writer, data, options);
+  }
   else
     status = 1;
   lua_unlock(L);
@@ -887,6 +924,28 @@ LUA_API int lua_dump (lua_State *L, lua_Writer writer, void *data) {
 }
 
 
+LUA_API int lua_dumpstate (lua_State *L, lua_Writer writer, void *data) {
+  int status;
+  lua_lock(L);
+  status = luaU_dumpstate(L, writer, data);
+  lua_unlock(L);
+  return status;
+}
+
+
+LUA_API int lua_loadstate (lua_State *L, lua_Reader reader, void *data,
+                           const char *chunkname) {
+  ZIO z;
+  int status;
+  lua_lock(L);
+  if (!chunkname) chunkname = "?";
+  luaZ_init(L, &z, reader, data);
+  status = luaU_loadstate(L, &z, chunkname);
+  lua_unlock(L);
+  return status;
+}
+
+
 LUA_API int  lua_status (lua_State *L) {
   return L->status;
 }
@@ -1036,7 +1095,8 @@ LUA_API void *lua_newuserdata (lua_State *L, size_t size) {
 
 
 
-static const char *aux_upvalue (StkId fi, int n, TValue **val) {
+static const char *aux_upvalue (lua_State *L, StkId fi, int n,
+                                TValue **val) {
   Closure *f;
   if (!ttisfunction(fi)) return NULL;
   f = clvalue(fi);
@@ -1047,6 +1107,7 @@ static const char *aux_upvalue (StkId fi, int n, TValue **val) {
   }
   else {
     Proto *p = f->l.p;
+    luaU_checkdebug(L, p);
     if (!(1 <= n && n <= p->sizeupvalues)) return NULL;
     *val = f->l.upvals[n-1]->v;
     return getstr(p->upvalues[n-1]);
@@ -1058,7 +1119,7 @@ LUA_API const char *lua_getupvalue (lua_State *L, int funcindex, int n) {
   const char *name;
   TValue *val;
   lua_lock(L);
-  name = aux_upvalue(index2adr(L, funcindex), n, &val);
+  name = aux_upvalue(L, index2adr(L, funcindex), n, &val);
   if (name) {
     setobj2s(L, L->top, val);
     api_incr_top(L);
@@ -1075,7 +1136,7 @@ LUA_API const char *lua_setupvalue (lua_State *L, int funcindex, int n) {
   lua_lock(L);
   fi = index2adr(L, funcindex);
   api_checknelems(L, 1);
-  name = aux_upvalue(fi, n, &val);
+  name = aux_upvalue(L, fi, n, &val);
   if (name) {
     L->top--;
     setobj(L, val, L->top);
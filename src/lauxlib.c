@@ -25,6 +25,14 @@
 #include "lauxlib.h"
 
 
+#if defined(LUA_USE_MMAP)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
 #define FREELIST_REF	0	/* free list of references */
 
 
@@ -434,8 +442,18 @@ LUALIB_API char *luaL_prepbuffer (luaL_Buffer *B) {
 
 
 LUALIB_API void luaL_addlstring (luaL_Buffer *B, const char *s, size_t l) {
-  while (l--)
-    luaL_addchar(B, *s++);
+  while (l > 0) {
+    size_t m = bufffree(B);
+    if (m == 0) {  /* buffer full? */
+      luaL_prepbuffer(B);
+      m = LUAL_BUFFERSIZE;
+    }
+    if (m > l) m = l;
+    memcpy(B->p, s, m);
+    B->p += m;
+    s += m;
+    l -= m;
+  }
 }
 
 
@@ -549,11 +567,16 @@ static int errfile (lua_State *L, const char *what, int fnameindex) {
 }
 
 
+static int loadcached (lua_State *L, const char *filename);
+
+
 LUALIB_API int luaL_loadfile (lua_State *L, const char *filename) {
   LoadF lf;
   int status, readstatus;
   int c;
   int fnameindex = lua_gettop(L) + 1;  /* index of filename on the stack */
+  if (filename != NULL && (status = loadcached(L, filename)) >= 0)
+    return status;
   lf.extraline = 0;
   if (filename == NULL) {
     lua_pushliteral(L, "=stdin");
@@ -622,6 +645,537 @@ LUALIB_API int (luaL_loadstring) (lua_State *L, const char *s) {
 }
 
 
+/*
+** Adds a digest, as 64 hexadecimal digits (as printed by luac -k), to
+** the registry table of trusted chunks, whose code is not verified when
+** loaded. Returns 0 if `hex' is not a digest.
+*/
+LUALIB_API int luaL_trustdigest (lua_State *L, const char *hex) {
+  char d[32];
+  int i;
+  for (i = 0; i < 64; i++) {
+    int c = tolower((unsigned char)hex[i]);
+    int v = isdigit(c) ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+    if (v < 0) return 0;
+    if (i % 2 == 0) d[i/2] = (char)(v << 4);
+    else d[i/2] |= (char)v;
+  }
+  if (hex[64] != '\0') return 0;
+  luaL_findtable(L, LUA_REGISTRYINDEX, LUA_TRUSTED, 1);
+  lua_pushlstring(L, d, sizeof(d));
+  lua_pushboolean(L, 1);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  return 1;
+}
+
+
+#if defined(LUA_USE_MMAP)
+
+#define MAPPEDCHUNK	"MAPPEDCHUNK*"
+
+
+typedef struct LoadM {
+  void *addr;
+  size_t size;
+} LoadM;
+
+
+static int mapped_gc (lua_State *L) {
+  LoadM *m = (LoadM *)lua_touserdata(L, 1);
+  if (m->addr != NULL) {
+    munmap(m->addr, m->size);
+    m->addr = NULL;
+  }
+  return 0;
+}
+
+
+/*
+** Pushes a userdata holding the contents of a whole (regular, non-empty)
+** file, mapped read-only, and returns them; on errors, pushes a message
+** and returns NULL. The mapping lives as long as the userdata.
+*/
+LUALIB_API const char *luaL_mapfile (lua_State *L, const char *filename,
+                                     size_t *size) {
+  struct stat st;
+  LoadM *m;
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    lua_pushfstring(L, "cannot open %s: %s", filename, strerror(errno));
+    return NULL;
+  }
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    lua_pushfstring(L, "cannot map %s", filename);
+    return NULL;
+  }
+  m = (LoadM *)lua_newuserdata(L, sizeof(LoadM));
+  m->addr = NULL;
+  m->size = (size_t)st.st_size;
+  if (luaL_newmetatable(L, MAPPEDCHUNK)) {
+    lua_pushcfunction(L, mapped_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+  m->addr = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m->addr == MAP_FAILED) {
+    m->addr = NULL;
+    lua_pop(L, 1);
+    lua_pushfstring(L, "cannot map %s: %s", filename, strerror(errno));
+    return NULL;
+  }
+  *size = m->size;
+  return (const char *)m->addr;
+}
+
+
+/*
+** Maps a whole file and loads it in place: functions from a binary
+** chunk in the extended format keep their code and line information
+** in the (read-only, shared) mapping, which stays alive as long as any
+** of them does.
+*/
+LUALIB_API int luaL_loadmapped (lua_State *L, const char *filename) {
+  const char *p, *end;
+  size_t size;
+  int status;
+  int fnameindex = lua_gettop(L) + 1;  /* index of filename on the stack */
+  lua_pushfstring(L, "@%s", filename);
+  p = luaL_mapfile(L, filename, &size);
+  if (p == NULL) {  /* cannot map it; read it the usual way */
+    lua_pop(L, 2);
+    return luaL_loadfile(L, filename);
+  }
+  end = p + size;
+  if (*p == '#') {  /* Unix exec. file? */
+    while (p < end && *p != '\n') p++;  /* skip first line (keep the '\n') */
+    if (end - p > 1 && p[1] == LUA_SIGNATURE[0]) p++;  /* binary chunk */
+  }
+  status = lua_loadimage(L, p, (size_t)(end - p), lua_tostring(L, fnameindex));
+  lua_remove(L, fnameindex + 1);  /* remove mapping (now owned by results) */
+  lua_remove(L, fnameindex);
+  return status;
+}
+
+
+/*
+** Bytecode cache: when package.bytecodecache names a directory,
+** luaL_loadfile keeps there a dumped copy of each source file it
+** loads, named after a hash of the file's real path. The copy starts
+** with a key line (file name, mtime, size and a hash of the contents)
+** and is used only while that line still matches the source. Copies are
+** written to a temporary file and then renamed, so that concurrent
+** readers never see a partial one.
+*/
+
+#define CACHESIG	"\033LuaC"
+
+
+static unsigned long cachehash (const char *s, size_t l) {
+  unsigned long h = 2166136261UL;  /* FNV-1a */
+  for (; l > 0; l--, s++) h = ((h ^ (unsigned char)*s) * 16777619UL) & 0xFFFFFFFFUL;
+  return h;
+}
+
+
+static int cachewriter (lua_State *L, const void *p, size_t size, void *f) {
+  (void)L;
+  return fwrite(p, 1, size, (FILE *)f) != size;
+}
+
+
+static void writecache (lua_State *L, const char *cachename,
+                        const char *key, size_t keylen) {
+  static const char zeros[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+  size_t l = strlen(cachename);
+  char *tmp = (char *)lua_newuserdata(L, l + sizeof(".XXXXXX"));
+  FILE *f = NULL;
+  int fd, ok;
+  memcpy(tmp, cachename, l);
+  memcpy(tmp + l, ".XXXXXX", sizeof(".XXXXXX"));  /* unique per call */
+  fd = mkstemp(tmp);
+  if (fd != -1 && (f = fdopen(fd, "wb")) == NULL) {
+    close(fd);
+    remove(tmp);
+  }
+  if (f == NULL) { lua_pop(L, 1); return; }  /* cache not writable; ignore */
+  lua_pushvalue(L, -2);  /* function to dump */
+  ok = fwrite(key, 1, keylen, f) == keylen &&
+       fwrite(zeros, 1, (8 - keylen % 8) % 8, f) == (8 - keylen % 8) % 8 &&
+       lua_dumpx(L, cachewriter, f, LUA_DUMP_ALIGN) == 0;
+  lua_pop(L, 1);
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp, cachename) != 0)
+    remove(tmp);
+  lua_pop(L, 1);
+}
+
+
+/*
+** loads `filename' through the cache; returns -1, leaving the stack as
+** it was, when there is no cache or the file is not a source file
+*/
+static int loadcached (lua_State *L, const char *filename) {
+  struct stat st;
+  const char *dir, *p, *end, *key, *cachename;
+  char nums[3*sizeof(unsigned long)*3 + 8];
+  char *real;
+  size_t size, keylen;
+  int status;
+  int base = lua_gettop(L);
+  dir = NULL;
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "package");
+    if (lua_istable(L, -1)) {
+      lua_getfield(L, -1, "bytecodecache");
+      dir = lua_tostring(L, -1);
+    }
+  }
+  if (dir == NULL || *dir == '\0' || stat(filename, &st) == -1 ||
+      (p = luaL_mapfile(L, filename, &size)) == NULL) {
+    lua_settop(L, base);
+    return -1;
+  }
+  end = p + size;
+  if (*p == '#') {  /* Unix exec. file? */
+    while (p < end && *p != '\n') p++;  /* skip first line (keep the '\n') */
+    if (end - p > 1 && p[1] == LUA_SIGNATURE[0]) p++;
+  }
+  if (p < end && *p == LUA_SIGNATURE[0]) {
+    lua_settop(L, base);  /* binary file: nothing to cache */
+    return -1;
+  }
+  sprintf(nums, "%lu %lu %08lx", (unsigned long)st.st_mtime,
+          (unsigned long)size, cachehash(p, (size_t)(end - p)));
+  key = lua_pushfstring(L, CACHESIG " %s %s\n", nums, filename);
+  keylen = lua_strlen(L, -1);
+  real = realpath(filename, NULL);
+  if (real == NULL) cachename = filename;
+  else cachename = real;
+  sprintf(nums, "%08lx", cachehash(cachename, strlen(cachename)));
+  free(real);
+  cachename = lua_pushfstring(L, "%s" LUA_DIRSEP "%s.luac", dir, nums);
+  lua_pushfstring(L, "@%s", filename);
+  {  /* look for a valid copy */
+    size_t csize;
+    int top = lua_gettop(L);
+    const char *c = luaL_mapfile(L, cachename, &csize);
+    size_t skip = (keylen + 7) & ~(size_t)7;
+    if (c != NULL && csize > skip && memcmp(c, key, keylen) == 0 &&
+        lua_loadimage(L, c + skip, csize - skip, lua_tostring(L, top)) == 0) {
+      lua_replace(L, base + 1);  /* function */
+      lua_settop(L, base + 1);  /* mapping is owned by the function */
+      return 0;
+    }
+    lua_settop(L, top);  /* stale or missing copy */
+  }
+  status = luaL_loadbuffer(L, p, (size_t)(end - p), lua_tostring(L, -1));
+  if (status == 0) writecache(L, cachename, key, keylen);
+  lua_replace(L, base + 1);  /* function or error message */
+  lua_settop(L, base + 1);
+  return status;
+}
+
+#else
+
+LUALIB_API const char *luaL_mapfile (lua_State *L, const char *filename,
+                                     size_t *size) {
+  FILE *f = fopen(filename, "rb");
+  char *b;
+  long n;
+  if (f == NULL) {
+    lua_pushfstring(L, "cannot open %s: %s", filename, strerror(errno));
+    return NULL;
+  }
+  if (fseek(f, 0, SEEK_END) != 0 || (n = ftell(f)) <= 0 ||
+      fseek(f, 0, SEEK_SET) != 0) {
+    fclose(f);
+    lua_pushfstring(L, "cannot map %s", filename);
+    return NULL;
+  }
+  b = (char *)lua_newuserdata(L, (size_t)n);
+  if (fread(b, 1, (size_t)n, f) != (size_t)n) {
+    fclose(f);
+    lua_pop(L, 1);
+    lua_pushfstring(L, "cannot read %s", filename);
+    return NULL;
+  }
+  fclose(f);
+  *size = (size_t)n;
+  return b;
+}
+
+
+LUALIB_API int luaL_loadmapped (lua_State *L, const char *filename) {
+  return luaL_loadfile(L, filename);
+}
+
+
+static int loadcached (lua_State *L, const char *filename) {
+  (void)L; (void)filename;
+  return -1;  /* no cache without stat */
+}
+
+#endif
+
+
+/*
+** Shared code images: one in-memory copy of a chunk, reference
+** counted, that any number of states (in any threads) load in place.
+** Each state gets its own Protos, constants and strings, but the code
+** and line information of functions from an extended-format chunk,
+** and the bodies of lazily loaded functions, stay in the image.
+*/
+
+#define SHAREDIMAGE	"SHAREDIMAGE*"
+
+
+struct luaL_Image {
+  long refs;
+  size_t size;
+  union { double d; void *p; long l; } dummy;  /* align the data */
+};
+
+#define imagedata(img)	((const char *)((img) + 1))
+
+
+LUALIB_API luaL_Image *luaL_newimage (const char *buff, size_t size) {
+  luaL_Image *img = (luaL_Image *)malloc(sizeof(luaL_Image) + size);
+  if (img == NULL) return NULL;
+  img->refs = 1;
+  img->size = size;
+  memcpy((char *)(img + 1), buff, size);
+  return img;
+}
+
+
+LUALIB_API void luaL_releaseimage (luaL_Image *img) {
+  if (img != NULL && luai_imageunref(img->refs) == 0)
+    free(img);
+}
+
+
+static int image_gc (lua_State *L) {
+  luaL_Image **pi = (luaL_Image **)lua_touserdata(L, 1);
+  luaL_releaseimage(*pi);
+  *pi = NULL;
+  return 0;
+}
+
+
+LUALIB_API int luaL_loadimage (lua_State *L, luaL_Image *img,
+                               const char *chunkname) {
+  int status;
+  luaL_Image **pi = (luaL_Image **)lua_newuserdata(L, sizeof(luaL_Image *));
+  *pi = NULL;
+  if (luaL_newmetatable(L, SHAREDIMAGE)) {
+    lua_pushcfunction(L, image_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+  luai_imageref(img->refs);
+  *pi = img;
+  status = lua_loadimage(L, imagedata(img), img->size, chunkname);
+  lua_remove(L, -2);  /* remove reference (now owned by results) */
+  return status;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** State images
+** =======================================================
+*/
+
+/*
+** Objects that an image refers to by name, the permanents, are found by
+** walking a state that has just been set up (libraries opened, C
+** functions registered) from the registry, the globals and the basic
+** metatables through string and number keys, metatables, environments and the
+** upvalues of C functions. Names are the paths that lead to the objects,
+** which are the same in every state set up the same way; any path will
+** do, so all of them are kept. Lua functions are not permanents.
+*/
+
+#define P_NAMES		1	/* object -> name */
+#define P_QUEUE		2	/* objects to search */
+#define P_PERMANENTS	3	/* name -> object */
+#define P_OLD		4	/* previous permanents (left out) */
+
+
+/* name the value on the top after the string below it; pops both */
+static void addpermanent (lua_State *L, int base, int *n) {
+  int t = lua_type(L, -1);
+  if ((t == LUA_TTABLE || t == LUA_TUSERDATA || t == LUA_TTHREAD ||
+       lua_iscfunction(L, -1)) && !lua_rawequal(L, -1, base + P_OLD)) {
+    lua_pushvalue(L, -2);
+    lua_rawget(L, base + P_PERMANENTS);
+    if (lua_isnil(L, -1)) {  /* name not taken? */
+      lua_pushvalue(L, -3);
+      lua_pushvalue(L, -3);
+      lua_rawset(L, base + P_PERMANENTS);
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, base + P_NAMES);
+    if (lua_isnil(L, -1)) {  /* first path to this object? */
+      lua_pushvalue(L, -2);
+      lua_pushvalue(L, -4);
+      lua_rawset(L, base + P_NAMES);
+      lua_pushvalue(L, -2);
+      lua_rawseti(L, base + P_QUEUE, ++*n);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 2);
+}
+
+
+/* name what the object at `o' (named `name') refers to */
+static void searchpermanent (lua_State *L, int base, int *n, int o,
+                             const char *name) {
+  if (lua_istable(L, o)) {
+    lua_pushnil(L);
+    while (lua_next(L, o)) {
+      if (lua_type(L, -2) == LUA_TSTRING) {
+        lua_pushfstring(L, "%s.%s", name, lua_tostring(L, -2));
+        lua_insert(L, -2);
+        addpermanent(L, base, n);
+      }
+      else if (lua_type(L, -2) == LUA_TNUMBER) {
+        lua_pushfstring(L, "%s[%f]", name, lua_tonumber(L, -2));
+        lua_insert(L, -2);
+        addpermanent(L, base, n);
+      }
+      else lua_pop(L, 1);
+    }
+  }
+  if (lua_getmetatable(L, o)) {
+    lua_pushfstring(L, "%s#metatable", name);
+    lua_insert(L, -2);
+    addpermanent(L, base, n);
+  }
+  if (lua_iscfunction(L, o)) {
+    int i;
+    for (i = 1; lua_getupvalue(L, o, i) != NULL; i++) {
+      lua_pushfstring(L, "%s#%d", name, i);
+      lua_insert(L, -2);
+      addpermanent(L, base, n);
+    }
+  }
+  if (lua_type(L, o) == LUA_TFUNCTION || lua_type(L, o) == LUA_TUSERDATA) {
+    lua_getfenv(L, o);
+    lua_pushfstring(L, "%s#env", name);
+    lua_insert(L, -2);
+    addpermanent(L, base, n);
+  }
+}
+
+
+/*
+** Sets the registry table LUA_PERMANENTS to name every object reachable
+** in the state as it is now. A state that saves an image and one that
+** loads it must both call this function after the same setup.
+*/
+LUALIB_API void luaL_setpermanents (lua_State *L) {
+  int base = lua_gettop(L);
+  int i, n = 0;
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_getfield(L, LUA_REGISTRYINDEX, LUA_PERMANENTS);
+  lua_pushliteral(L, "_R");
+  lua_pushvalue(L, LUA_REGISTRYINDEX);
+  addpermanent(L, base, &n);
+  lua_pushliteral(L, "_G");
+  lua_pushvalue(L, LUA_GLOBALSINDEX);
+  addpermanent(L, base, &n);
+  lua_pushnil(L);
+  lua_pushboolean(L, 0);
+  lua_pushnumber(L, 0);
+  lua_pushliteral(L, "");
+  lua_pushlightuserdata(L, NULL);
+  for (i = -5; i < 0; i++) {  /* basic metatables */
+    if (lua_getmetatable(L, i)) {
+      lua_pushfstring(L, "_M.%s", luaL_typename(L, i - 1));
+      lua_insert(L, -2);
+      addpermanent(L, base, &n);
+    }
+  }
+  lua_pop(L, 5);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, base + P_QUEUE, i);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, base + P_NAMES);
+    searchpermanent(L, base, &n, lua_gettop(L) - 1, lua_tostring(L, -1));
+    lua_pop(L, 2);
+  }
+  lua_pushvalue(L, base + P_PERMANENTS);
+  lua_setfield(L, LUA_REGISTRYINDEX, LUA_PERMANENTS);
+  lua_settop(L, base);
+}
+
+
+LUALIB_API int luaL_loadstatefile (lua_State *L, const char *filename) {
+  LoadF lf;
+  int status, readstatus;
+  int fnameindex = lua_gettop(L) + 1;  /* index of filename on the stack */
+  lua_pushfstring(L, "@%s", filename);
+  lf.extraline = 0;
+  lf.f = fopen(filename, "rb");
+  if (lf.f == NULL) return errfile(L, "open", fnameindex);
+  status = lua_loadstate(L, getF, &lf, lua_tostring(L, -1));
+  readstatus = ferror(lf.f);
+  fclose(lf.f);
+  if (readstatus) {
+    lua_settop(L, fnameindex);  /* ignore results from `lua_loadstate' */
+    return errfile(L, "read", fnameindex);
+  }
+  lua_remove(L, fnameindex);
+  return status;
+}
+
+
+typedef struct NewState {
+  const char *filename;
+  void (*openlibs) (lua_State *L);
+} NewState;
+
+
+static int newstate (lua_State *L) {
+  NewState *ns = (NewState *)lua_touserdata(L, 1);
+  if (ns->openlibs) ns->openlibs(L);
+  luaL_setpermanents(L);
+  if (luaL_loadstatefile(L, ns->filename) != 0)
+    lua_error(L);
+  return 0;
+}
+
+
+/*
+** Creates a state from an image: `openlibs' (e.g. `luaL_openlibs') must
+** set it up as the state that saved the image was before its
+** permanents were set. Returns NULL on errors.
+*/
+LUALIB_API lua_State *luaL_newstatefromimage (const char *filename,
+                                              void (*openlibs) (lua_State *L)) {
+  NewState ns;
+  lua_State *L = luaL_newstate();
+  if (L == NULL) return NULL;
+  ns.filename = filename;
+  ns.openlibs = openlibs;
+  if (lua_cpcall(L, newstate, &ns) != 0) {
+    lua_close(L);
+    return NULL;
+  }
+  return L;
+}
 
 /* }====================================================== */
 
@@ -78,6 +78,22 @@ LUALIB_API int (luaL_loadfile) (lua_State *L, const char *filename);
 LUALIB_API int (luaL_loadbuffer) (lua_State *L, const char *buff, size_t sz,
                                   const char *name);
 LUALIB_API int (luaL_loadstring) (lua_State *L, const char *s);
+LUALIB_API int (luaL_loadmapped) (lua_State *L, const char *filename);
+LUALIB_API const char *(luaL_mapfile) (lua_State *L, const char *filename,
+                                       size_t *size);
+LUALIB_API int (luaL_trustdigest) (lua_State *L, const char *hex);
+
+typedef struct luaL_Image luaL_Image;
+
+LUALIB_API luaL_Image *(luaL_newimage) (const char *buff, size_t size);
+LUALIB_API void (luaL_releaseimage) (luaL_Image *img);
+LUALIB_API int (luaL_loadimage) (lua_State *L, luaL_Image *img,
+                                 const char *chunkname);
+
+LUALIB_API void (luaL_setpermanents) (lua_State *L);
+LUALIB_API int (luaL_loadstatefile) (lua_State *L, const char *filename);
+LUALIB_API lua_State *(luaL_newstatefromimage) (const char *filename,
+                                    void (*openlibs) (lua_State *L));
 
 LUALIB_API lua_State *(luaL_newstate) (void);
 
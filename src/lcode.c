@@ -256,7 +256,7 @@ int luaK_stringK (FuncState *fs, TString *s) {
 
 int luaK_numberK (FuncState *fs, lua_Number r) {
   TValue o;
-  setnvalue(&o, r);
+  luaO_setnumber(&o, r);
   return addk(fs, &o, &o);
 }
 
@@ -277,6 +277,30 @@ static int nilK (FuncState *fs) {
 }
 
 
+/*
+** replace the code of a constructor, from its OP_NEWTABLE at `pc', by
+** a copy of the template `t'; constants from `nk' on were added by that
+** code only and are dropped
+*/
+void luaK_template (FuncState *fs, int pc, int nk, Table *t) {
+  lua_State *L = fs->L;
+  int a = GETARG_A(fs->f->code[pc]);
+  TValue o;
+  while (fs->nk > nk) {
+    TValue *k = &fs->f->k[--fs->nk];
+    if (ttisnil(k)) {  /* see `nilK' */
+      sethvalue(L, &o, fs->h);
+    }
+    else setobj(L, &o, k);
+    setnilvalue(luaH_set(L, fs->h, &o));
+    setnilvalue(k);
+  }
+  fs->pc = pc;
+  sethvalue(L, &o, t);
+  luaK_codeABx(fs, OP_TEMPLATE, a, addk(fs, &o, &o));
+}
+
+
 void luaK_setreturns (FuncState *fs, expdesc *e, int nresults) {
   if (e->k == VCALL) {  /* expression is an open function call? */
     SETARG_C(getcode(fs, e), nresults+1);
@@ -20,12 +20,14 @@
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
+#include "lmem.h"
 #include "lobject.h"
 #include "lopcodes.h"
 #include "lstate.h"
 #include "lstring.h"
 #include "ltable.h"
 #include "ltm.h"
+#include "lundump.h"
 #include "lvm.h"
 
 
@@ -45,13 +47,18 @@ static int currentline (lua_State *L, CallInfo *ci) {
   int pc = currentpc(L, ci);
   if (pc < 0)
     return -1;  /* only active lua functions have current-line information */
-  else
-    return getline(ci_func(ci)->l.p, pc);
+  else {
+    Proto *p = ci_func(ci)->l.p;
+    luaU_checkdebug(L, p);
+    return getline(p, pc);
+  }
 }
 
 
 /*
-** this function can be called asynchronous (e.g. during a signal)
+** this function can be called asynchronous (e.g. during a signal);
+** a running interpreter sees new line and count hooks only at its
+** next safe point (a jump, a call or a return; see `dojump' in lvm.c)
 */
 LUA_API int lua_sethook (lua_State *L, lua_Hook func, int mask, int count) {
   if (func == NULL || mask == 0) {  /* turn off hooks? */
@@ -112,6 +119,7 @@ static Proto *getluaproto (CallInfo *ci) {
 static const char *findlocal (lua_State *L, CallInfo *ci, int n) {
   const char *name;
   Proto *fp = getluaproto(ci);
+  if (fp) luaU_checkdebug(L, fp);
   if (fp && (name = luaF_getlocalname(fp, n, currentpc(L, ci))) != NULL)
     return name;  /* is a local variable in a Lua function */
   else {
@@ -179,9 +187,12 @@ static void collectvalidlines (lua_State *L, Closure *f) {
     setnilvalue(L->top);
   }
   else {
-    Table *t = luaH_new(L, 0, 0);
-    int *lineinfo = f->l.p->lineinfo;
+    Table *t;
+    int *lineinfo;
     int i;
+    luaU_checkdebug(L, f->l.p);
+    t = luaH_new(L, 0, 0);
+    lineinfo = f->l.p->lineinfo;
     for (i=0; i<f->l.p->sizelineinfo; i++)
       setbvalue(luaH_setnum(L, t, lineinfo[i]), 1);
     sethvalue(L, L->top, t); 
@@ -306,25 +317,48 @@ static int checkArgMode (const Proto *pt, int r, enum OpArgMask mode) {
     case OpArgN: check(r == 0); break;
     case OpArgU: break;
     case OpArgR: checkreg(pt, r); break;
-    case OpArgK:
-      check(ISK(r) ? INDEXK(r) < pt->sizek : r < pt->maxstacksize);
+    case OpArgK:  /* (table templates are only for OP_TEMPLATE) */
+      check(ISK(r) ? INDEXK(r) < pt->sizek && !ttistable(&pt->k[INDEXK(r)])
+                   : r < pt->maxstacksize);
       break;
   }
   return 1;
 }
 
 
-static Instruction symbexec (const Proto *pt, int lastpc, int reg) {
+/*
+** The code checker makes one forward pass over the code and, on the way,
+** records in `trace' the instruction symbolic execution runs just
+** before each one: the path to an instruction starts at the beginning and
+** takes the forward jumps that do not go past it. `skip[pc]' is the
+** nearest target of the forward jumps left untaken on the path to `pc';
+** that path goes on from `pc' to an instruction only if it is before
+** `skip[pc]'. `target[pc]' tells whether a forward jump goes to `pc'.
+*/
+
+#define TRACE_START	(-1)	/* first instruction */
+#define TRACE_NONE	(-2)	/* not on any path */
+#define TRACE_COUNT	(-3)	/* count of a setlist, not an instruction */
+
+static int scan (const Proto *pt, int *trace, int *skip, int *target) {
+  int n = pt->sizecode;
   int pc;
-  int last;  /* stores position of last instruction that changed `reg' */
-  last = pt->sizecode-1;  /* points to final return (a `neutral' instruction) */
+  for (pc = 0; pc < n; pc++) {
+    trace[pc] = TRACE_NONE;
+    skip[pc] = 0;  /* not reached (yet) */
+    target[pc] = 0;
+  }
   check(precheck(pt));
-  for (pc = 0; pc < lastpc; pc++) {
+  trace[0] = TRACE_START;
+  skip[0] = n;
+  for (pc = 0; pc < n; pc++) {
     Instruction i = pt->code[pc];
     OpCode op = GET_OPCODE(i);
     int a = GETARG_A(i);
     int b = 0;
     int c = 0;
+    int next = pc+1;  /* next instruction on a path through `pc' */
+    int dest = -1;  /* target of a jump */
     check(op < NUM_OPCODES);
     checkreg(pt, a);
     switch (getOpMode(op)) {
@@ -337,53 +371,37 @@ static Instruction symbexec (const Proto *pt, int lastpc, int reg) {
       }
       case iABx: {
         b = GETARG_Bx(i);
-        if (getBMode(op) == OpArgK) check(b < pt->sizek);
+        if (getBMode(op) == OpArgK) {
+          check(b < pt->sizek);
+          check(ttistable(&pt->k[b]) == (op == OP_TEMPLATE));
+        }
         break;
       }
       case iAsBx: {
         b = GETARG_sBx(i);
         if (getBMode(op) == OpArgR) {
-          int dest = pc+1+b;
-          check(0 <= dest && dest < pt->sizecode);
-          if (dest > 0) {
-            int j;
-            /* check that it does not jump to a setlist count; this
-               is tricky, because the count from a previous setlist may
-               have the same value of an invalid setlist; so, we must
-               go all the way back to the first of them (if any) */
-            for (j = 0; j < dest; j++) {
-              Instruction d = pt->code[dest-1-j];
-              if (!(GET_OPCODE(d) == OP_SETLIST && GETARG_C(d) == 0)) break;
-            }
-            /* if 'j' is even, previous value is not a setlist (even if
-               it looks like one) */
-            check((j&1) == 0);
-          }
+          dest = pc+1+b;
+          check(0 <= dest && dest < n);
+          /* it cannot jump to a setlist count */
+          if (dest > pc) target[dest] = 1;
+          else check(trace[dest] != TRACE_COUNT);
         }
         break;
       }
     }
-    if (testAMode(op)) {
-      if (a == reg) last = pc;  /* change register `a' */
-    }
     if (testTMode(op)) {
-      check(pc+2 < pt->sizecode);  /* check skip */
+      check(pc+2 < n);  /* check skip */
       check(GET_OPCODE(pt->code[pc+1]) == OP_JMP);
     }
     switch (op) {
       case OP_LOADBOOL: {
         if (c == 1) {  /* does it jump? */
-          check(pc+2 < pt->sizecode);  /* check its jump */
+          check(pc+2 < n);  /* check its jump */
           check(GET_OPCODE(pt->code[pc+1]) != OP_SETLIST ||
                 GETARG_C(pt->code[pc+1]) != 0);
         }
         break;
       }
-      case OP_LOADNIL: {
-        if (a <= reg && reg <= b)
-          last = pc;  /* set registers from `a' to `b' */
-        break;
-      }
       case OP_GETUPVAL:
       case OP_SETUPVAL: {
         check(b < pt->nups);
@@ -396,7 +414,6 @@ static Instruction symbexec (const Proto *pt, int lastpc, int reg) {
       }
       case OP_SELF: {
         checkreg(pt, a+1);
-        if (reg == a+1) last = pc;
         break;
       }
       case OP_CONCAT: {
@@ -406,18 +423,11 @@ static Instruction symbexec (const Proto *pt, int lastpc, int reg) {
       case OP_TFORLOOP: {
         check(c >= 1);  /* at least one result (control variable) */
         checkreg(pt, a+2+c);  /* space for results */
-        if (reg >= a+2) last = pc;  /* affect all regs above its base */
         break;
       }
       case OP_FORLOOP:
-      case OP_FORPREP:
+      case OP_FORPREP: {
         checkreg(pt, a+3);
-        /* go through */
-      case OP_JMP: {
-        int dest = pc+1+b;
-        /* not full check and jump is forward and do not skip `lastpc'? */
-        if (reg != NO_REG && pc < dest && dest <= lastpc)
-          pc += b;  /* do the jump */
         break;
       }
       case OP_CALL:
@@ -431,7 +441,6 @@ static Instruction symbexec (const Proto *pt, int lastpc, int reg) {
         }
         else if (c != 0)
           checkreg(pt, a+c-1);
-        if (reg >= a) last = pc;  /* affect all registers above base */
         break;
       }
       case OP_RETURN: {
@@ -442,8 +451,9 @@ static Instruction symbexec (const Proto *pt, int lastpc, int reg) {
       case OP_SETLIST: {
         if (b > 0) checkreg(pt, a + b);
         if (c == 0) {
-          pc++;
-          check(pc < pt->sizecode - 1);
+          check(pc+1 < n-1);
+          check(!target[pc+1]);
+          next = pc+2;
         }
         break;
       }
@@ -451,13 +461,12 @@ static Instruction symbexec (const Proto *pt, int lastpc, int reg) {
         int nup, j;
         check(b < pt->sizep);
         nup = pt->p[b]->nups;
-        check(pc + nup < pt->sizecode);
+        check(pc + nup < n);
         for (j = 1; j <= nup; j++) {
           OpCode op1 = GET_OPCODE(pt->code[pc + j]);
           check(op1 == OP_GETUPVAL || op1 == OP_MOVE);
         }
-        if (reg != NO_REG)  /* tracing? */
-          pc += nup;  /* do not 'execute' these pseudo-instructions */
+        next = pc+1+nup;  /* paths do not go through the pseudo-instructions */
         break;
       }
       case OP_VARARG: {
@@ -470,21 +479,81 @@ static Instruction symbexec (const Proto *pt, int lastpc, int reg) {
       }
       default: break;
     }
+    if (skip[pc] > pc) {  /* on a path? */
+      if (pc < dest && dest < skip[pc]) {  /* paths to `dest' take the jump */
+        trace[dest] = pc;
+        skip[dest] = skip[pc];
+      }
+      if (next < n && next < skip[pc] && next != dest) {
+        trace[next] = pc;
+        skip[next] = (next < dest && dest < skip[pc]) ? dest : skip[pc];
+      }
+    }
+    if (op == OP_SETLIST && next == pc+2)
+      trace[++pc] = TRACE_COUNT;  /* skip count */
   }
-  return pt->code[last];
+  return 1;
 }
 
 #undef check
 #undef checkjump
 #undef checkreg
 
-/* }====================================================== */
+
+/*
+** check the code of `pt'; the paths it finds are dropped, as most
+** prototypes never need them (`lastchange' rebuilds them on demand)
+*/
+int luaG_checkcode (lua_State *L, Proto *pt) {
+  int n = pt->sizecode;
+  int *aux = luaM_newvector(L, 3*n, int);
+  int ok = scan(pt, aux, aux + n, aux + 2*n);
+  luaM_freearray(L, aux, 3*n, int);
+  return ok;
+}
+
+
+/* record in `pt->trace' the paths of symbolic execution through `pt' */
+static void buildtrace (lua_State *L, Proto *pt) {
+  int n = pt->sizecode;
+  int *aux;
+  pt->trace = luaM_newvector(L, n, int);
+  aux = luaM_newvector(L, 2*n, int);
+  scan(pt, pt->trace, aux, aux + n);
+  luaM_freearray(L, aux, 2*n, int);
+}
+
+
+/* does instruction `i' change register `reg'? */
+static int changes (Instruction i, int reg) {
+  int a = GETARG_A(i);
+  switch (GET_OPCODE(i)) {
+    case OP_LOADNIL: return (a <= reg && reg <= GETARG_B(i));
+    case OP_SELF: return (reg == a || reg == a+1);
+    case OP_TFORLOOP: return (reg >= a+2);
+    case OP_CALL: case OP_TAILCALL: return (reg >= a);
+    default: return (testAMode(GET_OPCODE(i)) && reg == a);
+  }
+}
 
 
-int luaG_checkcode (const Proto *pt) {
-  return (symbexec(pt, pt->sizecode, NO_REG) != 0);
+/*
+** last instruction that changed register `reg' on the path to `lastpc'
+** (or the final return, a `neutral' instruction, if none did)
+*/
+static Instruction lastchange (lua_State *L, Proto *p, int lastpc, int reg) {
+  int pc;
+  if (p->trace == NULL)
+    buildtrace(L, p);
+  for (pc = p->trace[lastpc]; pc >= 0; pc = p->trace[pc]) {
+    if (changes(p->code[pc], reg))
+      return p->code[pc];
+  }
+  return p->code[p->sizecode-1];
 }
 
+/* }====================================================== */
+
 
 static const char *kname (Proto *p, int c) {
   if (ISK(c) && ttisstring(&p->k[INDEXK(c)]))
@@ -500,10 +569,11 @@ static const char *getobjname (lua_State *L, CallInfo *ci, int stackpos,
     Proto *p = ci_func(ci)->l.p;
     int pc = currentpc(L, ci);
     Instruction i;
+    luaU_checkdebug(L, p);
     *name = luaF_getlocalname(p, stackpos+1, pc);
     if (*name)  /* is a local? */
       return "local";
-    i = symbexec(p, pc, stackpos);  /* try symbolic execution */
+    i = lastchange(L, p, pc, stackpos);  /* try symbolic execution */
     lua_assert(pc != -1);
     switch (GET_OPCODE(i)) {
       case OP_GETGLOBAL: {
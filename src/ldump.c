@@ -17,23 +17,54 @@
 
 #include "lobject.h"
 #include "lstate.h"
+#include "ltable.h"
 #include "lundump.h"
 
 #include "ldo.h"
 #include "lmem.h"
 
+/*
+* string pool of the extended format: every string of the chunk is
+* written once, right after the header, and referred to elsewhere by its
+* index plus one (zero stands for NULL)
+*/
 typedef struct {
+    const TString** strings;	/* in order of first use */
+    int n;
+    int size;			/* size of `strings' */
+    int* slots;			/* hash of indices into `strings' (-1: free) */
+    int sizeslots;		/* power of 2, at least twice `n' */
+} StringPool;
+
+/* output is coalesced into blocks of this size before reaching the writer */
+#define DUMPBUFFER	8192
+
+typedef struct DumpState {
  lua_State* L;
  lua_Writer writer;
  void* data;
  int strip;
  int status;
+ char* buff;			/* output not yet given to the writer */
+ size_t n;			/* bytes in `buff' */
+ int extended;			/* extended portable format? */
+ int options;			/* options for the extended header */
+ size_t pos;			/* bytes written so far */
+ StringPool* pool;		/* string pool (or NULL) */
+ Sha256* sha;			/* hash of what is written (or NULL) */
+ int ndebug;			/* index of the next debug record */
+ /* writers for the byte order of this machine (see setup_dump_funcs) */
+ void (*dump_int)(int x, struct DumpState* D);
+ void (*dump_size_t)(size_t x, struct DumpState* D);
+ void (*dump_number)(lua_Number x, struct DumpState* D);
+ void (*dump_int_vector)(const void* b, int n, size_t size, struct DumpState* D);
+ void (*dump_code_vector)(const void* b, int n, struct DumpState* D);
 } DumpState;
 
 #define DumpMem(b,n,size,D) DumpBlock(b,(n)*(size),D)
 #define DumpVar(x,D)        DumpMem(&x,1,sizeof(x),D)
 
-static void DumpBlock(const void* b, size_t size, DumpState* D)
+static void DumpWrite(const void* b, size_t size, DumpState* D)
 {
  if (D->status==0)
  {
@@ -43,6 +74,29 @@ static void DumpBlock(const void* b, size_t size, DumpState* D)
  }
 }
 
+static void DumpFlush(DumpState* D)
+{
+ if (D->n>0) DumpWrite(D->buff,D->n,D);
+ D->n=0;
+}
+
+static void DumpBlock(const void* b, size_t size, DumpState* D)
+{
+ if (D->status==0)
+ {
+  if (D->n+size>DUMPBUFFER) DumpFlush(D);
+  if (size>=DUMPBUFFER)
+   DumpWrite(b,size,D);		/* too large to be worth copying */
+  else if (size>0)
+  {
+   memcpy(D->buff+D->n,b,size);
+   D->n+=size;
+  }
+ }
+ if (D->sha!=NULL) luaU_sha256update(D->sha,b,size);
+ D->pos+=size;
+}
+
 static void DumpChar(int y, DumpState* D)
 {
  char x=(char)y;
@@ -84,32 +138,56 @@ static void DumpString(const TString* s, DumpState* D)
 
 static void DumpFunction(const Proto* f, const TString* p, DumpState* D);
 
-static void DumpConstants(const Proto* f, DumpState* D)
+static void DumpConstant(const TValue* o, DumpState* D);
+
+/* table template: sizes, array part, non-nil pairs of the hash part */
+static void DumpTable(const Table* t, DumpState* D)
 {
- int i,n=f->sizek;
+ int i,n=0,size=sizenode(t);
+ for (i=0; i<size; i++) if (!ttisnil(gval(gnode(t,i)))) n++;
+ DumpInt(t->sizearray,D);
+ DumpInt(n>0 ? size : 0,D);
  DumpInt(n,D);
- for (i=0; i<n; i++)
+ for (i=0; i<t->sizearray; i++) DumpConstant(&t->array[i],D);
+ for (i=0; i<size; i++)
  {
-  const TValue* o=&f->k[i];
-  DumpChar(ttype(o),D);
-  switch (ttype(o))
-  {
-   case LUA_TNIL:
-    break;
-   case LUA_TBOOLEAN:
-    DumpChar(bvalue(o),D);
-    break;
-   case LUA_TNUMBER:
-    DumpNumber(nvalue(o),D);
-    break;
-   case LUA_TSTRING:
-    DumpString(rawtsvalue(o),D);
-    break;
-   default:
-    lua_assert(0);          /* cannot happen */
-    break;
-  }
+  const Node* node=gnode(t,i);
+  if (ttisnil(gval(node))) continue;
+  DumpConstant(key2tval(node),D);
+  DumpConstant(gval(node),D);
  }
+}
+
+static void DumpConstant(const TValue* o, DumpState* D)
+{
+ DumpChar(ttype(o),D);
+ switch (ttype(o))
+ {
+  case LUA_TNIL:
+   break;
+  case LUA_TBOOLEAN:
+   DumpChar(bvalue(o),D);
+   break;
+  case LUA_TNUMBER:
+   DumpNumber(nvalue(o),D);
+   break;
+  case LUA_TSTRING:
+   DumpString(rawtsvalue(o),D);
+   break;
+  case LUA_TTABLE:
+   DumpTable(hvalue(o),D);
+   break;
+  default:
+   lua_assert(0);          /* cannot happen */
+   break;
+ }
+}
+
+static void DumpConstants(const Proto* f, DumpState* D)
+{
+ int i,n=f->sizek;
+ DumpInt(n,D);
+ for (i=0; i<n; i++) DumpConstant(&f->k[i],D);
  n=f->sizep;
  DumpInt(n,D);
  for (i=0; i<n; i++) DumpFunction(f->p[i],f->source,D);
@@ -147,11 +225,12 @@ static void DumpFunction(const Proto* f, const TString* p, DumpState* D)
  DumpDebug(f,D);
 }
 
-static void (*dump_int)(int x, DumpState* D) = NULL;
-static void (*dump_size_t)(size_t x, DumpState* D) = NULL;
-static void (*dump_number)(lua_Number x, DumpState* D) = NULL;
-static void (*dump_int_vector)(const void* b, int n, size_t size, DumpState* D) = NULL;
-static void (*dump_code_vector)(const void* b, int n, DumpState* D) = NULL;
+/* kept in the DumpState, as threads may dump at the same time (luac -j) */
+#define dump_int(x,D)			((D)->dump_int(x,D))
+#define dump_size_t(x,D)		((D)->dump_size_t(x,D))
+#define dump_number(x,D)		((D)->dump_number(x,D))
+#define dump_int_vector(b,n,size,D)	((D)->dump_int_vector(b,n,size,D))
+#define dump_code_vector(b,n,D)		((D)->dump_code_vector(b,n,D))
 
 static void dump_int_o(int i, DumpState* D) {
     int32_t x = (int32_t)i;
@@ -191,19 +270,178 @@ static void dump_number_s(lua_Number n, DumpState* D) {
     DumpBlock(&du.u, 8, D);
 }
 
+static void dump_varint(size_t x, DumpState* D) {
+    unsigned char b[(sizeof(size_t)*8+6)/7];
+    int n = 0;
+    while (x >= 0x80) {
+        b[n++] = (unsigned char)(x | 0x80);
+        x >>= 7;
+    }
+    b[n++] = (unsigned char)x;
+    DumpBlock(b, n, D);
+}
+
+/*
+* in the compact format, ints are LEB128 varints and signed differences
+* are zig-zag coded first, so that small magnitudes take one byte
+*/
+static void dump_integer(int x, DumpState* D) {
+    if (D->options & LUAC_X_COMPACT) {
+        dump_varint((size_t)(unsigned int)x, D);
+    } else {
+        dump_int(x, D);
+    }
+}
+
+static void dump_delta(int x, int prev, DumpState* D) {
+    int32_t d = (int32_t)((uint32_t)x - (uint32_t)prev);
+    dump_varint((size_t)(((uint32_t)d << 1) ^ (uint32_t)(d >> 31)), D);
+}
+
+static int pool_slot(const StringPool* P, const TString* s) {
+    int i = (int)(s->tsv.hash & (unsigned int)(P->sizeslots - 1));
+    while (P->slots[i] != -1 && P->strings[P->slots[i]] != s) {
+        i = (i + 1) & (P->sizeslots - 1);
+    }
+    return i;
+}
+
+static void pool_add(DumpState* D, const TString* s) {
+    StringPool* P = D->pool;
+    int i;
+    if (s == NULL) {
+        return;
+    }
+    if (2 * (P->n + 1) > P->sizeslots) {  /* rehash */
+        int j, oldsize = P->sizeslots;
+        int* old = P->slots;
+        P->sizeslots = (oldsize == 0) ? 64 : 2 * oldsize;
+        P->slots = luaM_newvector(D->L, P->sizeslots, int);
+        for (j = 0; j < P->sizeslots; j++) P->slots[j] = -1;
+        for (j = 0; j < P->n; j++) P->slots[pool_slot(P, P->strings[j])] = j;
+        luaM_freearray(D->L, old, oldsize, int);
+    }
+    i = pool_slot(P, s);
+    if (P->slots[i] == -1) {
+        luaM_growvector(D->L, P->strings, P->n, P->size, const TString*,
+                        MAX_INT, "strings in pool");
+        P->slots[i] = P->n;
+        P->strings[P->n++] = s;
+    }
+}
+
+static void collect_constant(const TValue* o, DumpState* D) {
+    if (ttisstring(o)) {
+        pool_add(D, rawtsvalue(o));
+    }
+    else if (ttistable(o)) {
+        const Table* t = hvalue(o);
+        int i;
+        for (i = 0; i < t->sizearray; i++) {
+            collect_constant(&t->array[i], D);
+        }
+        for (i = 0; i < sizenode(t); i++) {
+            const Node* n = gnode(t, i);
+            if (!ttisnil(gval(n))) {
+                collect_constant(key2tval(n), D);
+                collect_constant(gval(n), D);
+            }
+        }
+    }
+}
+
+/* visit strings in the same order dump_function writes them */
+static void collect_strings(const Proto* f, const TString* p, DumpState* D) {
+    int i;
+    if (!(f->source==p || D->strip)) {
+        pool_add(D, f->source);
+    }
+    for (i = 0; i < f->sizek; i++) {
+        collect_constant(&f->k[i], D);
+    }
+    for (i = 0; i < f->sizep; i++) {
+        collect_strings(f->p[i], f->source, D);
+    }
+    if (!D->strip) {
+        for (i = 0; i < f->sizelocvars; i++) {
+            pool_add(D, f->locvars[i].varname);
+        }
+        for (i = 0; i < f->sizeupvalues; i++) {
+            pool_add(D, f->upvalues[i]);
+        }
+    }
+}
+
+/*
+* with LUAC_X_HASHES, each string is preceded by its hash, so that the
+* loader need not compute it (see luaS_newhlstr in lstring.c)
+*/
+static void dump_hash(const TString* s, DumpState* D) {
+    if (D->options & LUAC_X_HASHES) {
+        unsigned char b[4];
+        lu_int32 h = (lu_int32)s->tsv.hash;
+        b[0] = (unsigned char)h;
+        b[1] = (unsigned char)(h >> 8);
+        b[2] = (unsigned char)(h >> 16);
+        b[3] = (unsigned char)(h >> 24);
+        DumpBlock(b, 4, D);
+    }
+}
+
+static void dump_pool(const Proto* f, DumpState* D) {
+    int i;
+    collect_strings(f, NULL, D);
+    dump_varint((size_t)D->pool->n, D);
+    for (i = 0; i < D->pool->n; i++) {
+        const TString* s = D->pool->strings[i];
+        dump_varint(s->tsv.len, D);
+        dump_hash(s, D);
+        DumpBlock(getstr(s), s->tsv.len, D);
+    }
+}
+
 static void dump_string(const TString* s, DumpState* D) {
+    if (D->pool != NULL) {
+        StringPool* P = D->pool;
+        dump_varint((s == NULL) ? 0 : (size_t)P->slots[pool_slot(P, s)] + 1, D);
+        return;
+    }
+    if (D->options & LUAC_X_COMPACT) {  /* no trailing '\0' */
+        if (s==NULL) {
+            dump_varint(0, D);
+        } else {
+            dump_varint(s->tsv.len+1, D);
+            dump_hash(s, D);
+            DumpBlock(getstr(s), s->tsv.len, D);
+        }
+        return;
+    }
     if (s==NULL || getstr(s)==NULL) {
         size_t size = 0;
         dump_size_t(size,D);
     } else {
         size_t size=s->tsv.len+1;
         dump_size_t(size,D);
+        dump_hash(s,D);
         DumpBlock(getstr(s),size,D);
     }
 }
 
+/*
+* in the extended format, vectors of 4-byte items start at offsets that
+* are multiples of 4 from the beginning of the chunk, so that a loader
+* can use them in place
+*/
+static void dump_align(DumpState* D) {
+    static const char zeros[4] = { 0, 0, 0, 0 };
+    if (D->extended && (D->pos & 3) != 0) {
+        DumpBlock(zeros, 4 - (D->pos & 3), D);
+    }
+}
+
 static void dump_int_vector_o(const void *b, int n, size_t size, DumpState* D) {
-    dump_int_o(n, D);
+    dump_integer(n, D);
+    dump_align(D);
 
     if (size == 4) {
         DumpBlock(b, n * 4, D);
@@ -218,22 +456,48 @@ static void dump_int_vector_o(const void *b, int n, size_t size, DumpState* D) {
     }
 }
 
-static void dump_int_vector_s(const void *b, int n, size_t size, DumpState* D) {
-    const int * s = (const int *)b;
-    int32_t * d = luaM_newvector(D->L, n, int32_t);
+/*
+* a swapped vector goes out through a small buffer on the C stack, a
+* slice at a time, instead of through a swapped copy of the whole vector
+*/
+#define SWAPSLICE 256
+
+static void dump_swapped(const lu_int32* s, int n, DumpState* D) {
+    lu_int32 d[SWAPSLICE];
+    while (n > 0) {
+        int m = (n < SWAPSLICE) ? n : SWAPSLICE;
+        luaU_swap4(d, s, (size_t)m);
+        DumpBlock(d, m * 4, D);
+        s += m;
+        n -= m;
+    }
+}
 
-    dump_int_s(n, D);
+static void dump_int_vector_s(const void *b, int n, size_t size, DumpState* D) {
+    dump_integer(n, D);
+    dump_align(D);
 
-    for (int i = 0; i < n; i++) {
-        d[i] = BSWAP_32(s[i]);
+    if (size == 4) {
+        dump_swapped((const lu_int32 *)b, n, D);
+    } else {
+        const int * ip = (const int *)b;
+        lu_int32 d[SWAPSLICE];
+        while (n > 0) {
+            int m = (n < SWAPSLICE) ? n : SWAPSLICE;
+            for (int i = 0; i < m; i++) {
+                d[i] = (lu_int32)ip[i];
+            }
+            luaU_swap4(d, d, (size_t)m);
+            DumpBlock(d, m * 4, D);
+            ip += m;
+            n -= m;
+        }
     }
-
-    DumpBlock(d, n * 4, D);
-    luaM_freearray(D->L, d, n, int32_t);
 }
 
 static void dump_code_vector_o(const void *b, int n, DumpState* D) {
-    dump_int_o(n, D);
+    dump_integer(n, D);
+    dump_align(D);
 
     if (sizeof(Instruction) == 4) {
         DumpBlock(b, n * 4, D);
@@ -249,114 +513,271 @@ static void dump_code_vector_o(const void *b, int n, DumpState* D) {
 }
 
 static void dump_code_vector_s(const void *b, int n, DumpState* D) {
-    const Instruction * s = (const Instruction *)b;
-    int32_t * d = luaM_newvector(D->L, n, int32_t);
-    dump_int_s(n, D);
-    for (int i = 0; i < n; i++) {
-        d[i] = BSWAP_32(s[i]);
+    dump_integer(n, D);
+    dump_align(D);
+
+    if (sizeof(Instruction) == 4) {
+        dump_swapped((const lu_int32 *)b, n, D);
+    } else {
+        const Instruction * ip = (const Instruction *)b;
+        lu_int32 d[SWAPSLICE];
+        while (n > 0) {
+            int m = (n < SWAPSLICE) ? n : SWAPSLICE;
+            for (int i = 0; i < m; i++) {
+                d[i] = (lu_int32)ip[i];
+            }
+            luaU_swap4(d, d, (size_t)m);
+            DumpBlock(d, m * 4, D);
+            ip += m;
+            n -= m;
+        }
     }
-    DumpBlock(d, n * 4, D);
-    luaM_freearray(D->L, d, n, int32_t);
 }
 
 static void setup_dump_funcs(DumpState* D) {
-    if (dump_int == NULL) {
-        int x = 0x1;
-        if (*(int8_t *)&x) {
-            dump_int         = dump_int_o;
-            dump_size_t      = dump_size_t_o;
-            dump_int_vector  = dump_int_vector_o;
-            dump_code_vector = dump_code_vector_o;
-        } else {
-            dump_int         =  dump_int_s;
-            dump_size_t      =  dump_size_t_s;
-            dump_int_vector  =  dump_int_vector_s;
-            dump_code_vector =  dump_code_vector_s;
-        }
+    int x = 0x1;
+    double d = 1.2344999991522893623141499119810760021209716796875;
+    if (*(int8_t *)&x) {
+        D->dump_int         = dump_int_o;
+        D->dump_size_t      = dump_size_t_o;
+        D->dump_int_vector  = dump_int_vector_o;
+        D->dump_code_vector = dump_code_vector_o;
+    } else {
+        D->dump_int         =  dump_int_s;
+        D->dump_size_t      =  dump_size_t_s;
+        D->dump_int_vector  =  dump_int_vector_s;
+        D->dump_code_vector =  dump_code_vector_s;
     }
 
-    if (dump_number == NULL) {
-        double d = 1.2344999991522893623141499119810760021209716796875;
-        if (memcmp(&d, "\x78\x56\x34\x12\x83\xC0\xF3\x3F", 8) == 0) {
-            dump_number = dump_number_o;
-        } else if (memcmp(&d, "\x3F\xF3\xC0\x83\x12\x34\x56\x78", 8) == 0) {
-            dump_number = dump_number_s;
-        } else {
-            luaO_pushfstring(D->L,"dump: unknown number format");
-            luaD_throw(D->L, LUA_ERRERR);
-        }
+    if (memcmp(&d, "\x78\x56\x34\x12\x83\xC0\xF3\x3F", 8) == 0) {
+        D->dump_number = dump_number_o;
+    } else if (memcmp(&d, "\x3F\xF3\xC0\x83\x12\x34\x56\x78", 8) == 0) {
+        D->dump_number = dump_number_s;
+    } else {
+        luaO_pushfstring(D->L,"dump: unknown number format");
+        luaD_throw(D->L, LUA_ERRERR);
     }
 }
 
 static void dump_function(const Proto* f, const TString* p, DumpState* D);
 
+static void dump_constant(const TValue* o, DumpState* D);
+
+/* table template, laid out as in DumpTable */
+static void dump_table(const Table* t, DumpState* D) {
+    int i, n = 0, size = sizenode(t);
+    for (i = 0; i < size; i++) {
+        if (!ttisnil(gval(gnode(t, i)))) n++;
+    }
+    dump_integer(t->sizearray, D);
+    dump_integer(n > 0 ? size : 0, D);
+    dump_integer(n, D);
+    for (i = 0; i < t->sizearray; i++) {
+        dump_constant(&t->array[i], D);
+    }
+    for (i = 0; i < size; i++) {
+        const Node* node = gnode(t, i);
+        if (!ttisnil(gval(node))) {
+            dump_constant(key2tval(node), D);
+            dump_constant(gval(node), D);
+        }
+    }
+}
+
+static void dump_constant(const TValue* o, DumpState* D) {
+    DumpChar(ttype(o),D);
+    switch (ttype(o)) {
+        case LUA_TNIL:
+            break;
+        case LUA_TBOOLEAN:
+            DumpChar(bvalue(o),D);
+            break;
+        case LUA_TNUMBER:
+            dump_number(nvalue(o),D);
+            break;
+        case LUA_TSTRING:
+            dump_string(rawtsvalue(o),D);
+            break;
+        case LUA_TTABLE:
+            dump_table(hvalue(o),D);
+            break;
+        default:
+            lua_assert(0);          /* cannot happen */
+            break;
+    }
+}
+
 static void dump_constants(const Proto* f, DumpState* D) {
     int i,n=f->sizek;
 
-    dump_int(n,D);
+    dump_integer(n,D);
 
     for (i=0; i<n; i++) {
-        const TValue* o=&f->k[i];
-        DumpChar(ttype(o),D);
-        switch (ttype(o)) {
-            case LUA_TNIL:
-                break;
-            case LUA_TBOOLEAN:
-                DumpChar(bvalue(o),D);
-                break;
-            case LUA_TNUMBER:
-                dump_number(nvalue(o),D);
-                break;
-            case LUA_TSTRING:
-                dump_string(rawtsvalue(o),D);
-                break;
-            default:
-                lua_assert(0);          /* cannot happen */
-                break;
-        }
+        dump_constant(&f->k[i],D);
     }
     n=f->sizep;
-    dump_int(n,D);
+    dump_integer(n,D);
     for (i=0; i<n; i++) {
         dump_function(f->p[i], f->source, D);
     }
 }
 
+/* compact lineinfo: differences from the previous line */
+static void dump_lineinfo_compact(const Proto* f, int n, DumpState* D) {
+    int i, prev = f->linedefined;
+    dump_integer(n, D);
+    for (i = 0; i < n; i++) {
+        dump_delta(f->lineinfo[i], prev, D);
+        prev = f->lineinfo[i];
+    }
+}
+
 static void dump_debug(const Proto* f, DumpState* D) {
-    int i,n;
+    int i,n,prev;
 
     n= (D->strip) ? 0 : f->sizelineinfo;
-    dump_int_vector(f->lineinfo, n, sizeof(int), D);
+    if (D->options & LUAC_X_COMPACT) {
+        dump_lineinfo_compact(f, n, D);
+    } else {
+        dump_int_vector(f->lineinfo, n, sizeof(int), D);
+    }
 
     n= (D->strip) ? 0 : f->sizelocvars;
-    dump_int(n,D);
+    dump_integer(n,D);
+    prev = 0;
     for (i=0; i<n; i++) {
         dump_string(f->locvars[i].varname,D);
-        dump_int(f->locvars[i].startpc,D);
-        dump_int(f->locvars[i].endpc,D);
+        if (D->options & LUAC_X_COMPACT) {
+            dump_delta(f->locvars[i].startpc, prev, D);
+            dump_delta(f->locvars[i].endpc, f->locvars[i].startpc, D);
+            prev = f->locvars[i].startpc;
+        } else {
+            dump_int(f->locvars[i].startpc,D);
+            dump_int(f->locvars[i].endpc,D);
+        }
     }
 
     n= (D->strip) ? 0 : f->sizeupvalues;
-    dump_int(n,D);
+    dump_integer(n,D);
     for (i=0; i<n; i++) {
         dump_string(f->upvalues[i],D);
     }
 }
 
 
+static void dump_body(const Proto* f, int index, DumpState* D) {
+    dump_code_vector(f->code, f->sizecode, D);
+    dump_constants(f,D);
+    if (D->options & LUAC_X_DEBUG) {
+        dump_integer(index, D);
+    } else {
+        dump_debug(f,D);
+    }
+}
+
+/*
+* size of the body of `f' when written after its 4-byte size: a dry run
+* of dump_body, as DumpBlock only counts bytes once status is set
+*/
+static size_t body_size(const Proto* f, int index, const DumpState* D) {
+    DumpState C = *D;
+    C.status = 1;
+    C.sha = NULL;
+    C.pos += 4;
+    dump_body(f, index, &C);
+    return C.pos - D->pos - 4;
+}
+
 static void dump_function(const Proto* f, const TString* p, DumpState* D) {
+    int index = D->ndebug++;  /* before nested functions take theirs */
     dump_string((f->source==p || D->strip) ? NULL : f->source,D);
-    dump_int(f->linedefined,D);
-    dump_int(f->lastlinedefined,D);
+    dump_integer(f->linedefined,D);
+    dump_integer(f->lastlinedefined,D);
 
     DumpChar(f->nups,D);
     DumpChar(f->numparams,D);
     DumpChar(f->is_vararg,D);
     DumpChar(f->maxstacksize,D);
 
-    dump_code_vector(f->code, f->sizecode, D);
-    dump_constants(f,D);
-    dump_debug(f,D);
+    if (D->options & LUAC_X_LAZY) {  /* fixed size, see body_size */
+        dump_int((int)body_size(f, index, D), D);
+    }
+    dump_body(f, index, D);
+}
+
+/*
+* debug section: the debug information of all functions, in the order
+* in which they are written, after a table of where each record starts
+* (with fixed-size entries, so that its size is known in advance)
+*/
+static int count_functions(const Proto* f) {
+    int i, n = 1;
+    for (i = 0; i < f->sizep; i++) {
+        n += count_functions(f->p[i]);
+    }
+    return n;
+}
+
+static void dump_records(const Proto* f, int* offsets, int* i, size_t start,
+                         DumpState* D) {
+    int j;
+    if (offsets != NULL) {
+        offsets[*i] = (int)(D->pos - start);
+    }
+    (*i)++;
+    dump_debug(f, D);
+    for (j = 0; j < f->sizep; j++) {
+        dump_records(f->p[j], offsets, i, start, D);
+    }
+}
+
+static void dump_debug_section(const Proto* f, DumpState* D) {
+    int n = count_functions(f);
+    int* offsets = luaM_newvector(D->L, n + 1, int);
+    DumpState C = *D;
+    size_t start;
+    int i;
+    C.status = 1;  /* dry run (see body_size) to find the offsets */
+    C.sha = NULL;
+    dump_integer(n, &C);
+    for (i = 0; i <= n; i++) {
+        dump_int(0, &C);
+    }
+    start = C.pos;
+    i = 0;
+    dump_records(f, offsets, &i, start, &C);
+    offsets[n] = (int)(C.pos - start);
+
+    dump_integer(n, D);
+    for (i = 0; i <= n; i++) {
+        dump_int(offsets[i], D);
+    }
+    i = 0;
+    dump_records(f, NULL, &i, 0, D);
+    luaM_freearray(D->L, offsets, n + 1, int);
+}
+
+/*
+* digest of the chunk: a dry run (see body_size) hashing the header and
+* everything that follows the digest
+*/
+static void dump_digest(const Proto* f, const char* h, const DumpState* D,
+                        unsigned char* digest) {
+    DumpState C = *D;
+    Sha256 sha;
+    luaU_sha256init(&sha);
+    luaU_sha256update(&sha, h, LUAC_HEADERSIZE_X);
+    C.status = 1;
+    C.sha = &sha;
+    C.pos = LUAC_HEADERSIZE_X + LUAC_DIGESTSIZE;
+    if (C.pool != NULL) {
+        dump_pool(f, &C);
+    }
+    if (C.options & LUAC_X_DEBUG) {
+        dump_debug_section(f, &C);
+    }
+    dump_function(f, NULL, &C);
+    luaU_sha256final(&sha, digest);
 }
 
 static void DumpHeader(DumpState* D)
@@ -366,30 +787,147 @@ static void DumpHeader(DumpState* D)
  DumpBlock(h,LUAC_HEADERSIZE,D);
 }
 
+/*
+* writer of compressed containers: buffers the chunk and writes it out
+* block by block (see luaZ_initlz in lzio.c)
+*/
+typedef struct {
+    lua_Writer writer;
+    void* data;
+    size_t n;				/* bytes in `block' */
+    char block[LUAZ_LZBLOCK];
+    char out[LUAZ_LZBOUND(LUAZ_LZBLOCK)];
+    int hash[LUAZ_LZHASHSIZE];
+} LZWriter;
+
+static void put_uint32(unsigned char* p, size_t x) {
+    p[0] = (unsigned char)(x & 0xFF);
+    p[1] = (unsigned char)((x >> 8) & 0xFF);
+    p[2] = (unsigned char)((x >> 16) & 0xFF);
+    p[3] = (unsigned char)((x >> 24) & 0xFF);
+}
+
+static int lz_flush(lua_State* L, LZWriter* W) {
+    unsigned char h[8];
+    size_t comp = luaZ_lzcompress(W->block, W->n, W->out, W->hash);
+    int status;
+    put_uint32(h, W->n);
+    put_uint32(h + 4, (comp < W->n) ? comp : 0);
+    status = (*W->writer)(L, h, 8, W->data);
+    if (status == 0) {
+        status = (comp < W->n) ? (*W->writer)(L, W->out, comp, W->data)
+                               : (*W->writer)(L, W->block, W->n, W->data);
+    }
+    W->n = 0;
+    return status;
+}
+
+static int lz_writer(lua_State* L, const void* p, size_t size, void* ud) {
+    LZWriter* W = (LZWriter*)ud;
+    const char* b = (const char*)p;
+    while (size > 0) {
+        size_t m = LUAZ_LZBLOCK - W->n;
+        if (m > size) m = size;
+        memcpy(W->block + W->n, b, m);
+        W->n += m;
+        b += m;
+        size -= m;
+        if (W->n == LUAZ_LZBLOCK) {
+            int status = lz_flush(L, W);
+            if (status != 0) return status;
+        }
+    }
+    return 0;
+}
+
 static int dump_portable_bytecode = 1;
 
 /*
 ** dump Lua function as precompiled chunk
 */
-int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip)
+int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int options)
 {
  DumpState D;
+ StringPool pool;
+ LZWriter* lz=NULL;
+ char buff[DUMPBUFFER];
  D.L=L;
  D.writer=w;
  D.data=data;
- D.strip=strip;
+ D.strip=(options & LUA_DUMP_STRIP) != 0;
  D.status=0;
+ D.buff=buff;
+ D.n=0;
+ D.options=0;
+ if (options & LUA_DUMP_STRPOOL) D.options|=LUAC_X_STRPOOL;
+ if (options & LUA_DUMP_LAZY) D.options|=LUAC_X_LAZY;
+ if (options & LUA_DUMP_COMPACT) D.options|=LUAC_X_COMPACT;
+ if (options & LUA_DUMP_DIGEST) D.options|=LUAC_X_DIGEST;
+ if ((options & LUA_DUMP_DEBUG) && !D.strip) D.options|=LUAC_X_DEBUG;
+ if (options & LUA_DUMP_HASHES) D.options|=LUAC_X_HASHES;
+ D.extended=(options & LUA_DUMP_ALIGN) != 0 || D.options != 0;
+ D.pos=0;
+ D.pool=NULL;
+ D.sha=NULL;
+ D.ndebug=0;
+ if (options & LUA_DUMP_COMPRESS) {
+    char h[LUAC_HEADERSIZE];
+    luaU_header_z(h);
+    lz=luaM_new(L,LZWriter);
+    lua_unlock(L);
+    D.status=(*w)(L,h,LUAC_HEADERSIZE,data);
+    lua_lock(L);
+    lz->writer=w;
+    lz->data=data;
+    lz->n=0;
+    D.writer=lz_writer;
+    D.data=lz;
+ }
 
  if (dump_portable_bytecode == 1) {
-    char h[LUAC_HEADERSIZE];
-    luaU_header_p(h);
-    DumpBlock(h,LUAC_HEADERSIZE,&D);
+    char h[LUAC_HEADERSIZE_X];
+    if (D.extended) {
+        luaU_header_x(h, D.options);
+        DumpBlock(h,LUAC_HEADERSIZE_X,&D);
+    } else {
+        luaU_header_p(h);
+        DumpBlock(h,LUAC_HEADERSIZE,&D);
+    }
 
     setup_dump_funcs(&D);
+    if (D.options & LUAC_X_STRPOOL) {
+        pool.strings=NULL; pool.n=pool.size=0;
+        pool.slots=NULL; pool.sizeslots=0;
+        D.pool=&pool;
+    }
+    if (D.options & LUAC_X_DIGEST) {
+        unsigned char digest[LUAC_DIGESTSIZE];
+        dump_digest(f, h, &D, digest);
+        DumpBlock(digest, LUAC_DIGESTSIZE, &D);
+    }
+    if (D.pool != NULL) {
+        dump_pool(f,&D);
+    }
+    if (D.options & LUAC_X_DEBUG) {
+        dump_debug_section(f,&D);
+    }
     dump_function(f,NULL,&D);
+    if (D.pool != NULL) {
+        luaM_freearray(L, pool.strings, pool.size, const TString*);
+        luaM_freearray(L, pool.slots, pool.sizeslots, int);
+    }
  } else {
     DumpHeader(&D);
     DumpFunction(f,NULL,&D);
  }
+ DumpFlush(&D);
+ if (lz != NULL) {
+    static const unsigned char end[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    lua_unlock(L);
+    if (D.status==0 && lz->n > 0) D.status=lz_flush(L,lz);
+    if (D.status==0) D.status=(*w)(L,end,8,data);
+    lua_lock(L);
+    luaM_free(L,lz);
+ }
  return D.status;
 }
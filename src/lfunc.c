@@ -14,6 +14,7 @@
 
 #include "lfunc.h"
 #include "lgc.h"
+#include "ljit.h"
 #include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
@@ -134,21 +135,54 @@ Proto *luaF_newproto (lua_State *L) {
   f->linedefined = 0;
   f->lastlinedefined = 0;
   f->source = NULL;
+  f->image = NULL;
+  f->lazy = NULL;
+  f->debug = NULL;
+  f->trace = NULL;
+  f->cache = NULL;
+  f->lookups = 0;
+  f->jit = NULL;
+  f->hotcount = LUAI_JITHOT;
+  f->borrowed = 0;
   return f;
 }
 
 
 void luaF_freeproto (lua_State *L, Proto *f) {
-  luaM_freearray(L, f->code, f->sizecode, Instruction);
+  if (!(f->borrowed & PROTO_BCODE))
+    luaM_freearray(L, f->code, f->sizecode, Instruction);
   luaM_freearray(L, f->p, f->sizep, Proto *);
   luaM_freearray(L, f->k, f->sizek, TValue);
-  luaM_freearray(L, f->lineinfo, f->sizelineinfo, int);
+  if (!(f->borrowed & PROTO_BLINEINFO))
+    luaM_freearray(L, f->lineinfo, f->sizelineinfo, int);
   luaM_freearray(L, f->locvars, f->sizelocvars, struct LocVar);
   luaM_freearray(L, f->upvalues, f->sizeupvalues, TString *);
+  if (f->lazy) luaM_free(L, f->lazy);
+  if (f->debug) luaM_free(L, f->debug);
+  if (f->trace) luaM_freearray(L, f->trace, f->sizecode, int);
+  if (f->cache) luaM_freearray(L, f->cache, f->sizecode, ICache);
+#if defined(LUA_USE_JIT)
+  if (f->jit) luaJ_free(f);
+#endif
   luaM_free(L, f);
 }
 
 
+/*
+** give `f' its inline caches (see lvm.c), all empty
+*/
+void luaF_initcache (lua_State *L, Proto *f) {
+  int i;
+  ICache *c = luaM_newvector(L, f->sizecode, ICache);
+  for (i = 0; i < f->sizecode; i++) {
+    c[i].t = NULL;
+    c[i].n = NULL;
+    c[i].layout = 0;
+  }
+  f->cache = c;
+}
+
+
 void luaF_freeclosure (lua_State *L, Closure *c) {
   int size = (c->c.isC) ? sizeCclosure(c->c.nupvalues) :
                           sizeLclosure(c->l.nupvalues);
@@ -203,6 +203,18 @@ static int traversetable (global_State *g, Table *h) {
 static void traverseproto (global_State *g, Proto *f) {
   int i;
   if (f->source) stringmark(f->source);
+  if (f->image) markobject(g, f->image);
+  if (f->lazy) {
+    if (f->lazy->owner) markobject(g, f->lazy->owner);
+    if (f->lazy->pool) markobject(g, f->lazy->pool);
+    if (f->lazy->dsection) markobject(g, f->lazy->dsection);
+    if (f->lazy->downer) markobject(g, f->lazy->downer);
+  }
+  if (f->debug) {
+    markobject(g, f->debug->section);
+    markobject(g, f->debug->owner);
+    if (f->debug->pool) markobject(g, f->debug->pool);
+  }
   for (i=0; i<f->sizek; i++)  /* mark literals */
     markvalue(g, &f->k[i]);
   for (i=0; i<f->sizeupvalues; i++) {  /* mark upvalue names */
@@ -313,7 +325,9 @@ static l_mem propagatemark (global_State *g) {
                              sizeof(TValue) * p->sizek + 
                              sizeof(int) * p->sizelineinfo +
                              sizeof(LocVar) * p->sizelocvars +
-                             sizeof(TString *) * p->sizeupvalues;
+                             sizeof(TString *) * p->sizeupvalues +
+                             (p->trace ? sizeof(int) * p->sizecode : 0) +
+                             (p->cache ? sizeof(ICache) * p->sizecode : 0);
     }
     default: lua_assert(0); return 0;
   }
@@ -0,0 +1,1180 @@
+/*
+** $Id: ljit.c $
+** Baseline compiler of Lua functions to x86-64 machine code
+** See Copyright Notice in lua.h
+*/
+
+
+#include <stddef.h>
+
+#define ljit_c
+#define LUA_CORE
+
+#include "lua.h"
+
+#if defined(LUA_USE_JIT)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "lgc.h"
+#include "ljit.h"
+#include "lobject.h"
+#include "lopcodes.h"
+#include "lstate.h"
+#include "ltable.h"
+
+
+/*
+** Each instruction of a function is translated on its own, from a
+** template, into code working on the stack slots of the function just
+** as luaV_execute does. The code handles only the common cases of an
+** instruction (numbers, array slots, string keys found through the
+** inline caches); for anything else (calls, metamethods, allocation,
+** errors) it returns to the interpreter, which then runs the instruction
+** from the state it would have had without the machine code. So the
+** code never reallocates the stack, never calls the collector and never
+** raises errors, and `savedpc' and the call infos stay the business of
+** the interpreter.
+**
+** The interpreter enters the code at calls and loops (see lvm.c), at
+** any instruction, so each instruction starts at a label. Jumps back
+** return to the interpreter when a line or count hook is on.
+*/
+
+
+/* code of a function */
+typedef struct JitCode {
+  size_t size;  /* bytes mapped, starting at this header */
+  unsigned char *mcode;  /* entry stub, then the code of each instruction */
+  unsigned int label[1];  /* offset in `mcode' of each instruction */
+} JitCode;
+
+
+/*
+** the entry stub: runs the code from `start' and returns the index of
+** the instruction where the interpreter goes on
+*/
+typedef int (*JitEntry) (lua_State *L, StkId base, const TValue *k,
+                         LClosure *cl, const void *start);
+
+
+/* x86-64 registers */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+       R8, R9, R10, R11, R12, R13, R14, R15 };
+
+/*
+** registers kept by the code (callee-saved in the System V ABI, as is
+** R15, which keeps a value across calls to C)
+*/
+#define RBASE	RBX	/* `base' */
+#define RKST	R12	/* `k' */
+#define RSTATE	R13	/* `L' */
+#define RCL	R14	/* `cl' */
+
+/* condition codes */
+enum { CC_O, CC_NO, CC_B, CC_AE, CC_E, CC_NE, CC_BE, CC_A,
+       CC_S, CC_NS, CC_P, CC_NP, CC_L, CC_GE, CC_LE, CC_G };
+
+#define CC_ALWAYS	(-1)
+
+#define NOJUMP		(-1)
+
+/* offsets of the parts of a TValue */
+#define VALUE		cast_int(offsetof(TValue, value))
+#define TAG		cast_int(offsetof(TValue, tt))
+
+#define fieldof(t,f)	cast_int(offsetof(t, f))
+
+
+/* room for the code of an instruction and for its jumps, at most */
+#define MAXINSTR	320
+#define MAXFIX		24
+#define EXITSIZE	10	/* bytes of an exit stub */
+#define STUBSIZE	64	/* bytes of the entry stub and the epilogue */
+
+
+/* a jump whose target is another instruction or its exit */
+typedef struct Fixup {
+  int at;  /* offset of the displacement of the jump */
+  int pc;  /* target instruction */
+  int toexit;  /* to the exit of `pc' instead of its code? */
+} Fixup;
+
+
+typedef struct JitState {
+  Proto *p;
+  unsigned char *mc;  /* code being written */
+  int pos;  /* next free byte in `mc' */
+  int limit;  /* size of `mc' */
+  int pc;  /* instruction being compiled */
+  int epilogue;  /* offset of the return to the interpreter */
+  int *exit;  /* offset of the exit stub of each instruction, or -1 */
+  Fixup *fix;
+  int nfix;
+  int maxfix;
+  int failed;  /* ran out of room? */
+} JitState;
+
+
+/* a value operand: a stack slot or a constant */
+typedef struct Slot {
+  int base;  /* RBASE or RKST */
+  int disp;  /* offset of the TValue from `base' */
+  const TValue *k;  /* the constant, or NULL for a stack slot */
+} Slot;
+
+
+
+/*
+** {======================================================
+** Instruction encoding
+** =======================================================
+*/
+
+static void put1 (JitState *J, int b) {
+  if (J->pos < J->limit)
+    J->mc[J->pos++] = cast(unsigned char, b);
+  else
+    J->failed = 1;
+}
+
+
+static void put4 (JitState *J, int w) {
+  unsigned int u = cast(unsigned int, w);
+  put1(J, u & 0xff);
+  put1(J, (u >> 8) & 0xff);
+  put1(J, (u >> 16) & 0xff);
+  put1(J, u >> 24);
+}
+
+
+static void put8 (JitState *J, size_t w) {
+  put4(J, cast_int(w & 0xffffffffu));
+  put4(J, cast_int(w >> 32));
+}
+
+
+/* prefix (0x66 or 0xF2), REX and opcode of one or two bytes */
+static void opcode (JitState *J, int pfx, int w, int op, int reg, int rm) {
+  int rex = (w << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+  if (pfx) put1(J, pfx);
+  if (rex) put1(J, 0x40 | rex);
+  if (op > 0xff) put1(J, op >> 8);
+  put1(J, op & 0xff);
+}
+
+
+/* instruction on registers `reg' and `rm' */
+static void rr (JitState *J, int pfx, int w, int op, int reg, int rm) {
+  opcode(J, pfx, w, op, reg, rm);
+  put1(J, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+
+/* instruction on register `reg' and memory at `base'+`disp' */
+static void rm (JitState *J, int pfx, int w, int op, int reg,
+                int base, int disp) {
+  int mod;
+  if (disp == 0 && (base & 7) != RBP) mod = 0;
+  else if (-128 <= disp && disp <= 127) mod = 1;
+  else mod = 2;
+  opcode(J, pfx, w, op, reg, base);
+  put1(J, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) put1(J, 0x24);  /* SIB for no index */
+  if (mod == 1) put1(J, disp & 0xff);
+  else if (mod == 2) put4(J, disp);
+}
+
+
+/* operations with an immediate (group 1 of opcodes 0x81/0x83) */
+enum { AL_ADD = 0, AL_OR = 1, AL_AND = 4, AL_SUB = 5, AL_XOR = 6,
+       AL_CMP = 7 };
+
+static void ri (JitState *J, int w, int al, int reg, int imm) {
+  if (-128 <= imm && imm <= 127) {
+    rr(J, 0, w, 0x83, al, reg);
+    put1(J, imm & 0xff);
+  }
+  else {
+    rr(J, 0, w, 0x81, al, reg);
+    put4(J, imm);
+  }
+}
+
+
+static void mi (JitState *J, int al, int base, int disp, int imm) {
+  if (-128 <= imm && imm <= 127) {
+    rm(J, 0, 0, 0x83, al, base, disp);
+    put1(J, imm & 0xff);
+  }
+  else {
+    rm(J, 0, 0, 0x81, al, base, disp);
+    put4(J, imm);
+  }
+}
+
+
+/* mov dword [base+disp], imm */
+static void storei (JitState *J, int base, int disp, int imm) {
+  rm(J, 0, 0, 0xc7, 0, base, disp);
+  put4(J, imm);
+}
+
+
+/* mov reg, imm64 */
+static void loadptr (JitState *J, int reg, const void *p) {
+  opcode(J, 0, 1, 0xb8 + (reg & 7), 0, reg);
+  put8(J, cast(size_t, p));
+}
+
+
+/* opcodes with a register and a memory or register operand */
+#define MOV_LD		0x8b
+#define MOV_ST		0x89
+#define ADD_RM		0x03
+#define SUB_RM		0x2b
+#define CMP_RM		0x3b
+#define OR_RM		0x0b
+#define XOR_RM		0x33
+#define TEST_RM		0x85
+#define IMUL_RM		0x0faf
+#define MOVUPS_LD	0x0f10
+#define MOVUPS_ST	0x0f11
+#define SD		0xf2	/* prefix of the scalar double operations */
+#define MOVSD_LD	0x0f10
+#define MOVSD_ST	0x0f11
+#define ADDSD		0x0f58
+#define MULSD		0x0f59
+#define SUBSD		0x0f5c
+#define DIVSD		0x0f5e
+#define CVTSI2SD	0x0f2a
+#define PD		0x66	/* prefix of ucomisd, xorpd and movq */
+#define UCOMISD		0x0f2e
+#define XORPD		0x0f57
+#define MOVQ_ST		0x0f7e
+
+/* jump (`cc' or always) to be patched; returns offset of displacement */
+static int jump (JitState *J, int cc) {
+  if (cc == CC_ALWAYS)
+    put1(J, 0xe9);
+  else {
+    put1(J, 0x0f);
+    put1(J, 0x80 + cc);
+  }
+  put4(J, 0);
+  return J->pos - 4;
+}
+
+
+static void patch (JitState *J, int at, int target) {
+  if (at != NOJUMP && at + 4 <= J->limit) {
+    int d = target - (at + 4);
+    J->mc[at] = cast(unsigned char, d & 0xff);
+    J->mc[at + 1] = cast(unsigned char, (d >> 8) & 0xff);
+    J->mc[at + 2] = cast(unsigned char, (d >> 16) & 0xff);
+    J->mc[at + 3] = cast(unsigned char, (cast(unsigned int, d) >> 24));
+  }
+}
+
+
+/* make jump `at' (if any) go to the current position */
+static void here (JitState *J, int at) {
+  patch(J, at, J->pos);
+}
+
+
+static void fixup (JitState *J, int at, int pc, int toexit) {
+  if (at == NOJUMP) return;
+  lua_assert(0 <= pc && pc < J->p->sizecode);
+  if (J->nfix < J->maxfix) {
+    J->fix[J->nfix].at = at;
+    J->fix[J->nfix].pc = pc;
+    J->fix[J->nfix].toexit = toexit;
+    J->nfix++;
+  }
+  else
+    J->failed = 1;
+}
+
+
+/* make jump `at' go to instruction `pc' */
+#define golabel(J,at,pc)	fixup(J, at, pc, 0)
+
+/* make jump `at' leave to the interpreter at instruction `pc' */
+#define goexitat(J,at,pc)	fixup(J, at, pc, 1)
+
+/* make jump `at' leave to the interpreter at the current instruction */
+#define goexit(J,at)		goexitat(J, at, (J)->pc)
+
+
+/* return to the interpreter at instruction `pc' */
+static void exitstub (JitState *J, int pc) {
+  J->exit[pc] = J->pos;
+  put1(J, 0xb8);  /* mov eax, pc */
+  put4(J, pc);
+  patch(J, jump(J, CC_ALWAYS), J->epilogue);
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Templates
+** =======================================================
+*/
+
+static Slot regslot (int r) {
+  Slot s;
+  s.base = RBASE;
+  s.disp = r * cast_int(sizeof(TValue));
+  s.k = NULL;
+  return s;
+}
+
+
+static Slot kslot (JitState *J, int x) {
+  Slot s;
+  s.base = RKST;
+  s.disp = x * cast_int(sizeof(TValue));
+  s.k = &J->p->k[x];
+  return s;
+}
+
+
+static Slot rkslot (JitState *J, int x) {
+  return ISK(x) ? kslot(J, INDEXK(x)) : regslot(x);
+}
+
+
+#define mayint(s)	((s)->k == NULL || ttisint((s)->k))
+
+
+/* jump unless `s' has tag `t' (NOJUMP if it always has) */
+static int jnottag (JitState *J, const Slot *s, int t) {
+  if (s->k)
+    return (rttype(s->k) == t) ? NOJUMP : jump(J, CC_ALWAYS);
+  mi(J, AL_CMP, s->base, s->disp + TAG, t);
+  return jump(J, CC_NE);
+}
+
+
+/* register `reg' := the 32 or 64 bits of the value in `s' */
+static void loadval (JitState *J, int w, int reg, const Slot *s) {
+  rm(J, 0, w, MOV_LD, reg, s->base, s->disp + VALUE);
+}
+
+
+/* xmm register `x' := number in `s' as a float; leaves if no number */
+static void loadnum (JitState *J, int x, const Slot *s) {
+  if (s->k && ttisint(s->k))
+    rm(J, SD, 0, CVTSI2SD, x, s->base, s->disp + VALUE);
+  else if (s->k && ttisfloat(s->k))
+    rm(J, SD, 0, MOVSD_LD, x, s->base, s->disp + VALUE);
+  else if (s->k)
+    goexit(J, jump(J, CC_ALWAYS));
+  else {
+    int notfloat = jnottag(J, s, LUA_TNUMBER);
+    int done;
+    rm(J, SD, 0, MOVSD_LD, x, s->base, s->disp + VALUE);
+    done = jump(J, CC_ALWAYS);
+    here(J, notfloat);
+    goexit(J, jnottag(J, s, LUA_TINT));
+    rm(J, SD, 0, CVTSI2SD, x, s->base, s->disp + VALUE);
+    here(J, done);
+  }
+}
+
+
+static void setint (JitState *J, const Slot *s, int reg) {
+  rm(J, 0, 0, MOV_ST, reg, s->base, s->disp + VALUE);
+  storei(J, s->base, s->disp + TAG, LUA_TINT);
+}
+
+
+static void setfloat (JitState *J, const Slot *s, int x) {
+  rm(J, SD, 0, MOVSD_ST, x, s->base, s->disp + VALUE);
+  storei(J, s->base, s->disp + TAG, LUA_TNUMBER);
+}
+
+
+static void setbool (JitState *J, const Slot *s, int b) {
+  storei(J, s->base, s->disp + VALUE, b);
+  storei(J, s->base, s->disp + TAG, LUA_TBOOLEAN);
+}
+
+
+/* `to' := `from', through xmm0 */
+static void copy (JitState *J, const Slot *to, const Slot *from) {
+  rm(J, 0, 0, MOVUPS_LD, 0, from->base, from->disp);
+  rm(J, 0, 0, MOVUPS_ST, 0, to->base, to->disp);
+}
+
+
+/* slot at the address in register `reg' */
+static Slot atreg (int reg, int disp) {
+  Slot s;
+  s.base = reg;
+  s.disp = disp;
+  s.k = NULL;
+  return s;
+}
+
+
+/*
+** jumps for `l_isfalse(s)': `*isfalse' is taken when it is; falls
+** through when it is not
+*/
+static void testfalse (JitState *J, const Slot *s, int *isfalse,
+                       int *isfalse2) {
+  int nobool;
+  mi(J, AL_CMP, s->base, s->disp + TAG, LUA_TNIL);
+  *isfalse = jump(J, CC_E);
+  nobool = jnottag(J, s, LUA_TBOOLEAN);
+  mi(J, AL_CMP, s->base, s->disp + VALUE, 0);
+  *isfalse2 = jump(J, CC_E);
+  here(J, nobool);
+}
+
+
+/*
+** leave unless storing `v' in the object in register `reg' needs no
+** barrier (the object is not black or `v' is not collectable)
+*/
+static void nobarrier (JitState *J, int reg, int marked, const Slot *v) {
+  int done = NOJUMP;
+  if (v->k && !iscollectable(v->k)) return;
+  if (v->k == NULL) {
+    rm(J, 0, 0, MOV_LD, RCX, v->base, v->disp + TAG);
+    ri(J, 0, AL_AND, RCX, tagmask);
+    ri(J, 0, AL_CMP, RCX, LUA_TSTRING);
+    done = jump(J, CC_B);
+  }
+  rm(J, 0, 0, 0xf6, 0, reg, marked);  /* test byte [reg+marked], black */
+  put1(J, bitmask(BLACKBIT));
+  goexit(J, jump(J, CC_NE));
+  here(J, done);
+}
+
+
+/*
+** jump to instruction `target', which is a jump back when not after
+** the current instruction: then it leaves to the interpreter if a hook
+** is on, to run them from there
+*/
+static void jumpto (JitState *J, int target) {
+  if (target <= J->pc) {
+    rm(J, 0, 0, 0xf6, 0, RSTATE, fieldof(lua_State, hookmask));
+    put1(J, LUA_MASKLINE | LUA_MASKCOUNT);
+    goexitat(J, jump(J, CC_NE), target);
+  }
+  golabel(J, jump(J, CC_ALWAYS), target);
+}
+
+
+/*
+** RAX := the table in `t'; RDX := address of the slot of the int key
+** in `key' in the array part; leaves when `t' is no table or the key is
+** no int or is out of the array part
+*/
+static void arrayslot (JitState *J, const Slot *t, const Slot *key) {
+  goexit(J, jnottag(J, t, LUA_TTABLE));
+  goexit(J, jnottag(J, key, LUA_TINT));
+  loadval(J, 1, RAX, t);
+  loadval(J, 0, RCX, key);
+  ri(J, 0, AL_SUB, RCX, 1);  /* unsigned `key - 1' < `sizearray' ? */
+  rm(J, 0, 0, CMP_RM, RCX, RAX, fieldof(Table, sizearray));
+  goexit(J, jump(J, CC_AE));
+  rm(J, 0, 1, MOV_LD, RDX, RAX, fieldof(Table, array));
+  rr(J, 0, 1, 0x6b, RCX, RCX);  /* imul rcx, rcx, sizeof(TValue) */
+  put1(J, cast_int(sizeof(TValue)));
+  rr(J, 0, 1, ADD_RM, RDX, RCX);
+}
+
+
+/*
+** the node of `key' in `h', refilling the inline cache `c' (as
+** `cachedslot' in lvm.c does); NULL if `h' has no such key
+*/
+static Node *refill (Table *h, TString *key, ICache *c) {
+  Node *n = luaH_getstrnode(h, key);
+  if (n != NULL) {
+    c->t = h;
+    c->n = n;
+    c->layout = h->layout;
+  }
+  return n;
+}
+
+
+/*
+** RDX := address of the node of the constant string `key' of the
+** current instruction in the table in RAX, through the inline cache of
+** that instruction; leaves if the table has no such key
+*/
+static void cachedslot (JitState *J, const Slot *key) {
+  int miss[2], done;
+  if (J->p->cache == NULL) {
+    goexit(J, jump(J, CC_ALWAYS));
+    return;
+  }
+  loadptr(J, RDX, &J->p->cache[J->pc]);
+  rm(J, 0, 1, CMP_RM, RAX, RDX, fieldof(ICache, t));
+  miss[0] = jump(J, CC_NE);
+  rm(J, 0, 0, MOV_LD, RCX, RAX, fieldof(Table, layout));
+  rm(J, 0, 0, CMP_RM, RCX, RDX, fieldof(ICache, layout));
+  miss[1] = jump(J, CC_NE);
+  rm(J, 0, 1, MOV_LD, RDX, RDX, fieldof(ICache, n));
+  done = jump(J, CC_ALWAYS);
+  here(J, miss[0]);
+  here(J, miss[1]);
+  rr(J, 0, 1, MOV_LD, R15, RAX);  /* (kept by the call) */
+  rr(J, 0, 1, MOV_LD, RDI, RAX);
+  loadptr(J, RSI, rawtsvalue(key->k));
+  loadptr(J, RAX, cast(void *, refill));
+  rr(J, 0, 0, 0xff, 2, RAX);  /* call rax */
+  rr(J, 0, 1, TEST_RM, RAX, RAX);
+  goexit(J, jump(J, CC_E));
+  rr(J, 0, 1, MOV_LD, RDX, RAX);
+  rr(J, 0, 1, MOV_LD, RAX, R15);
+  here(J, done);
+}
+
+
+/*
+** RAX := the table in `t' (or the one already in RAX, if `t' is NULL);
+** RDX := address of the slot of `key' in it minus `*disp', for the int
+** keys and the constant string keys the interpreter takes shortcuts
+** for; leaves on anything else
+*/
+static void tableslot (JitState *J, const Slot *t, const Slot *key,
+                       int *disp) {
+  *disp = 0;
+  if (key->k && ttisstring(key->k)) {
+    if (t) {
+      goexit(J, jnottag(J, t, LUA_TTABLE));
+      loadval(J, 1, RAX, t);
+    }
+    cachedslot(J, key);
+    *disp = fieldof(Node, i_val);
+  }
+  else if (t && mayint(key))
+    arrayslot(J, t, key);
+  else
+    goexit(J, jump(J, CC_ALWAYS));
+}
+
+
+/*
+** a nil slot is as good as any other when the table has no metatable,
+** as there is no `__index' or `__newindex' to try; jumps if not nil
+*/
+static int nilslot (JitState *J, int disp) {
+  int notnil;
+  mi(J, AL_CMP, RDX, disp + TAG, LUA_TNIL);
+  notnil = jump(J, CC_NE);
+  rm(J, 0, 1, 0x83, AL_CMP, RAX, fieldof(Table, metatable));
+  put1(J, 0);
+  goexit(J, jump(J, CC_NE));
+  return notnil;
+}
+
+
+static void gettable (JitState *J, const Slot *ra, const Slot *t,
+                      const Slot *key) {
+  int disp;
+  Slot v;
+  tableslot(J, t, key, &disp);
+  here(J, nilslot(J, disp));
+  v = atreg(RDX, disp);
+  copy(J, ra, &v);
+}
+
+
+static void settable (JitState *J, const Slot *t, const Slot *key,
+                      const Slot *val) {
+  int disp, notnil, isstr = (key->k && ttisstring(key->k));
+  Slot v;
+  tableslot(J, t, key, &disp);
+  notnil = nilslot(J, disp);
+  if (!isstr) {  /* (else below) */
+    rm(J, 0, 0, 0xc6, 0, RAX, fieldof(Table, flags));  /* flags = 0 */
+    put1(J, 0);
+  }
+  here(J, notnil);
+  nobarrier(J, RAX, fieldof(Table, marked), val);
+  v = atreg(RDX, disp);
+  copy(J, &v, val);
+  if (isstr) {
+    rm(J, 0, 0, 0xc6, 0, RAX, fieldof(Table, flags));
+    put1(J, 0);
+  }
+}
+
+
+/* the results of int operations that are still ints (see lvm.c) */
+static void intarith (JitState *J, OpCode op, const Slot *rb,
+                      const Slot *rc, int *tofloat, int *n) {
+  loadval(J, 0, RAX, rb);
+  switch (op) {
+    case OP_ADD:
+      rm(J, 0, 0, ADD_RM, RAX, rc->base, rc->disp + VALUE);
+      tofloat[(*n)++] = jump(J, CC_O);
+      break;
+    case OP_SUB:
+      rm(J, 0, 0, SUB_RM, RAX, rc->base, rc->disp + VALUE);
+      tofloat[(*n)++] = jump(J, CC_O);
+      break;
+    default: {  /* OP_MUL: ints within -MAX_INT..MAX_INT, but not -0 */
+      int nonzero;
+      lua_assert(op == OP_MUL);
+      rm(J, 0, 0, IMUL_RM, RAX, rc->base, rc->disp + VALUE);
+      tofloat[(*n)++] = jump(J, CC_O);
+      ri(J, 0, AL_CMP, RAX, MAX_INT);
+      tofloat[(*n)++] = jump(J, CC_G);
+      ri(J, 0, AL_CMP, RAX, -MAX_INT);
+      tofloat[(*n)++] = jump(J, CC_L);
+      rr(J, 0, 0, TEST_RM, RAX, RAX);
+      nonzero = jump(J, CC_NE);
+      loadval(J, 0, RCX, rb);
+      rm(J, 0, 0, OR_RM, RCX, rc->base, rc->disp + VALUE);
+      tofloat[(*n)++] = jump(J, CC_S);
+      here(J, nonzero);
+      break;
+    }
+  }
+}
+
+
+static void arith (JitState *J, OpCode op, const Slot *ra, const Slot *rb,
+                   const Slot *rc) {
+  int done = NOJUMP;
+  if (op != OP_DIV && mayint(rb) && mayint(rc)) {
+    int tofloat[8];
+    int n = 0, j;
+    tofloat[n++] = jnottag(J, rb, LUA_TINT);
+    tofloat[n++] = jnottag(J, rc, LUA_TINT);
+    intarith(J, op, rb, rc, tofloat, &n);
+    setint(J, ra, RAX);
+    done = jump(J, CC_ALWAYS);
+    for (j = 0; j < n; j++) here(J, tofloat[j]);
+  }
+  loadnum(J, 0, rb);
+  loadnum(J, 1, rc);
+  switch (op) {
+    case OP_ADD: rr(J, SD, 0, ADDSD, 0, 1); break;
+    case OP_SUB: rr(J, SD, 0, SUBSD, 0, 1); break;
+    case OP_MUL: rr(J, SD, 0, MULSD, 0, 1); break;
+    default: lua_assert(op == OP_DIV); rr(J, SD, 0, DIVSD, 0, 1); break;
+  }
+  setfloat(J, ra, 0);
+  here(J, done);
+}
+
+
+/* `a % b' for ints, as `int_mod' in lvm.c; leaves for anything else */
+static void intmod (JitState *J, const Slot *ra, const Slot *rb,
+                    const Slot *rc) {
+  int notminus1, done, nonneg, same;
+  goexit(J, jnottag(J, rb, LUA_TINT));
+  goexit(J, jnottag(J, rc, LUA_TINT));
+  loadval(J, 0, RCX, rc);
+  rr(J, 0, 0, TEST_RM, RCX, RCX);
+  goexit(J, jump(J, CC_E));  /* x % 0 is a float */
+  ri(J, 0, AL_CMP, RCX, -1);
+  notminus1 = jump(J, CC_NE);
+  rr(J, 0, 0, XOR_RM, RDX, RDX);
+  done = jump(J, CC_ALWAYS);
+  here(J, notminus1);
+  loadval(J, 0, RAX, rb);
+  put1(J, 0x99);  /* cdq */
+  rr(J, 0, 0, 0xf7, 7, RCX);  /* idiv ecx */
+  rr(J, 0, 0, TEST_RM, RDX, RDX);
+  nonneg = jump(J, CC_E);
+  rr(J, 0, 0, MOV_LD, RAX, RDX);
+  rr(J, 0, 0, XOR_RM, RAX, RCX);
+  same = jump(J, CC_NS);
+  rr(J, 0, 0, ADD_RM, RDX, RCX);  /* round to -inf */
+  here(J, nonneg);
+  here(J, same);
+  here(J, done);
+  setint(J, ra, RDX);
+}
+
+
+static void unm (JitState *J, const Slot *ra, const Slot *rb) {
+  int tofloat[3];
+  int done, j;
+  tofloat[0] = jnottag(J, rb, LUA_TINT);
+  loadval(J, 0, RAX, rb);
+  rr(J, 0, 0, TEST_RM, RAX, RAX);
+  tofloat[1] = jump(J, CC_E);  /* -0 is no int */
+  ri(J, 0, AL_CMP, RAX, -MAX_INT);
+  tofloat[2] = jump(J, CC_L);
+  rr(J, 0, 0, 0xf7, 3, RAX);  /* neg eax */
+  setint(J, ra, RAX);
+  done = jump(J, CC_ALWAYS);
+  for (j = 0; j < 3; j++) here(J, tofloat[j]);
+  loadnum(J, 0, rb);
+  rr(J, PD, 1, MOVQ_ST, 0, RAX);  /* movq rax, xmm0 */
+  rr(J, 0, 1, 0x0fba, 7, RAX);  /* btc rax, 63 */
+  put1(J, 63);
+  rm(J, 0, 1, MOV_ST, RAX, ra->base, ra->disp + VALUE);
+  storei(J, ra->base, ra->disp + TAG, LUA_TNUMBER);
+  here(J, done);
+}
+
+
+/*
+** `rb < rc' (OP_LT) or `rb <= rc' (OP_LE) for numbers; jumps to
+** `yes' or to `no'
+*/
+static void compare (JitState *J, OpCode op, const Slot *rb, const Slot *rc,
+                     int yes, int no) {
+  if (mayint(rb) && mayint(rc)) {
+    int nb = jnottag(J, rb, LUA_TINT);
+    int nc = jnottag(J, rc, LUA_TINT);
+    loadval(J, 0, RAX, rb);
+    rm(J, 0, 0, CMP_RM, RAX, rc->base, rc->disp + VALUE);
+    golabel(J, jump(J, op == OP_LT ? CC_L : CC_LE), yes);
+    golabel(J, jump(J, CC_ALWAYS), no);
+    here(J, nb);
+    here(J, nc);
+  }
+  loadnum(J, 0, rb);
+  loadnum(J, 1, rc);
+  rr(J, PD, 0, UCOMISD, 1, 0);  /* (unordered is neither above nor equal) */
+  golabel(J, jump(J, op == OP_LT ? CC_A : CC_AE), yes);
+  golabel(J, jump(J, CC_ALWAYS), no);
+}
+
+
+/* `rb == rc' without metamethods; jumps to `yes' or to `no' */
+static void equal (JitState *J, const Slot *rb, const Slot *rc,
+                   int yes, int no) {
+  int nonum, mixed, floats, j;
+  int ref[2], notbool;
+  rm(J, 0, 0, MOV_LD, RAX, rb->base, rb->disp + TAG);
+  rm(J, 0, 0, MOV_LD, RCX, rc->base, rc->disp + TAG);
+  /* numbers */
+  rr(J, 0, 0, MOV_LD, RDX, RAX);
+  ri(J, 0, AL_AND, RDX, tagmask);
+  ri(J, 0, AL_CMP, RDX, LUA_TNUMBER);
+  nonum = jump(J, CC_NE);
+  rr(J, 0, 0, MOV_LD, RDX, RCX);
+  ri(J, 0, AL_AND, RDX, tagmask);
+  ri(J, 0, AL_CMP, RDX, LUA_TNUMBER);
+  golabel(J, jump(J, CC_NE), no);
+  rr(J, 0, 0, CMP_RM, RAX, RCX);
+  mixed = jump(J, CC_NE);
+  ri(J, 0, AL_CMP, RAX, LUA_TINT);
+  floats = jump(J, CC_NE);
+  loadval(J, 0, RDX, rb);
+  rm(J, 0, 0, CMP_RM, RDX, rc->base, rc->disp + VALUE);
+  golabel(J, jump(J, CC_E), yes);
+  golabel(J, jump(J, CC_ALWAYS), no);
+  here(J, mixed);
+  here(J, floats);
+  loadnum(J, 0, rb);
+  loadnum(J, 1, rc);
+  rr(J, PD, 0, UCOMISD, 0, 1);
+  golabel(J, jump(J, CC_P), no);
+  golabel(J, jump(J, CC_E), yes);
+  golabel(J, jump(J, CC_ALWAYS), no);
+  /* other types */
+  here(J, nonum);
+  rr(J, 0, 0, CMP_RM, RAX, RCX);
+  golabel(J, jump(J, CC_NE), no);
+  ri(J, 0, AL_CMP, RAX, LUA_TNIL);
+  golabel(J, jump(J, CC_E), yes);
+  ri(J, 0, AL_CMP, RAX, LUA_TBOOLEAN);
+  notbool = jump(J, CC_NE);
+  loadval(J, 0, RDX, rb);
+  rm(J, 0, 0, CMP_RM, RDX, rc->base, rc->disp + VALUE);
+  golabel(J, jump(J, CC_E), yes);
+  golabel(J, jump(J, CC_ALWAYS), no);
+  here(J, notbool);
+  /* tables and userdata are equal if the same, else may have `__eq' */
+  ri(J, 0, AL_CMP, RAX, LUA_TTABLE);
+  ref[0] = jump(J, CC_E);
+  ri(J, 0, AL_CMP, RAX, LUA_TUSERDATA);
+  ref[1] = jump(J, CC_E);
+  loadval(J, 1, RDX, rb);  /* any other type is equal if the same */
+  rm(J, 0, 1, CMP_RM, RDX, rc->base, rc->disp + VALUE);
+  golabel(J, jump(J, CC_E), yes);
+  golabel(J, jump(J, CC_ALWAYS), no);
+  for (j = 0; j < 2; j++) here(J, ref[j]);
+  loadval(J, 1, RDX, rb);
+  rm(J, 0, 1, CMP_RM, RDX, rc->base, rc->disp + VALUE);
+  golabel(J, jump(J, CC_E), yes);
+  goexit(J, jump(J, CC_ALWAYS));
+}
+
+
+static void forprep (JitState *J, const Slot *ra, int skip) {
+  Slot limit = regslot(0), step = regslot(0), ext = regslot(0);
+  int negative, body;
+  limit.disp = ra->disp + cast_int(sizeof(TValue));
+  step.disp = limit.disp + cast_int(sizeof(TValue));
+  ext.disp = step.disp + cast_int(sizeof(TValue));
+  /* only loops over ints: the others have to be checked and converted */
+  goexit(J, jnottag(J, ra, LUA_TINT));
+  goexit(J, jnottag(J, &limit, LUA_TINT));
+  goexit(J, jnottag(J, &step, LUA_TINT));
+  loadval(J, 0, RAX, ra);
+  loadval(J, 0, RDX, &limit);
+  mi(J, AL_CMP, step.base, step.disp + VALUE, 0);
+  negative = jump(J, CC_LE);
+  rr(J, 0, 0, CMP_RM, RAX, RDX);
+  golabel(J, jump(J, CC_G), skip);
+  body = jump(J, CC_ALWAYS);
+  here(J, negative);
+  rr(J, 0, 0, CMP_RM, RAX, RDX);
+  golabel(J, jump(J, CC_L), skip);
+  here(J, body);
+  setint(J, &ext, RAX);
+}
+
+
+static void forloop (JitState *J, const Slot *ra, int target) {
+  Slot limit = regslot(0), step = regslot(0), ext = regslot(0);
+  int notint, negative, cont, done[2], positive, fcont, stop[2];
+  limit.disp = ra->disp + cast_int(sizeof(TValue));
+  step.disp = limit.disp + cast_int(sizeof(TValue));
+  ext.disp = step.disp + cast_int(sizeof(TValue));
+  /* ints: does adding `step' to `idx' pass `limit'? (see lvm.c) */
+  notint = jnottag(J, ra, LUA_TINT);
+  loadval(J, 0, RAX, ra);
+  loadval(J, 0, RCX, &limit);
+  loadval(J, 0, RDX, &step);
+  rr(J, 0, 0, TEST_RM, RDX, RDX);
+  negative = jump(J, CC_LE);
+  rr(J, 0, 0, MOV_LD, RSI, RCX);
+  rr(J, 0, 0, SUB_RM, RSI, RAX);
+  rr(J, 0, 0, CMP_RM, RSI, RDX);
+  done[0] = jump(J, CC_B);
+  cont = jump(J, CC_ALWAYS);
+  here(J, negative);
+  rr(J, 0, 0, MOV_LD, RSI, RAX);
+  rr(J, 0, 0, SUB_RM, RSI, RCX);
+  rr(J, 0, 0, MOV_LD, RDI, RDX);
+  rr(J, 0, 0, 0xf7, 3, RDI);  /* neg edi */
+  rr(J, 0, 0, CMP_RM, RSI, RDI);
+  done[1] = jump(J, CC_B);
+  here(J, cont);
+  rr(J, 0, 0, ADD_RM, RAX, RDX);
+  rm(J, 0, 0, MOV_ST, RAX, ra->base, ra->disp + VALUE);
+  setint(J, &ext, RAX);
+  jumpto(J, target);
+  /* floats: is the new `idx' past `limit'? */
+  here(J, notint);
+  loadnum(J, 0, ra);
+  loadnum(J, 1, &step);
+  rr(J, SD, 0, ADDSD, 0, 1);
+  loadnum(J, 2, &limit);
+  rr(J, PD, 0, XORPD, 3, 3);
+  rr(J, PD, 0, UCOMISD, 1, 3);
+  positive = jump(J, CC_A);
+  rr(J, PD, 0, UCOMISD, 0, 2);  /* (unordered is below) */
+  stop[0] = jump(J, CC_B);
+  fcont = jump(J, CC_ALWAYS);
+  here(J, positive);
+  rr(J, PD, 0, UCOMISD, 2, 0);
+  stop[1] = jump(J, CC_B);
+  here(J, fcont);
+  setfloat(J, ra, 0);
+  setfloat(J, &ext, 0);
+  jumpto(J, target);
+  here(J, stop[0]);
+  here(J, stop[1]);
+  here(J, done[0]);
+  here(J, done[1]);
+}
+
+
+/* code of instruction `J->pc' */
+static void instruction (JitState *J, Instruction i) {
+  int pc = J->pc;
+  Slot ra = regslot(GETARG_A(i));
+  switch (GET_OPCODE(i)) {
+    case OP_MOVE: {
+      Slot rb = regslot(GETARG_B(i));
+      copy(J, &ra, &rb);
+      break;
+    }
+    case OP_LOADK: {
+      Slot kb = kslot(J, GETARG_Bx(i));
+      copy(J, &ra, &kb);
+      break;
+    }
+    case OP_LOADBOOL: {
+      setbool(J, &ra, GETARG_B(i) != 0);
+      if (GETARG_C(i)) golabel(J, jump(J, CC_ALWAYS), pc + 2);
+      break;
+    }
+    case OP_LOADNIL: {
+      int r;
+      for (r = GETARG_A(i); r <= GETARG_B(i); r++) {
+        Slot s = regslot(r);
+        storei(J, s.base, s.disp + TAG, LUA_TNIL);
+      }
+      break;
+    }
+    case OP_GETUPVAL: {
+      Slot v = atreg(RAX, 0);
+      rm(J, 0, 1, MOV_LD, RAX, RCL,
+         fieldof(LClosure, upvals) + GETARG_B(i) * cast_int(sizeof(UpVal *)));
+      rm(J, 0, 1, MOV_LD, RAX, RAX, fieldof(UpVal, v));
+      copy(J, &ra, &v);
+      break;
+    }
+    case OP_SETUPVAL: {
+      Slot v = atreg(RDX, 0);
+      rm(J, 0, 1, MOV_LD, RAX, RCL,
+         fieldof(LClosure, upvals) + GETARG_B(i) * cast_int(sizeof(UpVal *)));
+      nobarrier(J, RAX, fieldof(UpVal, marked), &ra);
+      rm(J, 0, 1, MOV_LD, RDX, RAX, fieldof(UpVal, v));
+      copy(J, &v, &ra);
+      break;
+    }
+    case OP_GETGLOBAL: {
+      Slot kb = kslot(J, GETARG_Bx(i));
+      rm(J, 0, 1, MOV_LD, RAX, RCL, fieldof(LClosure, env));
+      gettable(J, &ra, NULL, &kb);
+      break;
+    }
+    case OP_SETGLOBAL: {
+      Slot kb = kslot(J, GETARG_Bx(i));
+      rm(J, 0, 1, MOV_LD, RAX, RCL, fieldof(LClosure, env));
+      settable(J, NULL, &kb, &ra);
+      break;
+    }
+    case OP_GETTABLE: {
+      Slot rb = regslot(GETARG_B(i));
+      Slot rc = rkslot(J, GETARG_C(i));
+      gettable(J, &ra, &rb, &rc);
+      break;
+    }
+    case OP_SETTABLE: {
+      Slot rb = rkslot(J, GETARG_B(i));
+      Slot rc = rkslot(J, GETARG_C(i));
+      settable(J, &ra, &rb, &rc);
+      break;
+    }
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: {
+      Slot rb = rkslot(J, GETARG_B(i));
+      Slot rc = rkslot(J, GETARG_C(i));
+      arith(J, GET_OPCODE(i), &ra, &rb, &rc);
+      break;
+    }
+    case OP_MOD: {
+      Slot rb = rkslot(J, GETARG_B(i));
+      Slot rc = rkslot(J, GETARG_C(i));
+      intmod(J, &ra, &rb, &rc);
+      break;
+    }
+    case OP_UNM: {
+      Slot rb = regslot(GETARG_B(i));
+      unm(J, &ra, &rb);
+      break;
+    }
+    case OP_NOT: {
+      Slot rb = regslot(GETARG_B(i));
+      int f1, f2, done;
+      testfalse(J, &rb, &f1, &f2);
+      setbool(J, &ra, 0);
+      done = jump(J, CC_ALWAYS);
+      here(J, f1);
+      here(J, f2);
+      setbool(J, &ra, 1);
+      here(J, done);
+      break;
+    }
+    case OP_JMP: {
+      jumpto(J, pc + 1 + GETARG_sBx(i));
+      break;
+    }
+    /* a test jumps to the OP_JMP after it (`pc + 1') or skips it */
+    case OP_EQ: {
+      Slot rb = rkslot(J, GETARG_B(i));
+      Slot rc = rkslot(J, GETARG_C(i));
+      if (GETARG_A(i)) equal(J, &rb, &rc, pc + 1, pc + 2);
+      else equal(J, &rb, &rc, pc + 2, pc + 1);
+      break;
+    }
+    case OP_LT: case OP_LE: {
+      Slot rb = rkslot(J, GETARG_B(i));
+      Slot rc = rkslot(J, GETARG_C(i));
+      if (GETARG_A(i)) compare(J, GET_OPCODE(i), &rb, &rc, pc + 1, pc + 2);
+      else compare(J, GET_OPCODE(i), &rb, &rc, pc + 2, pc + 1);
+      break;
+    }
+    case OP_TEST: {
+      int f1, f2;
+      int isfalse = GETARG_C(i) ? pc + 2 : pc + 1;
+      int istrue = GETARG_C(i) ? pc + 1 : pc + 2;
+      testfalse(J, &ra, &f1, &f2);
+      golabel(J, jump(J, CC_ALWAYS), istrue);
+      golabel(J, f1, isfalse);
+      golabel(J, f2, isfalse);
+      break;
+    }
+    case OP_TESTSET: {
+      Slot rb = regslot(GETARG_B(i));
+      int f1, f2, skip;
+      testfalse(J, &rb, &f1, &f2);
+      if (GETARG_C(i)) {  /* copy and jump when true */
+        copy(J, &ra, &rb);
+        golabel(J, jump(J, CC_ALWAYS), pc + 1);
+        here(J, f1);
+        here(J, f2);
+        golabel(J, jump(J, CC_ALWAYS), pc + 2);
+      }
+      else {  /* copy and jump when false */
+        skip = jump(J, CC_ALWAYS);
+        here(J, f1);
+        here(J, f2);
+        copy(J, &ra, &rb);
+        golabel(J, jump(J, CC_ALWAYS), pc + 1);
+        golabel(J, skip, pc + 2);
+      }
+      break;
+    }
+    case OP_FORLOOP: {
+      forloop(J, &ra, pc + 1 + GETARG_sBx(i));
+      break;
+    }
+    case OP_FORPREP: {
+      forprep(J, &ra, pc + 1 + GETARG_sBx(i) + 1);
+      break;
+    }
+    default: {  /* left to the interpreter */
+      exitstub(J, pc);
+      break;
+    }
+  }
+}
+
+/* }====================================================== */
+
+
+
+static void entrystub (JitState *J) {
+  /* entry: save the kept registers, load them and jump to `start' */
+  put1(J, 0x53);  /* push rbx */
+  put1(J, 0x41); put1(J, 0x54);  /* push r12 */
+  put1(J, 0x41); put1(J, 0x55);  /* push r13 */
+  put1(J, 0x41); put1(J, 0x56);  /* push r14 */
+  put1(J, 0x41); put1(J, 0x57);  /* push r15 (which aligns the stack) */
+  rr(J, 0, 1, MOV_LD, RBASE, RSI);
+  rr(J, 0, 1, MOV_LD, RKST, RDX);
+  rr(J, 0, 1, MOV_LD, RSTATE, RDI);
+  rr(J, 0, 1, MOV_LD, RCL, RCX);
+  rr(J, 0, 0, 0xff, 4, R8);  /* jmp r8 */
+  /* epilogue: restore the kept registers and return EAX */
+  J->epilogue = J->pos;
+  put1(J, 0x41); put1(J, 0x5f);  /* pop r15 */
+  put1(J, 0x41); put1(J, 0x5e);  /* pop r14 */
+  put1(J, 0x41); put1(J, 0x5d);  /* pop r13 */
+  put1(J, 0x41); put1(J, 0x5c);  /* pop r12 */
+  put1(J, 0x5b);  /* pop rbx */
+  put1(J, 0xc3);  /* ret */
+}
+
+
+static void resolve (JitState *J, const unsigned int *label) {
+  int j;
+  for (j = 0; j < J->nfix; j++) {
+    Fixup *f = &J->fix[j];
+    if (f->toexit) {
+      if (J->exit[f->pc] < 0)
+        exitstub(J, f->pc);
+      patch(J, f->at, J->exit[f->pc]);
+    }
+    else
+      patch(J, f->at, cast_int(label[f->pc]));
+  }
+}
+
+
+#define alignto(n,a)	(((n) + (a) - 1) / (a) * (a))
+
+
+/*
+** compile `p'; if it cannot (no memory to map), it is not compiled
+** again before it runs many times more
+*/
+void luaJ_compile (lua_State *L, Proto *p) {
+  size_t page = cast(size_t, sysconf(_SC_PAGESIZE));
+  size_t head = alignto(offsetof(JitCode, label) +
+                        sizeof(unsigned int) * p->sizecode, 16);
+  size_t code = alignto(STUBSIZE + cast(size_t, p->sizecode) *
+                                    (MAXINSTR + EXITSIZE), 16);
+  size_t total = alignto(head + code + sizeof(int) * p->sizecode +
+                         sizeof(Fixup) * MAXFIX * p->sizecode, page);
+  size_t used;
+  JitCode *jc;
+  JitState J;
+  int pc;
+  UNUSED(L);
+  p->hotcount = MAX_INT;  /* in case of failure */
+  jc = cast(JitCode *, mmap(NULL, total, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (jc == MAP_FAILED) return;
+  jc->mcode = cast(unsigned char *, jc) + head;
+  J.p = p;
+  J.mc = jc->mcode;
+  J.pos = 0;
+  J.limit = cast_int(code);
+  J.exit = cast(int *, jc->mcode + code);
+  J.fix = cast(Fixup *, J.exit + p->sizecode);
+  J.nfix = 0;
+  J.maxfix = MAXFIX * p->sizecode;
+  J.failed = 0;
+  for (pc = 0; pc < p->sizecode; pc++) J.exit[pc] = -1;
+  entrystub(&J);
+  for (pc = 0; pc < p->sizecode; pc++) {
+    J.pc = pc;
+    jc->label[pc] = cast(unsigned int, J.pos);
+    instruction(&J, p->code[pc]);
+  }
+  resolve(&J, jc->label);
+  if (J.failed) {
+    munmap(jc, total);
+    return;
+  }
+  used = alignto(head + J.pos, page);
+  if (used < total)
+    munmap(cast(char *, jc) + used, total - used);
+  jc->size = used;
+  if (mprotect(jc, used, PROT_READ | PROT_EXEC) != 0) {
+    munmap(jc, used);
+    return;
+  }
+  p->jit = jc;
+}
+
+
+/*
+** run the code of the function of `cl' from instruction `pc' up to an
+** instruction left to the interpreter, which it returns
+*/
+const Instruction *luaJ_run (lua_State *L, LClosure *cl,
+                             const Instruction *pc) {
+  Proto *p = cl->p;
+  JitCode *jc = p->jit;
+  JitEntry entry = cast(JitEntry, cast(void *, jc->mcode));
+  int n = entry(L, L->base, p->k, cl, jc->mcode + jc->label[pc - p->code]);
+  lua_assert(0 <= n && n < p->sizecode);
+  return p->code + n;
+}
+
+
+void luaJ_free (Proto *p) {
+  munmap(p->jit, p->jit->size);
+  p->jit = NULL;
+}
+
+#endif
@@ -0,0 +1,23 @@
+/*
+** $Id: ljit.h $
+** Baseline compiler of Lua functions to x86-64 machine code
+** See Copyright Notice in lua.h
+*/
+
+#ifndef ljit_h
+#define ljit_h
+
+
+#include "lobject.h"
+
+
+#if defined(LUA_USE_JIT)
+
+LUAI_FUNC void luaJ_compile (lua_State *L, Proto *p);
+LUAI_FUNC const Instruction *luaJ_run (lua_State *L, LClosure *cl,
+                                       const Instruction *pc);
+LUAI_FUNC void luaJ_free (Proto *p);
+
+#endif
+
+#endif
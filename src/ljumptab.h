@@ -0,0 +1,53 @@
+/*
+** $Id: ljumptab.h $
+** Jump table for the dispatch of instructions in luaV_execute
+** See Copyright Notice in lua.h
+*/
+
+/*
+** included by lvm.c when LUA_USE_JUMPTABLE is on: each instruction ends
+** by fetching the next one and jumping straight to its handler, so that
+** each handler has an indirect jump of its own. While line or count
+** hooks are on, `disp' points to `hooktab', which sends every
+** instruction through the hooks before its handler; otherwise the
+** instructions run without any test for hooks.
+*/
+
+#undef vmsafepoint
+#undef vmtrace
+#undef vmdispatch
+#undef vmcase
+#undef vmbreak
+#undef vmhookcase
+
+#define vmsafepoint(L)	{ disp = hookson(L) ? hooktab : disptab; }
+
+#define vmtrace()	/* empty */
+
+#define vmdispatch(o)	goto *disp[o];
+
+#define vmcase(l)	L_##l:
+
+#define vmbreak		{ vmfetch(); vmdispatch(GET_OPCODE(i)); }
+
+#define vmhookcase	L_hook: { \
+  vmhook(); \
+  ra = RA(i); \
+  goto *disptab[GET_OPCODE(i)]; }
+
+
+#define oplabel(o)	&&L_OP_##o,
+#define hooklabel(o)	&&L_hook,
+
+static const void *const disptab[NUM_OPCODES] = {
+  OPCODES(oplabel)
+};
+
+static const void *const hooktab[NUM_OPCODES] = {
+  OPCODES(hooklabel)
+};
+
+#undef oplabel
+#undef hooklabel
+
+const void *const *disp;  /* `disptab' or `hooktab' */
@@ -0,0 +1,463 @@
+/*
+** $Id: lmarshal.c $
+** Marshalling of Lua values into strings
+** See Copyright Notice in lua.h
+*/
+
+
+#include <limits.h>
+#include <string.h>
+
+#define lmarshal_c
+#define LUA_LIB
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+/*
+** A marshalled value is a signature followed by the value, written as a
+** tag byte and its contents with the sizes and byte order of the portable
+** bytecode format (see ldump.c): counts are 4-byte and numbers are 8-byte
+** doubles, both little-endian. Tables and functions are numbered as they
+** are first written and later occurrences refer to that number, so that
+** sharing and cycles survive. A function is written as portable bytecode
+** followed by the values of its upvalues. C functions, userdata and threads
+** cannot be marshalled; metatables and environments are not kept.
+*/
+
+#define MARSHAL_SIG	"\033LuaM\1"
+
+#define M_NIL		0
+#define M_FALSE		1
+#define M_TRUE		2
+#define M_NUMBER	3
+#define M_STRING	4
+#define M_TABLE		5	/* array items, then other pairs */
+#define M_NUMARRAY	6	/* same, with an array of bare numbers */
+#define M_FUNCTION	7	/* bytecode, then upvalues */
+#define M_REF		8	/* table or function already read */
+
+#define MAXDEPTH	LUAI_MAXCCALLS
+
+
+static int littleendian (void) {
+  const int one = 1;
+  return *(const char *)&one;
+}
+
+
+static void setdouble (char *p, double d, int le) {
+  memcpy(p, &d, 8);
+  if (!le) {
+    int i;
+    for (i = 0; i < 4; i++) {
+      char c = p[i]; p[i] = p[7-i]; p[7-i] = c;
+    }
+  }
+}
+
+
+static double getdouble (const char *p, int le) {
+  double d;
+  if (le) memcpy(&d, p, 8);
+  else {
+    char b[8];
+    int i;
+    for (i = 0; i < 8; i++) b[i] = p[7-i];
+    memcpy(&d, b, 8);
+  }
+  return d;
+}
+
+
+
+/*
+** {======================================================
+** Encoding
+** =======================================================
+*/
+
+
+typedef struct Encoder {
+  lua_State *T;  /* thread where values are traversed */
+  luaL_Buffer b;  /* result, on the stack of the calling thread */
+  int n;  /* number of tables and functions written */
+  int le;  /* is the host little-endian? */
+} Encoder;
+
+
+#define SEEN	1	/* index in `T' of the table of numbered objects */
+
+
+static void putbyte (Encoder *E, int c) {
+  luaL_addchar(&E->b, (char)c);
+}
+
+
+static void putcount (Encoder *E, size_t x) {
+  char p[4];
+  if (x > 0xffffffffUL)
+    luaL_error(E->b.L, "value too large to marshal");
+  p[0] = (char)(x & 0xff);
+  p[1] = (char)((x >> 8) & 0xff);
+  p[2] = (char)((x >> 16) & 0xff);
+  p[3] = (char)((x >> 24) & 0xff);
+  luaL_addlstring(&E->b, p, 4);
+}
+
+
+static void putnumber (Encoder *E, lua_Number x) {
+  char p[8];
+  setdouble(p, (double)x, E->le);
+  luaL_addlstring(&E->b, p, 8);
+}
+
+
+static int writer (lua_State *L, const void* b, size_t size, void* B) {
+  (void)L;
+  luaL_addlstring((luaL_Buffer*) B, (const char *)b, size);
+  return 0;
+}
+
+
+/* is the key at `idx' one of the array items 1..n? */
+static int inarray (lua_State *T, int idx, int n) {
+  if (lua_type(T, idx) == LUA_TNUMBER) {
+    lua_Number k = lua_tonumber(T, idx);
+    return (k >= 1 && k <= n && k == (lua_Number)(int)k);
+  }
+  return 0;
+}
+
+
+/* if the object at the top was written before, write a reference to it */
+static int seen (Encoder *E) {
+  lua_State *T = E->T;
+  lua_pushvalue(T, -1);
+  lua_rawget(T, SEEN);
+  if (!lua_isnil(T, -1)) {
+    putbyte(E, M_REF);
+    putcount(E, (size_t)lua_tointeger(T, -1));
+    lua_pop(T, 1);
+    return 1;
+  }
+  lua_pop(T, 1);
+  lua_pushvalue(T, -1);
+  lua_pushinteger(T, ++E->n);
+  lua_rawset(T, SEEN);
+  return 0;
+}
+
+
+static void encode (Encoder *E, int depth);
+
+
+static void encodetable (Encoder *E, int depth) {
+  lua_State *T = E->T;
+  int n = (int)lua_objlen(T, -1);
+  int nn = 0;  /* number of array items that are numbers */
+  int nh = 0;
+  int numeric;
+  int i;
+  lua_pushnil(T);
+  while (lua_next(T, -2)) {  /* count the other pairs */
+    if (!inarray(T, -2, n)) nh++;
+    else if (lua_type(T, -1) == LUA_TNUMBER) nn++;
+    lua_pop(T, 1);
+  }
+  numeric = (n > 0 && nn == n);
+  putbyte(E, numeric ? M_NUMARRAY : M_TABLE);
+  putcount(E, (size_t)n);
+  putcount(E, (size_t)nh);
+  if (numeric) {  /* write the numbers straight into the buffer */
+    for (i = 1; i <= n; ) {
+      char *p = luaL_prepbuffer(&E->b);
+      size_t k;
+      for (k = 0; i <= n && k + 8 <= LUAL_BUFFERSIZE; i++, k += 8) {
+        lua_rawgeti(T, -1, i);
+        setdouble(p + k, (double)lua_tonumber(T, -1), E->le);
+        lua_pop(T, 1);
+      }
+      luaL_addsize(&E->b, k);
+    }
+  }
+  else {
+    for (i = 1; i <= n; i++) {
+      lua_rawgeti(T, -1, i);
+      encode(E, depth + 1);
+      lua_pop(T, 1);
+    }
+  }
+  lua_pushnil(T);
+  while (lua_next(T, -2)) {
+    if (!inarray(T, -2, n)) {
+      lua_pushvalue(T, -2);
+      encode(E, depth + 1);  /* key */
+      lua_pop(T, 1);
+      encode(E, depth + 1);  /* value */
+    }
+    lua_pop(T, 1);
+  }
+}
+
+
+static void encodefunction (Encoder *E, int depth) {
+  lua_State *T = E->T;
+  luaL_Buffer f;
+  lua_Debug ar;
+  size_t l;
+  const char *s;
+  int i;
+  lua_pushvalue(T, -1);
+  lua_getinfo(T, ">u", &ar);
+  luaL_buffinit(T, &f);
+  if (lua_dump(T, writer, &f) != 0)
+    luaL_error(E->b.L, "unable to marshal function");
+  luaL_pushresult(&f);
+  s = lua_tolstring(T, -1, &l);
+  putbyte(E, M_FUNCTION);
+  putcount(E, l);
+  luaL_addlstring(&E->b, s, l);
+  lua_pop(T, 1);
+  putbyte(E, ar.nups);
+  for (i = 1; i <= ar.nups; i++) {
+    lua_getupvalue(T, -1, i);
+    encode(E, depth + 1);
+    lua_pop(T, 1);
+  }
+}
+
+
+/* write the value at the top of `T' */
+static void encode (Encoder *E, int depth) {
+  lua_State *T = E->T;
+  switch (lua_type(T, -1)) {
+    case LUA_TNIL: {
+      putbyte(E, M_NIL);
+      break;
+    }
+    case LUA_TBOOLEAN: {
+      putbyte(E, lua_toboolean(T, -1) ? M_TRUE : M_FALSE);
+      break;
+    }
+    case LUA_TNUMBER: {
+      putbyte(E, M_NUMBER);
+      putnumber(E, lua_tonumber(T, -1));
+      break;
+    }
+    case LUA_TSTRING: {
+      size_t l;
+      const char *s = lua_tolstring(T, -1, &l);
+      putbyte(E, M_STRING);
+      putcount(E, l);
+      luaL_addlstring(&E->b, s, l);
+      break;
+    }
+    case LUA_TTABLE:
+    case LUA_TFUNCTION: {
+      if (lua_iscfunction(T, -1))
+        luaL_error(E->b.L, "cannot marshal a C function");
+      if (depth > MAXDEPTH || !lua_checkstack(T, LUA_MINSTACK))
+        luaL_error(E->b.L, "value to marshal is nested too deeply");
+      if (seen(E)) break;
+      if (lua_istable(T, -1)) encodetable(E, depth);
+      else encodefunction(E, depth);
+      break;
+    }
+    default: {
+      luaL_error(E->b.L, "cannot marshal a %s", luaL_typename(T, -1));
+    }
+  }
+}
+
+
+static int marshal_encode (lua_State *L) {
+  Encoder E;
+  luaL_checkany(L, 1);
+  lua_settop(L, 1);
+  E.T = lua_newthread(L);
+  E.n = 0;
+  E.le = littleendian();
+  lua_newtable(E.T);  /* SEEN */
+  lua_pushvalue(L, 1);
+  lua_xmove(L, E.T, 1);
+  luaL_buffinit(L, &E.b);
+  luaL_addlstring(&E.b, MARSHAL_SIG, sizeof(MARSHAL_SIG) - 1);
+  encode(&E, 0);
+  luaL_pushresult(&E.b);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Decoding
+** =======================================================
+*/
+
+
+typedef struct Decoder {
+  lua_State *L;
+  const char *p;  /* next byte to read */
+  size_t n;  /* bytes left */
+  int refs;  /* stack index of the table of numbered objects */
+  int nrefs;  /* number of tables and functions read */
+  int le;  /* is the host little-endian? */
+} Decoder;
+
+
+static void invalid (Decoder *D, const char *why) {
+  luaL_error(D->L, "invalid marshalled data (%s)", why);
+}
+
+
+static const char *getbytes (Decoder *D, size_t size) {
+  const char *p = D->p;
+  if (size > D->n) invalid(D, "truncated");
+  D->p += size;
+  D->n -= size;
+  return p;
+}
+
+
+static int getbyte (Decoder *D) {
+  return (unsigned char)*getbytes(D, 1);
+}
+
+
+static size_t getcount (Decoder *D) {
+  const unsigned char *p = (const unsigned char *)getbytes(D, 4);
+  return (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16) |
+         ((size_t)p[3] << 24);
+}
+
+
+static lua_Number getnumber (Decoder *D) {
+  return (lua_Number)getdouble(getbytes(D, 8), D->le);
+}
+
+
+/* number the object at the top */
+static void addref (Decoder *D) {
+  lua_pushvalue(D->L, -1);
+  lua_rawseti(D->L, D->refs, ++D->nrefs);
+}
+
+
+static void decode (Decoder *D, int depth);
+
+
+static void decodetable (Decoder *D, int numeric, int depth) {
+  lua_State *L = D->L;
+  size_t n = getcount(D);
+  size_t nh = getcount(D);
+  size_t i;
+  /* each item takes at least one byte (eight for bare numbers) */
+  if (n > D->n / (numeric ? 8 : 1) || nh > D->n / 2 || n > INT_MAX)
+    invalid(D, "bad table size");
+  lua_createtable(L, (int)n, (int)nh);
+  addref(D);
+  for (i = 1; i <= n; i++) {
+    if (numeric) lua_pushnumber(L, getnumber(D));
+    else decode(D, depth + 1);
+    lua_rawseti(L, -2, (int)i);
+  }
+  for (i = 0; i < nh; i++) {
+    decode(D, depth + 1);  /* key */
+    if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER &&
+                             lua_tonumber(L, -1) != lua_tonumber(L, -1)))
+      invalid(D, "bad key");
+    decode(D, depth + 1);  /* value */
+    lua_rawset(L, -3);
+  }
+}
+
+
+static void decodefunction (Decoder *D, int depth) {
+  lua_State *L = D->L;
+  size_t l = getcount(D);
+  const char *s = getbytes(D, l);
+  int nups, i;
+  if (l == 0 || *s != *LUA_SIGNATURE)
+    invalid(D, "bad function");
+  if (luaL_loadbuffer(L, s, l, "=marshal") != 0)
+    lua_error(L);
+  addref(D);
+  nups = getbyte(D);
+  for (i = 1; i <= nups; i++) {
+    decode(D, depth + 1);
+    if (lua_setupvalue(L, -2, i) == NULL)
+      invalid(D, "bad upvalue");
+  }
+}
+
+
+/* read a value and push it */
+static void decode (Decoder *D, int depth) {
+  lua_State *L = D->L;
+  int tag = getbyte(D);
+  if (depth > MAXDEPTH || !lua_checkstack(L, LUA_MINSTACK))
+    invalid(D, "nested too deeply");
+  switch (tag) {
+    case M_NIL: lua_pushnil(L); break;
+    case M_FALSE: lua_pushboolean(L, 0); break;
+    case M_TRUE: lua_pushboolean(L, 1); break;
+    case M_NUMBER: lua_pushnumber(L, getnumber(D)); break;
+    case M_STRING: {
+      size_t l = getcount(D);
+      lua_pushlstring(L, getbytes(D, l), l);
+      break;
+    }
+    case M_TABLE: decodetable(D, 0, depth); break;
+    case M_NUMARRAY: decodetable(D, 1, depth); break;
+    case M_FUNCTION: decodefunction(D, depth); break;
+    case M_REF: {
+      size_t i = getcount(D);
+      if (i < 1 || i > (size_t)D->nrefs) invalid(D, "bad reference");
+      lua_rawgeti(L, D->refs, (int)i);
+      break;
+    }
+    default: invalid(D, "bad tag");
+  }
+}
+
+
+static int marshal_decode (lua_State *L) {
+  Decoder D;
+  D.p = luaL_checklstring(L, 1, &D.n);
+  D.L = L;
+  D.nrefs = 0;
+  D.le = littleendian();
+  if (D.n < sizeof(MARSHAL_SIG) - 1 ||
+      memcmp(D.p, MARSHAL_SIG, sizeof(MARSHAL_SIG) - 1) != 0)
+    invalid(&D, "bad signature");
+  getbytes(&D, sizeof(MARSHAL_SIG) - 1);
+  lua_settop(L, 1);
+  lua_newtable(L);
+  D.refs = 2;
+  decode(&D, 0);
+  if (D.n != 0) invalid(&D, "extra bytes");
+  return 1;
+}
+
+/* }====================================================== */
+
+
+static const luaL_Reg marshallib[] = {
+  {"decode", marshal_decode},
+  {"encode", marshal_encode},
+  {NULL, NULL}
+};
+
+
+LUALIB_API int luaopen_marshal (lua_State *L) {
+  luaL_register(L, LUA_MARSHALLIBNAME, marshallib);
+  return 1;
+}
+
@@ -377,6 +377,155 @@ static void loaderror (lua_State *L, const char *filename) {
 }
 
 
+/*
+** {======================================================
+** Module archives
+** An archive, written by `luac -a', is LUA_ARCHIVESIG (padded with
+** zeros to 8 bytes) followed by 32-bit little-endian words: the number
+** of modules n, the number of slots m (a power of 2), the slots (each
+** 0 or the index plus one of a module) and n module entries (hash,
+** offset and length of the name, offset and size of the chunk). Offsets
+** count from the start of the archive; a module goes in the first free
+** slot from its hash (modulo m) on.
+** =======================================================
+*/
+
+
+#define ARCHIVES	"_ARCHIVES"
+#define AR_HEADER	16	/* signature plus n and m */
+#define AR_ENTRY	20	/* size of a module entry */
+
+
+static size_t getword (const char *p) {
+  const unsigned char *u = (const unsigned char *)p;
+  return (size_t)u[0] | ((size_t)u[1] << 8) | ((size_t)u[2] << 16) |
+         ((size_t)u[3] << 24);
+}
+
+
+/* FNV-1a; must match `archivehash' in luac.c */
+static size_t archivehash (const char *s, size_t l) {
+  unsigned long h = 2166136261UL;
+  for (; l > 0; l--, s++)
+    h = ((h ^ (unsigned char)*s) * 16777619UL) & 0xFFFFFFFFUL;
+  return (size_t)h;
+}
+
+
+/*
+** pushes the cached record of archive `filename' (a table with its
+** mapping, base address and size) or false if it cannot be mapped
+*/
+static void getarchive (lua_State *L, const char *filename) {
+  const char *a;
+  size_t size, n, m;
+  luaL_findtable(L, LUA_REGISTRYINDEX, ARCHIVES, 1);
+  lua_getfield(L, -1, filename);
+  if (!lua_isnil(L, -1)) {  /* already tried it? */
+    lua_remove(L, -2);  /* remove ARCHIVES table */
+    return;
+  }
+  lua_pop(L, 1);
+  a = luaL_mapfile(L, filename, &size);
+  if (a == NULL) {
+    lua_pop(L, 1);  /* error message */
+    lua_pushboolean(L, 0);
+  }
+  else {
+    if (size < AR_HEADER ||
+        memcmp(a, LUA_ARCHIVESIG, sizeof(LUA_ARCHIVESIG) - 1) != 0)
+      luaL_error(L, "bad archive " LUA_QS, filename);
+    n = getword(a + 8);
+    m = getword(a + 12);
+    if (m == 0 || (m & (m - 1)) != 0 || n > m ||
+        (size - AR_HEADER) / 4 < m ||
+        (size - AR_HEADER - 4 * m) / AR_ENTRY < n)
+      luaL_error(L, "bad archive " LUA_QS, filename);
+    lua_createtable(L, 3, 0);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, 1);  /* mapping */
+    lua_pushlightuserdata(L, (void *)a);
+    lua_rawseti(L, -2, 2);
+    lua_pushnumber(L, (lua_Number)size);
+    lua_rawseti(L, -2, 3);
+  }
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -3, filename);
+  lua_remove(L, -2);  /* remove ARCHIVES table */
+}
+
+
+/* returns the entry of module `name' in archive `a', or NULL */
+static const char *findmodule (const char *a, size_t size,
+                               const char *name, size_t l) {
+  size_t n = getword(a + 8);
+  size_t m = getword(a + 12);
+  size_t h = archivehash(name, l);
+  size_t i, k;
+  for (i = h & (m - 1), k = 0; k < m; i = (i + 1) & (m - 1), k++) {
+    size_t e = getword(a + AR_HEADER + 4 * i);
+    const char *entry;
+    if (e == 0 || e > n) return NULL;  /* free slot (or bad archive) */
+    entry = a + AR_HEADER + 4 * m + AR_ENTRY * (e - 1);
+    if (getword(entry) == h && getword(entry + 8) == l && l <= size &&
+        getword(entry + 4) <= size - l &&
+        memcmp(a + getword(entry + 4), name, l) == 0) {
+      if (getword(entry + 12) > size ||
+          getword(entry + 16) > size - getword(entry + 12))
+        return NULL;
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+
+static int loader_Archive (lua_State *L) {
+  size_t l;
+  const char *name = luaL_checklstring(L, 1, &l);
+  const char *path;
+  lua_getfield(L, LUA_ENVIRONINDEX, "archive");
+  path = lua_tostring(L, -1);
+  if (path == NULL)
+    luaL_error(L, LUA_QL("package.archive") " must be a string");
+  lua_pushliteral(L, "");  /* error accumulator */
+  while ((path = pushnexttemplate(L, path)) != NULL) {
+    const char *filename = lua_tostring(L, -1);
+    getarchive(L, filename);
+    if (lua_istable(L, -1)) {
+      const char *a, *entry;
+      size_t size;
+      lua_rawgeti(L, -1, 2);
+      a = (const char *)lua_touserdata(L, -1);
+      lua_rawgeti(L, -2, 3);
+      size = (size_t)lua_tonumber(L, -1);
+      lua_pop(L, 2);
+      entry = findmodule(a, size, name, l);
+      if (entry != NULL) {
+        lua_rawgeti(L, -1, 1);  /* mapping owns the chunk */
+        lua_pushfstring(L, "=%s:%s", filename, name);
+        lua_insert(L, -2);
+        if (lua_loadimage(L, a + getword(entry + 12), getword(entry + 16),
+                          lua_tostring(L, -2)) != 0)
+          loaderror(L, filename);
+        return 1;  /* module found */
+      }
+    }
+    if (lua_toboolean(L, -1))
+      lua_pushfstring(L, "\n\tno module " LUA_QS " in archive " LUA_QS,
+                         name, filename);
+    else
+      lua_pushfstring(L, "\n\tno archive " LUA_QS, filename);
+    lua_remove(L, -2);  /* remove archive record */
+    lua_remove(L, -2);  /* remove file name */
+    lua_concat(L, 2);  /* add entry to possible error message */
+  }
+  return 1;
+}
+
+/* }====================================================== */
+
+
 static int loader_Lua (lua_State *L) {
   const char *filename;
   const char *name = luaL_checkstring(L, 1);
@@ -621,7 +770,7 @@ static const luaL_Reg ll_funcs[] = {
 
 
 static const lua_CFunction loaders[] =
-  {loader_preload, loader_Lua, loader_C, loader_Croot, NULL};
+  {loader_preload, loader_Archive, loader_Lua, loader_C, loader_Croot, NULL};
 
 
 LUALIB_API int luaopen_package (lua_State *L) {
@@ -648,6 +797,10 @@ LUALIB_API int luaopen_package (lua_State *L) {
   lua_setfield(L, -2, "loaders");  /* put it in field `loaders' */
   setpath(L, "path", LUA_PATH, LUA_PATH_DEFAULT);  /* set field `path' */
   setpath(L, "cpath", LUA_CPATH, LUA_CPATH_DEFAULT); /* set field `cpath' */
+  setpath(L, "archive", LUA_ARCHIVE, LUA_ARCHIVE_DEFAULT);
+  /* set field `bytecodecache' (no cache if absent) */
+  lua_pushstring(L, getenv(LUA_BYTECODECACHE));
+  lua_setfield(L, -2, "bytecodecache");
   /* store config information */
   lua_pushliteral(L, LUA_DIRSEP "\n" LUA_PATHSEP "\n" LUA_PATH_MARK "\n"
                      LUA_EXECDIR "\n" LUA_IGMARK);
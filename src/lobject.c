@@ -24,7 +24,7 @@
 
 
 
-const TValue luaO_nilobject_ = {{NULL}, LUA_TNIL};
+const TValue luaO_nilobject_ = {NILCONSTANT};
 
 
 /*
@@ -87,6 +87,20 @@ int luaO_rawequalObj (const TValue *t1, const TValue *t2) {
 }
 
 
+/*
+** store number `n' in `o', as an int when it is one (but not -0, which
+** an int cannot keep)
+*/
+void luaO_setnumber (TValue *o, lua_Number n) {
+  int i;
+  lua_number2int(i, n);
+  if (luai_numeq(cast_num(i), n) && (i != 0 || luai_numlt(0, 1/n)))
+    setivalue(o, i)
+  else
+    setnvalue(o, n);
+}
+
+
 int luaO_str2d (const char *s, lua_Number *result) {
   char *endptr;
   *result = lua_str2number(s, &endptr);
@@ -30,6 +30,17 @@
 #define LUA_TDEADKEY	(LAST_TAG+3)
 
 
+/*
+** Variant tag of numbers kept as an `int': a number with an integral
+** value in the range of an int may be stored as such, so that the
+** arithmetic and the table indexing can skip the conversions; for
+** everything else (`ttype', the API, equality) it is a LUA_TNUMBER
+*/
+#define LUA_TINT	(LUA_TNUMBER | (1 << 4))
+
+#define tagmask		((1 << 4) - 1)
+
+
 /*
 ** Union of all collectable objects
 */
@@ -56,10 +67,13 @@ typedef struct GCheader {
 /*
 ** Union of all Lua values
 */
+#if !defined(LUA_NANBOX)
+
 typedef union {
   GCObject *gc;
   void *p;
   lua_Number n;
+  int i;
   int b;
 } Value;
 
@@ -70,35 +84,116 @@ typedef union {
 
 #define TValuefields	Value value; int tt
 
+#define NILCONSTANT	{NULL}, LUA_TNIL
+
+/* raw access to tags and values (without checks) */
+#define rttype(o)	((o)->tt)
+#define checktag(o,t)	(rttype(o) == (t))
+#define ttisfloat(o)	checktag((o), LUA_TNUMBER)
+
+#define gcval_(o)	((o)->value.gc)
+#define pval_(o)	((o)->value.p)
+#define nval_(o)	((o)->value.n)
+#define ival_(o)	((o)->value.i)
+#define bval_(o)	((o)->value.b)
+
+#define setnilvalue(obj) ((obj)->tt=LUA_TNIL)
+#define setgcval_(o,x,t) { (o)->value.gc=(x); (o)->tt=(t); }
+#define setpval_(o,x)	{ (o)->value.p=(x); (o)->tt=LUA_TLIGHTUSERDATA; }
+#define setnval_(o,x)	{ (o)->value.n=(x); (o)->tt=LUA_TNUMBER; }
+#define setival_(o,x)	{ (o)->value.i=(x); (o)->tt=LUA_TINT; }
+#define setbval_(o,x)	{ (o)->value.b=(x); (o)->tt=LUA_TBOOLEAN; }
+#define setobjval_(o1,o2) { (o1)->value = (o2)->value; (o1)->tt=(o2)->tt; }
+
+#define setttype(obj, tt) (rttype(obj) = (tt))
+
+#else
+
+/*
+** NaN boxing (see luaconf.h): a value is either a double or, in the
+** space of negative NaNs, a tag (plus 1, so that it is never an
+** infinity) in bits 47-51 above a payload in bits 0-46. Numbers that are
+** NaN are all kept as the positive quiet NaN, so no number looks boxed.
+*/
+typedef union {
+  LUAI_UINT64 u;
+  lua_Number n;
+} Value;
+
+#define TValuefields	Value value
+
+#define NANBOX_TAG(t)	((~cast(LUAI_UINT64, 0) << 52) | \
+			 (cast(LUAI_UINT64, (t) + 1) << 47))
+#define NANBOX_PAYLOAD	((cast(LUAI_UINT64, 1) << 47) - 1)
+#define NANBOX_NAN	(cast(LUAI_UINT64, 0x7FF8) << 48)
+
+#define NILCONSTANT	{NANBOX_TAG(LUA_TNIL)}
+
+/* raw access to tags and values (without checks) */
+#define rttype(o)	(ttisfloat(o) ? LUA_TNUMBER : \
+			 cast_int(((o)->value.u >> 47) & 0x1F) - 1)
+#define checktag(o,t)	(((o)->value.u >> 47) == (NANBOX_TAG(t) >> 47))
+#define ttisfloat(o)	((o)->value.u < NANBOX_TAG(LUA_TNIL))
+
+#define payload_(o)	cast(size_t, (o)->value.u & NANBOX_PAYLOAD)
+#define gcval_(o)	cast(GCObject *, payload_(o))
+#define pval_(o)	cast(void *, payload_(o))
+#define nval_(o)	((o)->value.n)
+#define ival_(o)	cast_int(cast(unsigned int, (o)->value.u))
+#define bval_(o)	ival_(o)
+
+#define box_(o,t,x)	((o)->value.u = NANBOX_TAG(t) | cast(LUAI_UINT64, x))
+
+#define setnilvalue(obj) box_(obj, LUA_TNIL, 0)
+#define setgcval_(o,x,t) { box_(o, t, cast(size_t, x)); }
+#define setpval_(o,x)	{ box_(o, LUA_TLIGHTUSERDATA, cast(size_t, x)); }
+#define setnval_(o,x) \
+  { lua_Number i_n=(x); \
+    if (luai_numisnan(i_n)) (o)->value.u = NANBOX_NAN; \
+    else (o)->value.n = i_n; }
+#define setival_(o,x)	{ box_(o, LUA_TINT, cast(unsigned int, x)); }
+#define setbval_(o,x)	{ box_(o, LUA_TBOOLEAN, cast(unsigned int, x)); }
+#define setobjval_(o1,o2) { (o1)->value = (o2)->value; }
+
+#define setttype(obj, tt) \
+  ((obj)->value.u = ((obj)->value.u & NANBOX_PAYLOAD) | NANBOX_TAG(tt))
+
+#endif
+
+
 typedef struct lua_TValue {
   TValuefields;
 } TValue;
 
 
 /* Macros to test type */
-#define ttisnil(o)	(ttype(o) == LUA_TNIL)
-#define ttisnumber(o)	(ttype(o) == LUA_TNUMBER)
-#define ttisstring(o)	(ttype(o) == LUA_TSTRING)
-#define ttistable(o)	(ttype(o) == LUA_TTABLE)
-#define ttisfunction(o)	(ttype(o) == LUA_TFUNCTION)
-#define ttisboolean(o)	(ttype(o) == LUA_TBOOLEAN)
-#define ttisuserdata(o)	(ttype(o) == LUA_TUSERDATA)
-#define ttisthread(o)	(ttype(o) == LUA_TTHREAD)
-#define ttislightuserdata(o)	(ttype(o) == LUA_TLIGHTUSERDATA)
+#define ttisnil(o)	checktag((o), LUA_TNIL)
+#define ttisnumber(o)	(ttisfloat(o) || ttisint(o))
+#define ttisint(o)	checktag((o), LUA_TINT)
+#define ttisstring(o)	checktag((o), LUA_TSTRING)
+#define ttistable(o)	checktag((o), LUA_TTABLE)
+#define ttisfunction(o)	checktag((o), LUA_TFUNCTION)
+#define ttisboolean(o)	checktag((o), LUA_TBOOLEAN)
+#define ttisuserdata(o)	checktag((o), LUA_TUSERDATA)
+#define ttisthread(o)	checktag((o), LUA_TTHREAD)
+#define ttislightuserdata(o)	checktag((o), LUA_TLIGHTUSERDATA)
 
 /* Macros to access values */
-#define ttype(o)	((o)->tt)
-#define gcvalue(o)	check_exp(iscollectable(o), (o)->value.gc)
-#define pvalue(o)	check_exp(ttislightuserdata(o), (o)->value.p)
-#define nvalue(o)	check_exp(ttisnumber(o), (o)->value.n)
-#define rawtsvalue(o)	check_exp(ttisstring(o), &(o)->value.gc->ts)
+#define ttype(o)	(rttype(o) & tagmask)
+#define gcvalue(o)	check_exp(iscollectable(o), gcval_(o))
+#define pvalue(o)	check_exp(ttislightuserdata(o), pval_(o))
+#define nvalue(o)	check_exp(ttisnumber(o), \
+			  ttisint(o) ? cast_num(ival_(o)) : nval_(o))
+#define ivalue(o)	check_exp(ttisint(o), ival_(o))
+#define fltvalue(o)	check_exp(ttisfloat(o), nval_(o))
+#define rawtsvalue(o)	check_exp(ttisstring(o), &gcval_(o)->ts)
 #define tsvalue(o)	(&rawtsvalue(o)->tsv)
-#define rawuvalue(o)	check_exp(ttisuserdata(o), &(o)->value.gc->u)
+#define rawuvalue(o)	check_exp(ttisuserdata(o), &gcval_(o)->u)
 #define uvalue(o)	(&rawuvalue(o)->uv)
-#define clvalue(o)	check_exp(ttisfunction(o), &(o)->value.gc->cl)
-#define hvalue(o)	check_exp(ttistable(o), &(o)->value.gc->h)
-#define bvalue(o)	check_exp(ttisboolean(o), (o)->value.b)
-#define thvalue(o)	check_exp(ttisthread(o), &(o)->value.gc->th)
+#define clvalue(o)	check_exp(ttisfunction(o), &gcval_(o)->cl)
+#define hvalue(o)	check_exp(ttistable(o), &gcval_(o)->h)
+#define bvalue(o)	check_exp(ttisboolean(o), bval_(o))
+#define thvalue(o)	check_exp(ttisthread(o), &gcval_(o)->th)
 
 #define l_isfalse(o)	(ttisnil(o) || (ttisboolean(o) && bvalue(o) == 0))
 
@@ -106,53 +201,60 @@ typedef struct lua_TValue {
 ** for internal debug only
 */
 #define checkconsistency(obj) \
-  lua_assert(!iscollectable(obj) || (ttype(obj) == (obj)->value.gc->gch.tt))
+  lua_assert(!iscollectable(obj) || (ttype(obj) == gcval_(obj)->gch.tt))
 
 #define checkliveness(g,obj) \
   lua_assert(!iscollectable(obj) || \
-  ((ttype(obj) == (obj)->value.gc->gch.tt) && !isdead(g, (obj)->value.gc)))
+  ((ttype(obj) == gcval_(obj)->gch.tt) && !isdead(g, gcval_(obj))))
 
 
 /* Macros to set values */
-#define setnilvalue(obj) ((obj)->tt=LUA_TNIL)
-
 #define setnvalue(obj,x) \
-  { TValue *i_o=(obj); i_o->value.n=(x); i_o->tt=LUA_TNUMBER; }
+  { TValue *i_o=(obj); setnval_(i_o, (x)); }
+
+#define setivalue(obj,x) \
+  { TValue *i_o=(obj); setival_(i_o, (x)); }
 
 #define setpvalue(obj,x) \
-  { TValue *i_o=(obj); i_o->value.p=(x); i_o->tt=LUA_TLIGHTUSERDATA; }
+  { TValue *i_o=(obj); setpval_(i_o, (x)); }
 
 #define setbvalue(obj,x) \
-  { TValue *i_o=(obj); i_o->value.b=(x); i_o->tt=LUA_TBOOLEAN; }
+  { TValue *i_o=(obj); setbval_(i_o, (x)); }
 
 #define setsvalue(L,obj,x) \
   { TValue *i_o=(obj); \
-    i_o->value.gc=cast(GCObject *, (x)); i_o->tt=LUA_TSTRING; \
+    setgcval_(i_o, cast(GCObject *, (x)), LUA_TSTRING); \
     checkliveness(G(L),i_o); }
 
 #define setuvalue(L,obj,x) \
   { TValue *i_o=(obj); \
-    i_o->value.gc=cast(GCObject *, (x)); i_o->tt=LUA_TUSERDATA; \
+    setgcval_(i_o, cast(GCObject *, (x)), LUA_TUSERDATA); \
     checkliveness(G(L),i_o); }
 
 #define setthvalue(L,obj,x) \
   { TValue *i_o=(obj); \
-    i_o->value.gc=cast(GCObject *, (x)); i_o->tt=LUA_TTHREAD; \
+    setgcval_(i_o, cast(GCObject *, (x)), LUA_TTHREAD); \
     checkliveness(G(L),i_o); }
 
 #define setclvalue(L,obj,x) \
   { TValue *i_o=(obj); \
-    i_o->value.gc=cast(GCObject *, (x)); i_o->tt=LUA_TFUNCTION; \
+    setgcval_(i_o, cast(GCObject *, (x)), LUA_TFUNCTION); \
     checkliveness(G(L),i_o); }
 
 #define sethvalue(L,obj,x) \
   { TValue *i_o=(obj); \
-    i_o->value.gc=cast(GCObject *, (x)); i_o->tt=LUA_TTABLE; \
+    setgcval_(i_o, cast(GCObject *, (x)), LUA_TTABLE); \
     checkliveness(G(L),i_o); }
 
 #define setptvalue(L,obj,x) \
   { TValue *i_o=(obj); \
-    i_o->value.gc=cast(GCObject *, (x)); i_o->tt=LUA_TPROTO; \
+    setgcval_(i_o, cast(GCObject *, (x)), LUA_TPROTO); \
+    checkliveness(G(L),i_o); }
+
+/* any collectable object, with the type in its header */
+#define setgcovalue(L,obj,x) \
+  { TValue *i_o=(obj); GCObject *i_g=(x); \
+    setgcval_(i_o, i_g, i_g->gch.tt); \
     checkliveness(G(L),i_o); }
 
 
@@ -160,7 +262,7 @@ typedef struct lua_TValue {
 
 #define setobj(L,obj1,obj2) \
   { const TValue *o2=(obj2); TValue *o1=(obj1); \
-    o1->value = o2->value; o1->tt=o2->tt; \
+    setobjval_(o1, o2); \
     checkliveness(G(L),o1); }
 
 
@@ -183,8 +285,6 @@ typedef struct lua_TValue {
 #define setobj2n	setobj
 #define setsvalue2n	setsvalue
 
-#define setttype(obj, tt) (ttype(obj) = (tt))
-
 
 #define iscollectable(o)	(ttype(o) >= LUA_TSTRING)
 
@@ -225,6 +325,35 @@ typedef union Udata {
 
 
 
+/*
+** Encoded body of a function whose loading is deferred until it is
+** first instantiated (see lundump.c)
+*/
+typedef struct LazyBody {
+  GCObject *owner;  /* object holding the encoded bytes */
+  GCObject *pool;  /* string pool of the chunk (or NULL) */
+  const char *b;  /* encoded body */
+  size_t size;  /* size of `b' */
+  size_t pos;  /* offset of `b' from the start of the chunk */
+  int options;  /* options from the chunk header */
+  lu_byte trusted;  /* from a trusted chunk (no code verification)? */
+  GCObject *dsection;  /* debug section of the chunk (or NULL) */
+  GCObject *downer;  /* object holding the bytes of `dsection' */
+} LazyBody;
+
+
+/*
+** Debug information of a function not loaded yet: a record in the
+** debug section of its chunk, loaded when first needed (see lundump.c)
+*/
+typedef struct DebugRef {
+  GCObject *section;  /* userdata describing the debug section */
+  GCObject *owner;  /* object holding the bytes of the section */
+  GCObject *pool;  /* string pool of the chunk (or NULL) */
+  int index;  /* record of the function in the section */
+} DebugRef;
+
+
 /*
 ** Function Prototypes
 */
@@ -237,22 +366,36 @@ typedef struct Proto {
   struct LocVar *locvars;  /* information about local variables */
   TString **upvalues;  /* upvalue names */
   TString  *source;
+  GCObject *image;  /* object owning borrowed vectors (or NULL) */
+  LazyBody *lazy;  /* body not loaded yet (or NULL) */
+  DebugRef *debug;  /* debug information not loaded yet (or NULL) */
+  int *trace;  /* paths of symbolic execution (see ldebug.c) or NULL */
+  struct ICache *cache;  /* inline caches, one per instruction, or NULL */
+  struct JitCode *jit;  /* machine code (see ljit.c) or NULL */
   int sizeupvalues;
   int sizek;  /* size of `k' */
   int sizecode;
   int sizelineinfo;
   int sizep;  /* size of `p' */
   int sizelocvars;
+  int lookups;  /* cacheable lookups run while `cache' is NULL */
   int linedefined;
   int lastlinedefined;
+  int hotcount;  /* calls and loop iterations left before compiling */
   GCObject *gclist;
   lu_byte nups;  /* number of upvalues */
   lu_byte numparams;
   lu_byte is_vararg;
   lu_byte maxstacksize;
+  lu_byte borrowed;  /* vectors living in `image' (PROTO_B* bits) */
 } Proto;
 
 
+/* bits for `borrowed' in Proto */
+#define PROTO_BCODE		1	/* `code' points into `image' */
+#define PROTO_BLINEINFO		2	/* `lineinfo' points into `image' */
+
+
 /* masks for new-style vararg */
 #define VARARG_HASARG		1
 #define VARARG_ISVARARG		2
@@ -345,9 +488,22 @@ typedef struct Table {
   Node *lastfree;  /* any free position is before this position */
   GCObject *gclist;
   int sizearray;  /* size of `array' array */
+  unsigned int layout;  /* changes whenever keys move in `node' */
 } Table;
 
 
+/*
+** inline cache of an instruction indexing a table with a constant
+** string (see lvm.c): the node that held the key in the last table
+** indexed, valid while that table keeps the same layout
+*/
+typedef struct ICache {
+  Table *t;
+  Node *n;
+  unsigned int layout;  /* layout of `t' when `n' was cached */
+} ICache;
+
+
 
 /*
 ** `module' operation for hashing (size is always a power of 2)
@@ -370,6 +526,7 @@ LUAI_FUNC int luaO_log2 (unsigned int x);
 LUAI_FUNC int luaO_int2fb (unsigned int x);
 LUAI_FUNC int luaO_fb2int (int x);
 LUAI_FUNC int luaO_rawequalObj (const TValue *t1, const TValue *t2);
+LUAI_FUNC void luaO_setnumber (TValue *o, lua_Number n);
 LUAI_FUNC int luaO_str2d (const char *s, lua_Number *result);
 LUAI_FUNC const char *luaO_pushvfstring (lua_State *L, const char *fmt,
                                                        va_list argp);
@@ -13,48 +13,21 @@
 
 /* ORDER OP */
 
+#define opname(o)	#o,
+
 const char *const luaP_opnames[NUM_OPCODES+1] = {
-  "MOVE",
-  "LOADK",
-  "LOADBOOL",
-  "LOADNIL",
-  "GETUPVAL",
-  "GETGLOBAL",
-  "GETTABLE",
-  "SETGLOBAL",
-  "SETUPVAL",
-  "SETTABLE",
-  "NEWTABLE",
-  "SELF",
-  "ADD",
-  "SUB",
-  "MUL",
-  "DIV",
-  "MOD",
-  "POW",
-  "UNM",
-  "NOT",
-  "LEN",
-  "CONCAT",
-  "JMP",
-  "EQ",
-  "LT",
-  "LE",
-  "TEST",
-  "TESTSET",
-  "CALL",
-  "TAILCALL",
-  "RETURN",
-  "FORLOOP",
-  "FORPREP",
-  "TFORLOOP",
-  "SETLIST",
-  "CLOSE",
-  "CLOSURE",
-  "VARARG",
+  OPCODES(opname)
   NULL
 };
 
+/* check that OPCODES lists the opcodes in ORDER OP */
+#define opindex(o)	OPX_##o,
+enum { OPCODES(opindex) OPX_N };
+#define opcheck(o)  \
+  typedef char opcheck_##o[(cast_int(OPX_##o) == cast_int(OP_##o)) ? 1 : -1];
+OPCODES(opcheck)
+typedef char opcheck_n[(OPX_N == NUM_OPCODES) ? 1 : -1];
+
 
 #define opmode(t,a,b,c,m) (((t)<<7) | ((a)<<6) | ((b)<<4) | ((c)<<2) | (m))
 
@@ -98,5 +71,6 @@ const lu_byte luaP_opmodes[NUM_OPCODES] = {
  ,opmode(0, 0, OpArgN, OpArgN, iABC)		/* OP_CLOSE */
  ,opmode(0, 1, OpArgU, OpArgN, iABx)		/* OP_CLOSURE */
  ,opmode(0, 1, OpArgU, OpArgN, iABC)		/* OP_VARARG */
+ ,opmode(0, 1, OpArgK, OpArgN, iABx)		/* OP_TEMPLATE */
 };
 
@@ -204,11 +204,26 @@ OP_SETLIST,/*	A B C	R(A)[(C-1)*FPF+i] := R(A+i), 1 <= i <= B	*/
 OP_CLOSE,/*	A 	close all variables in the stack up to (>=) R(A)*/
 OP_CLOSURE,/*	A Bx	R(A) := closure(KPROTO[Bx], R(A), ... ,R(A+n))	*/
 
-OP_VARARG/*	A B	R(A), R(A+1), ..., R(A+B-1) = vararg		*/
+OP_VARARG,/*	A B	R(A), R(A+1), ..., R(A+B-1) = vararg		*/
+
+OP_TEMPLATE/*	A Bx	R(A) := copy of table template Kst(Bx)		*/
 } OpCode;
 
 
-#define NUM_OPCODES	(cast(int, OP_VARARG) + 1)
+#define NUM_OPCODES	(cast(int, OP_TEMPLATE) + 1)
+
+
+/*
+** the opcodes without their prefix, in ORDER OP, for building tables
+** indexed by opcode (`lopcodes.c' checks that it matches `OpCode')
+*/
+#define OPCODES(_) \
+  _(MOVE) _(LOADK) _(LOADBOOL) _(LOADNIL) _(GETUPVAL) _(GETGLOBAL) \
+  _(GETTABLE) _(SETGLOBAL) _(SETUPVAL) _(SETTABLE) _(NEWTABLE) _(SELF) \
+  _(ADD) _(SUB) _(MUL) _(DIV) _(MOD) _(POW) _(UNM) _(NOT) _(LEN) \
+  _(CONCAT) _(JMP) _(EQ) _(LT) _(LE) _(TEST) _(TESTSET) _(CALL) \
+  _(TAILCALL) _(RETURN) _(FORLOOP) _(FORPREP) _(TFORLOOP) _(SETLIST) \
+  _(CLOSE) _(CLOSURE) _(VARARG) _(TEMPLATE)
 
 
 
@@ -0,0 +1,509 @@
+/*
+** $Id: lopt.c $
+** Optimizer of precompiled functions (see luac.c)
+** See Copyright Notice in lua.h
+*/
+
+
+#include <string.h>
+
+#define lopt_c
+#define LUA_CORE
+
+#include "lua.h"
+
+#include "ldebug.h"
+#include "ldo.h"
+#include "lgc.h"
+#include "llimits.h"
+#include "lmem.h"
+#include "lobject.h"
+#include "lopcodes.h"
+#include "lopt.h"
+#include "lstate.h"
+#include "lstring.h"
+#include "lzio.h"
+
+
+/*
+** The code generator only folds constants as it emits code; this pass
+** works over whole functions after parsing, so it costs nothing to
+** programs that load source.  Each round marks the words of code that
+** can go away (see `kept') and then compacts the code, fixing jump
+** offsets, line info and the ranges of local variables.  Rounds go on
+** while they change something, as threading jumps and removing dead
+** code uncover more of both.  The format of the code does not change,
+** so optimized chunks dump and load like any other.
+*/
+
+
+/* what a word of code is */
+#define W_INSTR		0	/* an instruction */
+#define W_PSEUDO	1	/* upvalue of the closure before it */
+#define W_COUNT		2	/* count of the setlist before it */
+
+
+typedef struct OptState {
+  lua_State *L;
+  Proto *f;
+  int n;  /* size of code */
+  lu_byte *word;  /* W_* kind of each word */
+  lu_byte *kept;  /* whether each word stays */
+  lu_byte *target;  /* whether some path gets to it not by falling through */
+  int *aux;  /* stack of `reach' or map of `compact' (n+1 entries) */
+} OptState;
+
+
+#define dest(i,pc)	((pc)+1+GETARG_sBx(i))
+#define jump(sbx)	CREATE_ABx(OP_JMP, 0, (sbx)+MAXARG_sBx)
+#define isop(f,pc,o)	(GET_OPCODE((f)->code[pc]) == (o))
+
+
+static void decode (OptState *O) {
+  Proto *f = O->f;
+  int pc;
+  for (pc = 0; pc < O->n; pc++) {
+    Instruction i = f->code[pc];
+    O->word[pc] = W_INSTR;
+    if (GET_OPCODE(i) == OP_CLOSURE) {
+      int j;
+      for (j = f->p[GETARG_Bx(i)]->nups; j > 0; j--)
+        O->word[++pc] = W_PSEUDO;
+    }
+    else if (GET_OPCODE(i) == OP_SETLIST && GETARG_C(i) == 0)
+      O->word[++pc] = W_COUNT;
+  }
+}
+
+
+/*
+** put in `s' the instructions that may run right after the one at `pc';
+** returns how many there are
+*/
+static int successors (const Proto *f, int pc, int *s) {
+  Instruction i = f->code[pc];
+  OpCode op = GET_OPCODE(i);
+  if (testTMode(op)) {  /* its jump, or the instruction after the jump */
+    s[0] = pc+1; s[1] = pc+2;
+    return 2;
+  }
+  switch (op) {
+    case OP_JMP: s[0] = dest(i, pc); return 1;
+    case OP_LOADBOOL: s[0] = GETARG_C(i) ? pc+2 : pc+1; return 1;
+    case OP_FORLOOP: s[0] = pc+1; s[1] = dest(i, pc); return 2;
+    case OP_FORPREP: {  /* int loops skip the forloop or enter the body */
+      s[0] = pc+1; s[1] = dest(i, pc); s[2] = dest(i, pc)+1;
+      return 3;
+    }
+    case OP_RETURN: return 0;
+    case OP_CLOSURE: s[0] = pc+1+f->p[GETARG_Bx(i)]->nups; return 1;
+    case OP_SETLIST: s[0] = (GETARG_C(i) == 0) ? pc+2 : pc+1; return 1;
+    default: s[0] = pc+1; return 1;
+  }
+}
+
+
+/*
+** a comparison of two constants always goes the same way: make it a
+** jump (strings are not compared, as their order depends on the locale)
+*/
+static int foldtests (OptState *O) {
+  Proto *f = O->f;
+  int pc;
+  int changes = 0;
+  for (pc = 0; pc < O->n; pc++) {
+    Instruction i = f->code[pc];
+    OpCode op = GET_OPCODE(i);
+    const TValue *b, *c;
+    int res;
+    if (O->word[pc] != W_INSTR || (op != OP_EQ && op != OP_LT && op != OP_LE) ||
+        !ISK(GETARG_B(i)) || !ISK(GETARG_C(i)))
+      continue;
+    b = &f->k[INDEXK(GETARG_B(i))];
+    c = &f->k[INDEXK(GETARG_C(i))];
+    if (op == OP_EQ)
+      res = luaO_rawequalObj(b, c);
+    else if (ttisnumber(b) && ttisnumber(c))
+      res = (op == OP_LT) ? luai_numlt(nvalue(b), nvalue(c))
+                          : luai_numle(nvalue(b), nvalue(c));
+    else continue;
+    if (res == GETARG_A(i))  /* go where its jump goes */
+      f->code[pc] = jump(dest(f->code[pc+1], pc+1) - (pc+1));
+    else  /* skip its jump */
+      f->code[pc] = jump(1);
+    changes++;
+  }
+  return changes;
+}
+
+
+/*
+** a jump to a jump goes straight to where the last one goes (unless
+** they jump around in a loop)
+*/
+static int thread (OptState *O) {
+  Proto *f = O->f;
+  int pc;
+  int changes = 0;
+  for (pc = 0; pc < O->n; pc++) {
+    int d, steps = 0;
+    if (O->word[pc] != W_INSTR || !isop(f, pc, OP_JMP)) continue;
+    d = dest(f->code[pc], pc);
+    while (O->word[d] == W_INSTR && isop(f, d, OP_JMP) &&
+           dest(f->code[d], d) != d && steps++ < O->n)
+      d = dest(f->code[d], d);
+    if (steps <= O->n && d != dest(f->code[pc], pc) &&
+        -MAXARG_sBx <= d-(pc+1) && d-(pc+1) <= MAXARG_sBx) {
+      SETARG_sBx(f->code[pc], d-(pc+1));
+      changes++;
+    }
+  }
+  return changes;
+}
+
+
+/*
+** keep the words that some path from the entry gets to; the rest is
+** dead code
+*/
+static void reach (OptState *O) {
+  Proto *f = O->f;
+  int *stack = O->aux;
+  int top = 0;
+  memset(O->kept, 0, O->n);
+  O->kept[0] = 1;
+  stack[top++] = 0;
+  while (top > 0) {
+    int s[3];
+    int pc = stack[--top];
+    int ns = successors(f, pc, s);
+    int j;
+    for (j = pc+1; j < O->n && O->word[j] != W_INSTR; j++)
+      O->kept[j] = 1;  /* upvalues and counts go with their instruction */
+    if (isop(f, pc, OP_LOADBOOL) && GETARG_C(f->code[pc]))
+      s[ns++] = pc+1;  /* keep what it skips, so that it still skips that */
+    for (j = 0; j < ns; j++) {
+      if (s[j] < O->n && !O->kept[s[j]]) {
+        O->kept[s[j]] = 1;
+        stack[top++] = s[j];
+      }
+    }
+  }
+  O->kept[O->n - 1] = 1;  /* the final return stays in any case */
+}
+
+
+static void marktargets (OptState *O) {
+  int pc;
+  memset(O->target, 0, O->n);
+  for (pc = 0; pc < O->n; pc++) {
+    if (O->kept[pc] && O->word[pc] == W_INSTR) {
+      int s[3];
+      int ns = successors(O->f, pc, s);
+      int j;
+      for (j = 0; j < ns; j++)
+        if (s[j] != pc+1 && s[j] < O->n) O->target[s[j]] = 1;
+    }
+  }
+}
+
+
+/*
+** can the instruction at `pc' go away?  Not if it is the jump of a test
+** or the instruction a `loadbool' skips, as these must follow the one
+** before them
+*/
+static int removable (OptState *O, int pc) {
+  if (O->word[pc] != W_INSTR || pc == O->n - 1) return 0;
+  if (pc > 0 && O->word[pc-1] == W_INSTR) {
+    Instruction p = O->f->code[pc-1];
+    if (testTMode(GET_OPCODE(p)) ||
+        (GET_OPCODE(p) == OP_LOADBOOL && GETARG_C(p)))
+      return 0;
+  }
+  return 1;
+}
+
+
+static int nextkept (OptState *O, int pc) {
+  do { pc++; } while (pc < O->n && !O->kept[pc]);
+  return pc;
+}
+
+
+/* drop jumps to the next instruction and moves that change nothing */
+static int dropnoops (OptState *O) {
+  Proto *f = O->f;
+  int pc;
+  int changes = 0;
+  for (pc = 0; pc < O->n; pc++) {
+    Instruction i = f->code[pc];
+    if (!O->kept[pc] || !removable(O, pc)) continue;
+    if (GET_OPCODE(i) == OP_JMP) {
+      if (dest(i, pc) == nextkept(O, pc)) {
+        O->kept[pc] = 0;
+        changes++;
+      }
+    }
+    else if (GET_OPCODE(i) == OP_MOVE) {
+      int a = GETARG_A(i);
+      int b = GETARG_B(i);
+      int q = nextkept(O, pc);
+      if (a == b) {  /* MOVE A A */
+        O->kept[pc] = 0;
+        changes++;
+      }
+      else if (q < O->n && O->word[q] == W_INSTR && isop(f, q, OP_MOVE)) {
+        Instruction j = f->code[q];
+        if (GETARG_A(j) == b && GETARG_B(j) == a &&
+            !O->target[q] && removable(O, q)) {  /* MOVE A B; MOVE B A */
+          O->kept[q] = 0;
+          changes++;
+        }
+        else if (GETARG_A(j) == a && GETARG_B(j) != a) {  /* MOVE A B; MOVE A C */
+          O->kept[pc] = 0;
+          changes++;
+        }
+      }
+    }
+  }
+  return changes;
+}
+
+
+/* index of string `s' in the constants of `f', adding it if needed */
+static int stringk (lua_State *L, Proto *f, TString *s) {
+  int k;
+  for (k = 0; k < f->sizek; k++)
+    if (ttisstring(&f->k[k]) && rawtsvalue(&f->k[k]) == s) return k;
+  if (k > MAXARG_Bx) return k;  /* no `loadk' could load it */
+  setsvalue2s(L, L->top, s);  /* anchor it */
+  incr_top(L);
+  luaM_reallocvector(L, f->k, f->sizek, f->sizek+1, TValue);
+  setsvalue(L, &f->k[k], s);
+  f->sizek++;
+  luaC_objbarrier(L, f, s);
+  L->top--;
+  return k;
+}
+
+
+/*
+** a concatenation of string constants loaded right before it becomes
+** the load of their concatenation (numbers are left alone: how they
+** become strings depends on LUA_NUMBER_FMT)
+*/
+static int foldconcat (OptState *O) {
+  lua_State *L = O->L;
+  Proto *f = O->f;
+  int pc;
+  int changes = 0;
+  for (pc = 0; pc < O->n; pc++) {
+    Instruction i = f->code[pc];
+    int b, first, q, k;
+    size_t l = 0;
+    char *buff;
+    if (!O->kept[pc] || O->word[pc] != W_INSTR || GET_OPCODE(i) != OP_CONCAT ||
+        O->target[pc])
+      continue;
+    b = GETARG_B(i);
+    first = pc - (GETARG_C(i) - b + 1);
+    if (first < 0) continue;
+    for (q = first; q < pc; q++) {
+      Instruction j = f->code[q];
+      if (!O->kept[q] || O->word[q] != W_INSTR || (q > first && O->target[q]) ||
+          GET_OPCODE(j) != OP_LOADK || GETARG_A(j) != b + (q - first) ||
+          !ttisstring(&f->k[GETARG_Bx(j)]))
+        break;
+      l += tsvalue(&f->k[GETARG_Bx(j)])->len;
+    }
+    if (q < pc) continue;
+    buff = luaZ_openspace(L, &G(L)->buff, l);
+    l = 0;
+    for (q = first; q < pc; q++) {
+      const TString *s = rawtsvalue(&f->k[GETARG_Bx(f->code[q])]);
+      memcpy(buff+l, getstr(s), s->tsv.len);
+      l += s->tsv.len;
+    }
+    k = stringk(L, f, luaS_newlstr(L, buff, l));
+    if (k > MAXARG_Bx) continue;
+    f->code[first] = CREATE_ABx(OP_LOADK, GETARG_A(i), k);
+    for (q = first+1; q <= pc; q++) O->kept[q] = 0;
+    changes++;
+  }
+  return changes;
+}
+
+
+/* remove the words not kept; returns whether there were any */
+static int compact (OptState *O) {
+  lua_State *L = O->L;
+  Proto *f = O->f;
+  int *map = O->aux;  /* new position of each word */
+  int pc, n = 0;
+  for (pc = 0; pc < O->n; pc++) {
+    map[pc] = n;
+    if (O->kept[pc]) n++;
+  }
+  map[O->n] = n;  /* end of the ranges of locals */
+  if (n == O->n) return 0;
+  for (pc = 0; pc < O->n; pc++) {
+    Instruction i = f->code[pc];
+    if (!O->kept[pc]) continue;
+    if (O->word[pc] == W_INSTR && getOpMode(GET_OPCODE(i)) == iAsBx)
+      SETARG_sBx(i, map[dest(i, pc)] - (map[pc]+1));
+    f->code[map[pc]] = i;
+    if (f->sizelineinfo > 0)
+      f->lineinfo[map[pc]] = f->lineinfo[pc];
+  }
+  for (pc = 0; pc < f->sizelocvars; pc++) {
+    f->locvars[pc].startpc = map[f->locvars[pc].startpc];
+    f->locvars[pc].endpc = map[f->locvars[pc].endpc];
+  }
+  luaM_reallocvector(L, f->code, O->n, n, Instruction);
+  f->sizecode = n;
+  if (f->sizelineinfo > 0) {
+    luaM_reallocvector(L, f->lineinfo, f->sizelineinfo, n, int);
+    f->sizelineinfo = n;
+  }
+  O->n = n;
+  return 1;
+}
+
+
+/*
+** registers the locals of `f' need, as debug information tells them; it
+** lists them in the order they come into scope, each one taking the
+** register after those still alive
+*/
+static int localregs (const Proto *f) {
+  int endpc[LUAI_MAXVARS];
+  int i, j;
+  int na = 0, need = 0;
+  for (i = 0; i < f->sizelocvars; i++) {
+    int startpc = f->locvars[i].startpc;
+    if (i > 0 && startpc < f->locvars[i-1].startpc)
+      return f->maxstacksize;  /* not from the parser; do not guess */
+    for (j = 0; j < na; ) {  /* drop those dead at `startpc' */
+      if (endpc[j] <= startpc) endpc[j] = endpc[--na];
+      else j++;
+    }
+    if (na == LUAI_MAXVARS) return f->maxstacksize;
+    endpc[na++] = f->locvars[i].endpc;
+    if (na > need) need = na;
+  }
+  return need;
+}
+
+
+#define atleast(x,n)	{ int n_ = (n); if ((x) < n_) (x) = n_; }
+
+/* registers the code of `f' needs */
+static int coderegs (const Proto *f) {
+  int pc;
+  int need = 2;  /* registers 0/1 are always valid (see lparser.c) */
+  atleast(need, f->numparams + (f->is_vararg & VARARG_HASARG));
+  for (pc = 0; pc < f->sizecode; pc++) {
+    Instruction i = f->code[pc];
+    OpCode op = GET_OPCODE(i);
+    int a = GETARG_A(i);
+    int b = GETARG_B(i);
+    int c = GETARG_C(i);
+    atleast(need, a+1);
+    if (getOpMode(op) == iABC) {
+      if (getBMode(op) == OpArgR || (getBMode(op) == OpArgK && !ISK(b)))
+        atleast(need, b+1);
+      if (getCMode(op) == OpArgR || (getCMode(op) == OpArgK && !ISK(c)))
+        atleast(need, c+1);
+    }
+    switch (op) {
+      case OP_SELF: atleast(need, a+2); break;
+      case OP_FORLOOP: case OP_FORPREP: atleast(need, a+4); break;
+      case OP_TFORLOOP: {  /* results, and the call of the generator */
+        atleast(need, a+3+c);
+        atleast(need, a+6);
+        break;
+      }
+      case OP_CALL: case OP_TAILCALL: {
+        if (b != 0) atleast(need, a+b);
+        if (c > 1) atleast(need, a+c-1);
+        break;
+      }
+      case OP_RETURN: case OP_VARARG: {
+        if (b > 1) atleast(need, a+b-1);
+        break;
+      }
+      case OP_SETLIST: {
+        if (b != 0) atleast(need, a+b+1);
+        if (c == 0) pc++;  /* skip count */
+        break;
+      }
+      default: break;
+    }
+  }
+  return need;
+}
+
+
+static void optimize (lua_State *L, Proto *f) {
+  OptState O;
+  int n = f->sizecode;
+  int locals = localregs(f);
+  int changes;
+  lua_assert(f->cache == NULL);
+  if (f->trace) {  /* paths change with the code */
+    luaM_freearray(L, f->trace, n, int);
+    f->trace = NULL;
+  }
+  if (f->borrowed & PROTO_BCODE) {  /* get code of its own */
+    Instruction *code = luaM_newvector(L, n, Instruction);
+    memcpy(code, f->code, n*sizeof(Instruction));
+    f->code = code;
+    f->borrowed &= ~PROTO_BCODE;
+  }
+  if (f->borrowed & PROTO_BLINEINFO) {
+    int *lineinfo = luaM_newvector(L, f->sizelineinfo, int);
+    memcpy(lineinfo, f->lineinfo, f->sizelineinfo*sizeof(int));
+    f->lineinfo = lineinfo;
+    f->borrowed &= ~PROTO_BLINEINFO;
+  }
+  O.L = L;
+  O.f = f;
+  O.n = n;
+  O.word = luaM_newvector(L, 3*n, lu_byte);
+  O.kept = O.word + n;
+  O.target = O.kept + n;
+  O.aux = luaM_newvector(L, n+1, int);
+  decode(&O);
+  changes = foldtests(&O);
+  for (;;) {
+    changes += thread(&O);
+    reach(&O);
+    marktargets(&O);
+    changes += foldconcat(&O);
+    changes += dropnoops(&O);
+    changes += compact(&O);
+    if (changes == 0) break;
+    decode(&O);
+    changes = 0;
+  }
+  luaM_freearray(L, O.word, 3*n, lu_byte);
+  luaM_freearray(L, O.aux, n+1, int);
+  atleast(locals, coderegs(f));
+  if (locals < f->maxstacksize)
+    f->maxstacksize = cast_byte(locals);
+}
+
+
+/*
+** optimize `f' and the functions nested in it, which must all be loaded
+** with their debug information (see luaU_materializeall); returns
+** whether the result passes the code checker
+*/
+int luaK_optimize (lua_State *L, Proto *f) {
+  int i;
+  optimize(L, f);
+  for (i = 0; i < f->sizep; i++)
+    if (!luaK_optimize(L, f->p[i])) return 0;
+  return luaG_checkcode(L, f);
+}
@@ -0,0 +1,17 @@
+/*
+** $Id: lopt.h $
+** Optimizer of precompiled functions (see luac.c)
+** See Copyright Notice in lua.h
+*/
+
+#ifndef lopt_h
+#define lopt_h
+
+
+#include "lobject.h"
+
+
+LUAI_FUNC int luaK_optimize (lua_State *L, Proto *f);
+
+
+#endif
@@ -371,7 +371,7 @@ static void close_func (LexState *ls) {
   f->sizelocvars = fs->nlocvars;
   luaM_reallocvector(L, f->upvalues, f->sizeupvalues, f->nups, TString *);
   f->sizeupvalues = f->nups;
-  lua_assert(luaG_checkcode(f));
+  lua_assert(luaG_checkcode(L, f));
   lua_assert(fs->bl == NULL);
   ls->fs = fs->prev;
   /* last token read was anchored in defunct function; must reanchor it */
@@ -495,11 +495,118 @@ static void listfield (LexState *ls, struct ConsControl *cc) {
 }
 
 
+/*
+** Table templates. A constructor whose items are all constants becomes
+** an OP_TEMPLATE copying a table built at compile time by running its
+** code: that table has the layout (and traversal order) of the one the
+** code would build, and building it costs one run of that code. A copy
+** only pays when the constructor runs more than once, so constructors
+** of code that runs once (the main chunk outside loops, such as a data
+** file) and very large ones are left alone.
+*/
+
+#define MAXTEMPLATE	1024	/* most items in a template */
+
+/* registers a template's code may use above its table */
+#define TREGS		(LFIELDS_PER_FLUSH + 3)
+
+/* register `r' and RK operand `x' in `runconstructor' */
+#define treg(r)	(((r) > a && (r) - a <= TREGS) ? &reg[(r) - a - 1] : NULL)
+#define trk(x)		(ISK(x) ? &f->k[INDEXK(x)] : treg(x))
+
+
+static int runsmany (FuncState *fs) {
+  BlockCnt *bl;
+  if (fs->prev != NULL) return 1;  /* a function may be called many times */
+  for (bl = fs->bl; bl; bl = bl->previous)
+    if (bl->isbreakable) return 1;  /* in a loop */
+  return 0;
+}
+
+
+/*
+** run the code of the constructor whose OP_NEWTABLE is at `pc' into `t',
+** which has the sizes given by that instruction; returns 0 if the code
+** does anything but store constants (and templates, as values)
+*/
+static int runconstructor (FuncState *fs, int pc, Table *t) {
+  lua_State *L = fs->L;
+  Proto *f = fs->f;
+  int a = GETARG_A(f->code[pc]);
+  TValue reg[TREGS];  /* registers a+1 ... a+TREGS */
+  int r;
+  for (r = 0; r < TREGS; r++) setnilvalue(&reg[r]);
+  for (pc++; pc < fs->pc; pc++) {
+    Instruction i = f->code[pc];
+    TValue *ra = treg(GETARG_A(i));
+    switch (GET_OPCODE(i)) {
+      case OP_LOADK: case OP_TEMPLATE: {
+        if (ra == NULL) return 0;
+        setobj(L, ra, &f->k[GETARG_Bx(i)]);
+        break;
+      }
+      case OP_LOADBOOL: {
+        if (ra == NULL || GETARG_C(i)) return 0;
+        setbvalue(ra, GETARG_B(i));
+        break;
+      }
+      case OP_LOADNIL: {
+        TValue *rb = treg(GETARG_B(i));
+        if (ra == NULL || rb == NULL) return 0;
+        for (; ra <= rb; ra++) setnilvalue(ra);
+        break;
+      }
+      case OP_SETTABLE: {
+        const TValue *key = trk(GETARG_B(i));
+        const TValue *val = trk(GETARG_C(i));
+        if (GETARG_A(i) != a || key == NULL || val == NULL ||
+            ttisnil(key) || ttistable(key) ||
+            (ttisnumber(key) && luai_numisnan(nvalue(key))))
+          return 0;
+        setobj2t(L, luaH_set(L, t, key), val);
+        break;
+      }
+      case OP_SETLIST: {  /* as in luaV_execute */
+        int n = GETARG_B(i);
+        int c = GETARG_C(i);
+        int last;
+        if (GETARG_A(i) != a || n == 0 || n > TREGS) return 0;
+        if (c == 0) c = cast_int(f->code[++pc]);
+        last = ((c-1)*LFIELDS_PER_FLUSH) + n;
+        if (last > t->sizearray)
+          luaH_resizearray(L, t, last);
+        for (; n > 0; n--)
+          setobj2t(L, luaH_setnum(L, t, last--), &reg[n - 1]);
+        break;
+      }
+      default: return 0;
+    }
+  }
+  return 1;
+}
+
+#undef treg
+#undef trk
+
+
+static void maketemplate (FuncState *fs, int pc, int nk) {
+  lua_State *L = fs->L;
+  Instruction i = fs->f->code[pc];
+  Table *t = luaH_new(L, luaO_fb2int(GETARG_B(i)), luaO_fb2int(GETARG_C(i)));
+  sethvalue(L, L->top, t);  /* anchor it */
+  incr_top(L);
+  if (runconstructor(fs, pc, t))
+    luaK_template(fs, pc, nk, t);
+  L->top--;
+}
+
+
 static void constructor (LexState *ls, expdesc *t) {
   /* constructor -> ?? */
   FuncState *fs = ls->fs;
   int line = ls->linenumber;
   int pc = luaK_codeABC(fs, OP_NEWTABLE, 0, 0, 0);
+  int nk = fs->nk;
   struct ConsControl cc;
   cc.na = cc.nh = cc.tostore = 0;
   cc.t = t;
@@ -534,6 +641,9 @@ static void constructor (LexState *ls, expdesc *t) {
   lastlistfield(fs, &cc);
   SETARG_B(fs->f->code[pc], luaO_int2fb(cc.na)); /* set initial array size */
   SETARG_C(fs->f->code[pc], luaO_int2fb(cc.nh));  /* set initial table size */
+  if (cc.na + cc.nh > 0 && cc.na + cc.nh <= MAXTEMPLATE &&
+      fs->lasttarget <= pc && runsmany(fs))
+    maketemplate(fs, pc, nk);
 }
 
 /* }====================================================================== */
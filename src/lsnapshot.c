@@ -0,0 +1,724 @@
+/*
+** $Id: lsnapshot.c $
+** save and load images of a whole Lua state
+** See Copyright Notice in lua.h
+*/
+
+#include <string.h>
+
+#define lsnapshot_c
+#define LUA_CORE
+
+#include "lua.h"
+
+#include "ldo.h"
+#include "lfunc.h"
+#include "lgc.h"
+#include "lmem.h"
+#include "lobject.h"
+#include "lstate.h"
+#include "lstring.h"
+#include "ltable.h"
+#include "lundump.h"
+#include "lzio.h"
+
+/*
+* An image holds every object reachable from the registry, the table of
+* globals and the metatables of the basic types. Objects named in the
+* registry table LUA_PERMANENTS (C functions, userdata, library tables)
+* are written by name and found by name in the state being loaded; the
+* contents of named tables are written too, and replace theirs.
+*
+* After the header and the object counts come the objects, first their
+* shells (what is needed to create them, with their sizes) and then
+* their contents (what they refer to), so that neither the writer nor the
+* reader recurses over the object graph. Lua closures come last among
+* the shells, because theirs refer to prototypes and upvalues. Numbers
+* and sizes are in the native format: images are meant to be loaded by
+* the program that wrote them.
+*/
+
+/* shells */
+#define S_STRING	0	/* size_t length, bytes */
+#define S_PERMANENT	1	/* name (as a string) */
+#define S_PERMTABLE	2	/* name; contents as S_TABLE */
+#define S_TABLE		3	/* int sizearray, int hash entries */
+#define S_PROTO		4	/* precompiled chunk (see luaU_dump) */
+#define S_UPVAL		5	/* (nothing) */
+#define S_CLOSURE	6	/* int prototype, int n, n * int upvalue */
+
+/* values */
+#define V_NIL		0
+#define V_FALSE		1
+#define V_TRUE		2
+#define V_NUMBER	3	/* lua_Number */
+#define V_OBJECT	4	/* int index (from 1) */
+
+#define SNAPBUFFER	8192
+
+typedef struct {
+    lua_State* L;
+    lua_Writer writer;
+    void* data;
+    int status;
+    Table* seen;		/* object (as light userdata) -> index */
+    Table* names;		/* permanent object -> name */
+    Table* perms;		/* LUA_PERMANENTS (never saved) */
+    GCObject** objs;		/* objects, by traversal order */
+    int nobjs;
+    int sizeobjs;
+    int* index;			/* traversal order -> index in the image */
+    size_t n;			/* bytes in `buff' */
+    char buff[SNAPBUFFER];
+} SaveState;
+
+static void save_flush(SaveState* S) {
+    if (S->status == 0 && S->n > 0) {
+        lua_unlock(S->L);
+        S->status = (*S->writer)(S->L, S->buff, S->n, S->data);
+        lua_lock(S->L);
+    }
+    S->n = 0;
+}
+
+static void save_block(SaveState* S, const void* b, size_t size) {
+    if (S->n + size > SNAPBUFFER) {
+        save_flush(S);
+        if (size >= SNAPBUFFER) {
+            if (S->status == 0) {
+                lua_unlock(S->L);
+                S->status = (*S->writer)(S->L, b, size, S->data);
+                lua_lock(S->L);
+            }
+            return;
+        }
+    }
+    if (size > 0) memcpy(S->buff + S->n, b, size);
+    S->n += size;
+}
+
+#define save_var(S,x)	save_block(S, &(x), sizeof(x))
+
+static void save_byte(SaveState* S, int b) {
+    char c = (char)b;
+    save_var(S, c);
+}
+
+static void save_int(SaveState* S, int x) {
+    save_var(S, x);
+}
+
+static void save_string(SaveState* S, const TString* s) {
+    size_t len = s->tsv.len;
+    save_var(S, len);
+    save_block(S, getstr(s), len);
+}
+
+static void save_error(SaveState* S, const char* what) {
+    luaO_pushfstring(S->L, "cannot save %s in state image", what);
+    luaD_throw(S->L, LUA_ERRRUN);
+}
+
+static const TValue* permanent_name(SaveState* S, GCObject* o) {
+    TValue v;
+    if (o->gch.tt > LAST_TAG) return luaO_nilobject;  /* prototype or upvalue */
+    setgcovalue(S->L, &v, o);
+    return luaH_get(S->names, &v);
+}
+
+/* index of `o' in traversal order (from 1), adding it if new */
+static int mark_object(SaveState* S, GCObject* o) {
+    TValue k;
+    const TValue* i;
+    setpvalue(&k, o);
+    i = luaH_get(S->seen, &k);
+    if (!ttisnil(i)) return (int)nvalue(i);
+    luaM_growvector(S->L, S->objs, S->nobjs, S->sizeobjs, GCObject*, MAX_INT,
+                    "too many objects");
+    S->objs[S->nobjs++] = o;
+    setnvalue(luaH_set(S->L, S->seen, &k), cast_num(S->nobjs));
+    return S->nobjs;
+}
+
+static void mark_value(SaveState* S, const TValue* v) {
+    if (iscollectable(v)) {
+        mark_object(S, gcvalue(v));
+    } else if (ttislightuserdata(v)) {
+        save_error(S, "a light userdata");
+    }
+}
+
+/* the table of permanents is left out of the registry */
+#define skipped(S,v)	(ttistable(v) && hvalue(v) == (S)->perms)
+
+static void traverse_table(SaveState* S, Table* h) {
+    int i;
+    if (h->metatable != NULL) mark_object(S, obj2gco(h->metatable));
+    for (i = 0; i < h->sizearray; i++) {
+        mark_value(S, &h->array[i]);
+    }
+    for (i = 0; i < sizenode(h); i++) {
+        Node* n = gnode(h, i);
+        if (!ttisnil(gval(n)) && !skipped(S, gval(n))) {
+            mark_value(S, key2tval(n));
+            mark_value(S, gval(n));
+        }
+    }
+}
+
+/* find every object to save, breadth first */
+static void traverse(SaveState* S) {
+    int i;
+    for (i = 0; i < S->nobjs; i++) {
+        GCObject* o = S->objs[i];
+        int permanent = !ttisnil(permanent_name(S, o));
+        switch (o->gch.tt) {
+            case LUA_TSTRING: {
+                break;
+            }
+            case LUA_TTABLE: {
+                traverse_table(S, gco2h(o));
+                break;
+            }
+            case LUA_TFUNCTION: {
+                Closure* cl = gco2cl(o);
+                if (!permanent) {
+                    int j;
+                    if (cl->c.isC) save_error(S, "a C function that is not a permanent");
+                    mark_object(S, obj2gco(cl->l.p));
+                    mark_object(S, obj2gco(cl->l.env));
+                    for (j = 0; j < cl->l.nupvalues; j++) {
+                        mark_object(S, obj2gco(cl->l.upvals[j]));
+                    }
+                }
+                break;
+            }
+            case LUA_TUPVAL: {
+                mark_value(S, gco2uv(o)->v);
+                break;
+            }
+            case LUA_TPROTO: {
+                luaU_materializeall(S->L, gco2p(o));  /* save whole functions */
+                break;
+            }
+            case LUA_TUSERDATA: {
+                if (!permanent) save_error(S, "a userdata that is not a permanent");
+                break;
+            }
+            default: {
+                if (!permanent) save_error(S, "a thread that is not a permanent");
+                break;
+            }
+        }
+    }
+}
+
+/* number objects so that closures come last */
+static void number_objects(SaveState* S) {
+    int i, n = 0;
+    S->index = luaM_newvector(S->L, S->nobjs, int);
+    for (i = 0; i < S->nobjs; i++) {
+        GCObject* o = S->objs[i];
+        if (o->gch.tt != LUA_TFUNCTION || !ttisnil(permanent_name(S, o))) {
+            S->index[i] = ++n;
+        }
+    }
+    for (i = 0; i < S->nobjs; i++) {
+        GCObject* o = S->objs[i];
+        if (o->gch.tt == LUA_TFUNCTION && ttisnil(permanent_name(S, o))) {
+            S->index[i] = ++n;
+        }
+    }
+}
+
+static int object_index(SaveState* S, GCObject* o) {
+    TValue k;
+    setpvalue(&k, o);
+    return S->index[(int)nvalue(luaH_get(S->seen, &k)) - 1];
+}
+
+static void save_value(SaveState* S, const TValue* v) {
+    switch (ttype(v)) {
+        case LUA_TNIL: {
+            save_byte(S, V_NIL);
+            break;
+        }
+        case LUA_TBOOLEAN: {
+            save_byte(S, bvalue(v) ? V_TRUE : V_FALSE);
+            break;
+        }
+        case LUA_TNUMBER: {
+            lua_Number x = nvalue(v);
+            save_byte(S, V_NUMBER);
+            save_var(S, x);
+            break;
+        }
+        default: {
+            save_byte(S, V_OBJECT);
+            save_int(S, object_index(S, gcvalue(v)));
+            break;
+        }
+    }
+}
+
+static int hash_entries(SaveState* S, const Table* h) {
+    int i, n = 0;
+    for (i = 0; i < sizenode(h); i++) {
+        if (!ttisnil(gval(gnode(h, i))) && !skipped(S, gval(gnode(h, i)))) n++;
+    }
+    return n;
+}
+
+static void save_shell(SaveState* S, GCObject* o) {
+    const TValue* name = permanent_name(S, o);
+    if (!ttisnil(name)) {
+        save_byte(S, (o->gch.tt == LUA_TTABLE) ? S_PERMTABLE : S_PERMANENT);
+        save_string(S, rawtsvalue(name));
+        return;
+    }
+    switch (o->gch.tt) {
+        case LUA_TSTRING: {
+            save_byte(S, S_STRING);
+            save_string(S, rawgco2ts(o));
+            break;
+        }
+        case LUA_TTABLE: {
+            save_byte(S, S_TABLE);
+            save_int(S, gco2h(o)->sizearray);
+            save_int(S, hash_entries(S, gco2h(o)));
+            break;
+        }
+        case LUA_TPROTO: {
+            save_byte(S, S_PROTO);
+            save_flush(S);
+            if (S->status == 0) {
+                S->status = luaU_dump(S->L, gco2p(o), S->writer, S->data, 0);
+            }
+            break;
+        }
+        case LUA_TUPVAL: {
+            save_byte(S, S_UPVAL);
+            break;
+        }
+        case LUA_TFUNCTION: {
+            Closure* cl = gco2cl(o);
+            int j;
+            save_byte(S, S_CLOSURE);
+            save_int(S, object_index(S, obj2gco(cl->l.p)));
+            save_int(S, cl->l.nupvalues);
+            for (j = 0; j < cl->l.nupvalues; j++) {
+                save_int(S, object_index(S, obj2gco(cl->l.upvals[j])));
+            }
+            break;
+        }
+    }
+}
+
+static void save_contents(SaveState* S, GCObject* o) {
+    switch (o->gch.tt) {
+        case LUA_TTABLE: {
+            Table* h = gco2h(o);
+            TValue mt;
+            int i;
+            if (h->metatable != NULL) {
+                sethvalue(S->L, &mt, h->metatable);
+            } else {
+                setnilvalue(&mt);
+            }
+            save_value(S, &mt);
+            save_int(S, h->sizearray);
+            for (i = 0; i < h->sizearray; i++) {
+                save_value(S, &h->array[i]);
+            }
+            for (i = 0; i < sizenode(h); i++) {
+                Node* n = gnode(h, i);
+                if (!ttisnil(gval(n)) && !skipped(S, gval(n))) {
+                    save_value(S, key2tval(n));
+                    save_value(S, gval(n));
+                }
+            }
+            save_byte(S, V_NIL);
+            break;
+        }
+        case LUA_TFUNCTION: {
+            if (ttisnil(permanent_name(S, o))) {
+                TValue env;
+                sethvalue(S->L, &env, gco2cl(o)->l.env);
+                save_value(S, &env);
+            }
+            break;
+        }
+        case LUA_TUPVAL: {
+            save_value(S, gco2uv(o)->v);
+            break;
+        }
+    }
+}
+
+static void f_save(lua_State* L, void* ud) {
+    SaveState* S = (SaveState*)ud;
+    const TValue* roots[2 + NUM_TAGS];
+    TValue mt[NUM_TAGS];
+    GCObject** order;
+    char h[LUAC_HEADERSIZE];
+    const TValue* perms;
+    int i, nroots = 0, nstrings = 0;
+
+    S->seen = luaH_new(L, 0, 0);
+    sethvalue2s(L, L->top, S->seen); incr_top(L);
+    S->names = luaH_new(L, 0, 0);
+    sethvalue2s(L, L->top, S->names); incr_top(L);
+    perms = luaH_getstr(hvalue(registry(L)), luaS_newliteral(L, LUA_PERMANENTS));
+    S->perms = NULL;
+    if (ttistable(perms)) {
+        Table* t = S->perms = hvalue(perms);
+        for (i = 0; i < sizenode(t); i++) {
+            Node* n = gnode(t, i);
+            if (ttisstring(key2tval(n)) && !ttisnil(gval(n))) {
+                setobj2t(L, luaH_set(L, S->names, gval(n)), key2tval(n));
+            }
+        }
+    }
+
+    roots[nroots++] = registry(L);
+    roots[nroots++] = gt(L);
+    for (i = 0; i < NUM_TAGS; i++) {
+        if (G(L)->mt[i] != NULL) {
+            sethvalue(L, &mt[i], G(L)->mt[i]);
+        } else {
+            setnilvalue(&mt[i]);
+        }
+        roots[nroots++] = &mt[i];
+    }
+    for (i = 0; i < nroots; i++) {
+        mark_value(S, roots[i]);
+    }
+    traverse(S);
+    number_objects(S);
+
+    /* objects in image order */
+    order = luaM_newvector(L, S->nobjs, GCObject*);
+    for (i = 0; i < S->nobjs; i++) {
+        order[S->index[i] - 1] = S->objs[i];
+        if (S->objs[i]->gch.tt == LUA_TSTRING) nstrings++;
+    }
+    luaM_freearray(L, S->objs, S->sizeobjs, GCObject*);
+    S->objs = order;
+    S->sizeobjs = S->nobjs;
+
+    luaU_header(h);
+    h[5] = (char)MY_LUAC_FORMAT_S;
+    save_block(S, h, LUAC_HEADERSIZE);
+    save_int(S, S->nobjs);
+    save_int(S, nstrings);
+    for (i = 0; i < S->nobjs; i++) {
+        save_shell(S, S->objs[i]);
+    }
+    for (i = 0; i < S->nobjs; i++) {
+        save_contents(S, S->objs[i]);
+    }
+    for (i = 0; i < nroots; i++) {
+        save_value(S, roots[i]);
+    }
+    save_flush(S);
+    L->top -= 2;  /* seen, names */
+}
+
+/*
+* save an image of the state; errors (objects that cannot be saved, lack
+* of memory) leave a message on the stack, while writer errors do not
+*/
+int luaU_dumpstate(lua_State* L, lua_Writer w, void* data) {
+    SaveState S;
+    int status;
+    S.L = L;
+    S.writer = w;
+    S.data = data;
+    S.status = 0;
+    S.objs = NULL;
+    S.nobjs = 0;
+    S.sizeobjs = 0;
+    S.index = NULL;
+    S.n = 0;
+    status = luaD_pcall(L, f_save, &S, savestack(L, L->top), L->errfunc);
+    luaM_freearray(L, S.objs, S.sizeobjs, GCObject*);
+    if (S.index != NULL) luaM_freearray(L, S.index, S.nobjs, int);
+    return (status != 0) ? status : S.status;
+}
+
+
+typedef struct {
+    lua_State* L;
+    ZIO* Z;
+    Mbuffer* b;
+    const char* chunkname;
+    const char* name;		/* for messages */
+    Table* perms;		/* LUA_PERMANENTS of the state being loaded */
+    GCObject** objs;		/* objects, by index in the image (from 1) */
+    lu_byte* kinds;		/* their shells */
+    int nobjs;
+} RestoreState;
+
+static void restore_error(RestoreState* S, const char* why) {
+    luaO_pushfstring(S->L, "%s: %s in state image", S->name, why);
+    luaD_throw(S->L, LUA_ERRSYNTAX);
+}
+
+#define IF(c,s)		if (c) restore_error(S,s)
+
+static void load_block(RestoreState* S, void* b, size_t size) {
+    size_t r = luaZ_read(S->Z, b, size);
+    IF (r != 0, "unexpected end");
+}
+
+#define load_var(S,x)	load_block(S, &(x), sizeof(x))
+
+static int load_byte(RestoreState* S) {
+    char c;
+    load_var(S, c);
+    return (unsigned char)c;
+}
+
+static int load_int(RestoreState* S) {
+    int x;
+    load_var(S, x);
+    IF (x < 0, "bad integer");
+    return x;
+}
+
+static TString* load_string(RestoreState* S) {
+    size_t len;
+    char* s;
+    load_var(S, len);
+    s = luaZ_openspace(S->L, S->b, len);
+    load_block(S, s, len);
+    return luaS_newlstr(S->L, s, len);
+}
+
+static GCObject* load_object(RestoreState* S, int kind) {
+    int i = load_int(S);
+    IF (i < 1 || i > S->nobjs || S->objs[i] == NULL, "bad object index");
+    IF (kind >= 0 && S->kinds[i] != kind, "bad object kind");
+    return S->objs[i];
+}
+
+static void load_value(RestoreState* S, TValue* v) {
+    switch (load_byte(S)) {
+        case V_NIL: {
+            setnilvalue(v);
+            break;
+        }
+        case V_FALSE: {
+            setbvalue(v, 0);
+            break;
+        }
+        case V_TRUE: {
+            setbvalue(v, 1);
+            break;
+        }
+        case V_NUMBER: {
+            lua_Number x;
+            load_var(S, x);
+            luaO_setnumber(v, x);
+            break;
+        }
+        case V_OBJECT: {
+            GCObject* o = load_object(S, -1);
+            IF (o->gch.tt > LAST_TAG, "bad object kind");
+            setgcovalue(S->L, v, o);
+            break;
+        }
+        default: {
+            restore_error(S, "bad value");
+        }
+    }
+}
+
+static Table* load_table(RestoreState* S) {
+    TValue v;
+    load_value(S, &v);
+    IF (!ttistable(&v), "table expected");
+    return hvalue(&v);
+}
+
+/* empty a named table, which gets the contents saved in the image */
+static void clear_table(RestoreState* S, Table* h) {
+    int i;
+    for (i = 0; i < h->sizearray; i++) {
+        setnilvalue(&h->array[i]);
+    }
+    for (i = 0; i < sizenode(h); i++) {
+        TValue* v = gval(gnode(h, i));
+        if (!ttisnil(v) && (!ttistable(v) || hvalue(v) != S->perms)) {
+            setnilvalue(v);  /* (the dummy node is read-only) */
+        }
+    }
+    h->metatable = NULL;
+}
+
+static GCObject* load_shell(RestoreState* S, int kind) {
+    lua_State* L = S->L;
+    switch (kind) {
+        case S_STRING: {
+            return obj2gco(load_string(S));
+        }
+        case S_PERMANENT:
+        case S_PERMTABLE: {
+            TString* name = load_string(S);
+            const TValue* v = luaH_getstr(S->perms, name);
+            if (!iscollectable(v) || (kind == S_PERMTABLE) != ttistable(v)) {
+                luaO_pushfstring(L, "%s: permanent " LUA_QS " not found", S->name,
+                                 getstr(name));
+                luaD_throw(L, LUA_ERRSYNTAX);
+            }
+            return gcvalue(v);
+        }
+        case S_TABLE: {
+            int narray = load_int(S);
+            int nhash = load_int(S);
+            return obj2gco(luaH_new(L, narray, nhash));
+        }
+        case S_PROTO: {
+            return obj2gco(luaU_undump(L, S->Z, S->b, S->chunkname));
+        }
+        case S_UPVAL: {
+            return obj2gco(luaF_newupval(L));
+        }
+        case S_CLOSURE: {
+            Proto* p = gco2p(load_object(S, S_PROTO));
+            int j, n = load_int(S);
+            Closure* cl;
+            IF (n != p->nups, "bad closure");
+            cl = luaF_newLclosure(L, n, hvalue(gt(L)));
+            cl->l.p = p;
+            for (j = 0; j < n; j++) {
+                cl->l.upvals[j] = gco2uv(load_object(S, S_UPVAL));
+            }
+            return obj2gco(cl);
+        }
+        default: {
+            restore_error(S, "bad object");
+            return NULL;
+        }
+    }
+}
+
+static void load_contents(RestoreState* S, int i) {
+    lua_State* L = S->L;
+    GCObject* o = S->objs[i];
+    switch (S->kinds[i]) {
+        case S_PERMTABLE:
+        case S_TABLE: {
+            Table* h = gco2h(o);
+            TValue k, v, mt;
+            int j, n;
+            load_value(S, &mt);
+            IF (!ttisnil(&mt) && !ttistable(&mt), "bad metatable");
+            h->metatable = ttisnil(&mt) ? NULL : hvalue(&mt);
+            n = load_int(S);
+            for (j = 1; j <= n; j++) {
+                load_value(S, &v);
+                setobj2t(L, luaH_setnum(L, h, j), &v);
+            }
+            for (;;) {
+                load_value(S, &k);
+                if (ttisnil(&k)) break;
+                load_value(S, &v);
+                setobj2t(L, luaH_set(L, h, &k), &v);
+            }
+            if (isblack(o)) luaC_barrierback(L, h);  /* an old table */
+            break;
+        }
+        case S_CLOSURE: {
+            gco2cl(o)->l.env = load_table(S);
+            break;
+        }
+        case S_UPVAL: {
+            load_value(S, gco2uv(o)->v);
+            break;
+        }
+    }
+}
+
+static void f_restore(lua_State* L, void* ud) {
+    RestoreState* S = (RestoreState*)ud;
+    char h[LUAC_HEADERSIZE], s[LUAC_HEADERSIZE];
+    const TValue* perms;
+    TValue v;
+    Udata* u;
+    int i, n, nstrings, size;
+
+    luaC_checkGC(L);
+    luaU_header(h);
+    h[5] = (char)MY_LUAC_FORMAT_S;
+    load_block(S, s, LUAC_HEADERSIZE);
+    IF (memcmp(h, s, LUAC_HEADERSIZE) != 0, "bad header");
+    perms = luaH_getstr(hvalue(registry(L)), luaS_newliteral(L, LUA_PERMANENTS));
+    S->perms = ttistable(perms) ? hvalue(perms) : luaH_new(L, 0, 0);
+    sethvalue2s(L, L->top, S->perms); incr_top(L);
+
+    n = load_int(S);
+    nstrings = load_int(S);
+    IF ((size_t)n >= MAX_SIZET/(sizeof(GCObject*) + 1), "bad object count");
+    u = luaS_newudata(L, (size_t)(n + 1) * (sizeof(GCObject*) + 1), hvalue(gt(L)));
+    setuvalue(L, L->top, u); incr_top(L);
+    S->objs = (GCObject**)(u + 1);
+    S->kinds = (lu_byte*)(S->objs + n + 1);
+    S->nobjs = n;
+    memset(S->objs, 0, (size_t)(n + 1) * sizeof(GCObject*));
+
+    /* make room for the strings at once (no collection runs while loading) */
+    size = G(L)->strt.size;
+    while (size < MAX_INT/2 && (lu_int32)size < (lu_int32)G(L)->strt.nuse + (lu_int32)nstrings) {
+        size *= 2;
+    }
+    if (size > G(L)->strt.size) luaS_resize(L, size);
+
+    for (i = 1; i <= n; i++) {
+        int kind = load_byte(S);
+        S->kinds[i] = (lu_byte)kind;
+        S->objs[i] = load_shell(S, kind);
+    }
+    for (i = 1; i <= n; i++) {
+        if (S->kinds[i] == S_PERMTABLE) clear_table(S, gco2h(S->objs[i]));
+    }
+    for (i = 1; i <= n; i++) {
+        load_contents(S, i);
+    }
+
+    load_value(S, &v);
+    IF (!ttistable(&v) || hvalue(&v) != hvalue(registry(L)), "bad registry");
+    load_value(S, &v);
+    IF (!ttistable(&v), "bad globals");
+    sethvalue(L, gt(L), hvalue(&v));
+    sethvalue(L, gt(G(L)->mainthread), hvalue(&v));
+    for (i = 0; i < NUM_TAGS; i++) {
+        load_value(S, &v);
+        IF (!ttisnil(&v) && !ttistable(&v), "bad metatable");
+        G(L)->mt[i] = ttisnil(&v) ? NULL : hvalue(&v);
+    }
+    L->top -= 2;  /* permanents, objects */
+}
+
+/*
+* load an image into the state, which should have the permanents of the
+* state that saved it; on errors the state may be left half loaded
+*/
+int luaU_loadstate(lua_State* L, ZIO* Z, const char* name) {
+    RestoreState S;
+    Mbuffer buff;
+    int status;
+    S.L = L;
+    S.Z = Z;
+    S.b = &buff;
+    S.chunkname = name;
+    if (*name == '@' || *name == '=') {
+        S.name = name + 1;
+    } else {
+        S.name = name;
+    }
+    luaZ_initbuffer(L, &buff);
+    status = luaD_pcall(L, f_restore, &S, savestack(L, L->top), L->errfunc);
+    luaZ_freebuffer(L, &buff);
+    return status;
+}
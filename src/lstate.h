@@ -90,6 +90,7 @@ typedef struct global_State {
   struct lua_State *mainthread;
   UpVal uvhead;  /* head of double-linked list of all open upvalues */
   struct Table *mt[NUM_TAGS];  /* metatables for basic types */
+  unsigned int nextlayout;  /* next value for a table `layout' */
   TString *tmname[TM_N];  /* array with tag-method names */
 } global_State;
 
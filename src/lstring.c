@@ -72,24 +72,56 @@ static TString *newlstr (lua_State *L, const char *str, size_t l,
 }
 
 
-TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
-  GCObject *o;
+static unsigned int hashlstr (const char *str, size_t l) {
   unsigned int h = cast(unsigned int, l);  /* seed */
   size_t step = (l>>5)+1;  /* if string is too long, don't hash all its chars */
   size_t l1;
   for (l1=l; l1>=step; l1-=step)  /* compute hash */
     h = h ^ ((h<<5)+(h>>2)+cast(unsigned char, str[l1-1]));
+  return h;
+}
+
+
+static TString *findlstr (lua_State *L, const char *str, size_t l,
+                          unsigned int h) {
+  GCObject *o;
   for (o = G(L)->strt.hash[lmod(h, G(L)->strt.size)];
        o != NULL;
        o = o->gch.next) {
     TString *ts = rawgco2ts(o);
-    if (ts->tsv.len == l && (memcmp(str, getstr(ts), l) == 0)) {
+    if (ts->tsv.hash == h && ts->tsv.len == l &&
+        (memcmp(str, getstr(ts), l) == 0)) {
       /* string may be dead */
       if (isdead(G(L), o)) changewhite(o);
       return ts;
     }
   }
-  return newlstr(L, str, l, h);  /* not found */
+  return NULL;
+}
+
+
+TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
+  unsigned int h = hashlstr(str, l);
+  TString *ts = findlstr(L, str, l, h);
+  return (ts != NULL) ? ts : newlstr(L, str, l, h);
+}
+
+
+/*
+** like `luaS_newlstr', for a string whose hash `h' is already known
+** (e.g., stored in a precompiled chunk); an interned string is found
+** without hashing, but a new string is created with `h' only if `check'
+** is off: otherwise `h' is checked first, as it may be wrong
+*/
+TString *luaS_newhlstr (lua_State *L, const char *str, size_t l,
+                        unsigned int h, int check) {
+  TString *ts = findlstr(L, str, l, h);
+  if (ts != NULL)
+    return ts;
+  else if (check && h != hashlstr(str, l))
+    return luaS_newlstr(L, str, l);
+  else
+    return newlstr(L, str, l, h);
 }
 
 
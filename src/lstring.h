@@ -26,6 +26,8 @@
 LUAI_FUNC void luaS_resize (lua_State *L, int newsize);
 LUAI_FUNC Udata *luaS_newudata (lua_State *L, size_t s, Table *e);
 LUAI_FUNC TString *luaS_newlstr (lua_State *L, const char *str, size_t l);
+LUAI_FUNC TString *luaS_newhlstr (lua_State *L, const char *str, size_t l,
+                                  unsigned int h, int check);
 
 
 #endif
@@ -138,18 +138,46 @@ static int str_char (lua_State *L) {
 
 
 static int writer (lua_State *L, const void* b, size_t size, void* B) {
-  (void)L;
-  luaL_addlstring((luaL_Buffer*) B, (const char *)b, size);
+  if (size > LUAL_BUFFERSIZE) {  /* large block? add it as a whole */
+    lua_pushlstring(L, (const char *)b, size);
+    luaL_addvalue((luaL_Buffer*) B);
+  }
+  else
+    luaL_addlstring((luaL_Buffer*) B, (const char *)b, size);
   return 0;
 }
 
 
+static int dumpoptions (lua_State *L, int arg) {
+  const char *opts = luaL_optstring(L, arg, "");
+  int options = 0;
+  for (; *opts; opts++) {
+    switch (*opts) {
+      case 's': options |= LUA_DUMP_STRIP; break;
+      case 'm': options |= LUA_DUMP_ALIGN; break;
+      case 't': options |= LUA_DUMP_STRPOOL; break;
+      case 'd': options |= LUA_DUMP_LAZY; break;
+      case 'c': options |= LUA_DUMP_COMPACT; break;
+      case 'z': options |= LUA_DUMP_COMPRESS; break;
+      case 'k': options |= LUA_DUMP_DIGEST; break;
+      case 'g': options |= LUA_DUMP_DEBUG; break;
+      case 'h': options |= LUA_DUMP_HASHES; break;
+      default:
+        luaL_argerror(L, arg,
+            lua_pushfstring(L, "invalid option " LUA_QL("%c"), *opts));
+    }
+  }
+  return options;
+}
+
+
 static int str_dump (lua_State *L) {
   luaL_Buffer b;
+  int options = dumpoptions(L, 2);
   luaL_checktype(L, 1, LUA_TFUNCTION);
   lua_settop(L, 1);
   luaL_buffinit(L,&b);
-  if (lua_dump(L, writer, &b) != 0)
+  if (lua_dumpx(L, writer, &b, options) != 0)
     luaL_error(L, "unable to dump given function");
   luaL_pushresult(&b);
   return 1;
@@ -73,8 +73,8 @@
 #define dummynode		(&dummynode_)
 
 static const Node dummynode_ = {
-  {{NULL}, LUA_TNIL},  /* value */
-  {{{NULL}, LUA_TNIL, NULL}}  /* key */
+  {NILCONSTANT},  /* value */
+  {{NILCONSTANT, NULL}}  /* key */
 };
 
 
@@ -118,7 +118,9 @@ static Node *mainposition (const Table *t, const TValue *key) {
 ** the array part of the table, -1 otherwise.
 */
 static int arrayindex (const TValue *key) {
-  if (ttisnumber(key)) {
+  if (ttisint(key))
+    return ivalue(key);
+  else if (ttisnumber(key)) {
     lua_Number n = nvalue(key);
     int k;
     lua_number2int(k, n);
@@ -163,7 +165,7 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
   int i = findindex(L, t, key);  /* find original element */
   for (i++; i < t->sizearray; i++) {  /* try first array part */
     if (!ttisnil(&t->array[i])) {  /* a non-nil value? */
-      setnvalue(key, cast_num(i+1));
+      setivalue(key, i+1);
       setobj2s(L, key+1, &t->array[i]);
       return 1;
     }
@@ -291,6 +293,7 @@ static void setnodevector (lua_State *L, Table *t, int size) {
   }
   t->lsizenode = cast_byte(lsize);
   t->lastfree = gnode(t, size);  /* all positions are free */
+  t->layout = G(L)->nextlayout++;
 }
 
 
@@ -371,6 +374,37 @@ Table *luaH_new (lua_State *L, int narray, int nhash) {
 }
 
 
+/*
+** copy of a table template (see OP_TEMPLATE), with the same sizes and
+** layout; values that are tables are templates too, and are copied
+*/
+Table *luaH_copy (lua_State *L, const Table *t) {
+  int i;
+  int nsize = (t->node == dummynode) ? 0 : sizenode(t);
+  Table *c = luaH_new(L, t->sizearray, nsize);
+  c->flags = 0;  /* keys may name metamethods */
+  if (t->sizearray > 0)
+    memcpy(c->array, t->array, t->sizearray * sizeof(TValue));
+  if (nsize > 0) {
+    memcpy(c->node, t->node, nsize * sizeof(Node));
+    for (i = 0; i < nsize; i++) {  /* relocate chains */
+      Node *n = gnext(gnode(t, i));
+      if (n != NULL) gnext(gnode(c, i)) = c->node + (n - t->node);
+    }
+    c->lastfree = c->node + (t->lastfree - t->node);
+  }
+  for (i = 0; i < c->sizearray; i++) {
+    if (ttistable(&c->array[i]))
+      sethvalue(L, &c->array[i], luaH_copy(L, hvalue(&c->array[i])));
+  }
+  for (i = 0; i < nsize; i++) {
+    TValue *v = gval(gnode(c, i));
+    if (ttistable(v)) sethvalue(L, v, luaH_copy(L, hvalue(v)));
+  }
+  return c;
+}
+
+
 void luaH_free (lua_State *L, Table *t) {
   if (t->node != dummynode)
     luaM_freearray(L, t->node, sizenode(t), Node);
@@ -414,6 +448,7 @@ static TValue *newkey (lua_State *L, Table *t, const TValue *key) {
       *n = *mp;  /* copy colliding node into free pos. (mp->next also goes) */
       gnext(mp) = NULL;  /* now `mp' is free */
       setnilvalue(gval(mp));
+      t->layout = G(L)->nextlayout++;  /* a key moved */
     }
     else {  /* colliding node is in its own main position */
       /* new node will go into free position */
@@ -422,7 +457,9 @@ static TValue *newkey (lua_State *L, Table *t, const TValue *key) {
       mp = n;
     }
   }
-  gkey(mp)->value = key->value; gkey(mp)->tt = key->tt;
+  else if (!ttisnil(key2tval(mp)))  /* reusing the node of a removed key? */
+    t->layout = G(L)->nextlayout++;  /* caches may still point to it */
+  setobj2t(L, key2tval(mp), key);
   luaC_barriert(L, t, key);
   lua_assert(ttisnil(gval(mp)));
   return gval(mp);
@@ -434,13 +471,14 @@ static TValue *newkey (lua_State *L, Table *t, const TValue *key) {
 */
 const TValue *luaH_getnum (Table *t, int key) {
   /* (1 <= key && key <= t->sizearray) */
-  if (cast(unsigned int, key-1) < cast(unsigned int, t->sizearray))
+  if (cast(unsigned int, key) - 1u < cast(unsigned int, t->sizearray))
     return &t->array[key-1];
   else {
     lua_Number nk = cast_num(key);
     Node *n = hashnum(t, nk);
     do {  /* check whether `key' is somewhere in the chain */
-      if (ttisnumber(gkey(n)) && luai_numeq(nvalue(gkey(n)), nk))
+      if (ttisint(gkey(n)) ? ivalue(gkey(n)) == key :
+          (ttisfloat(gkey(n)) && luai_numeq(fltvalue(gkey(n)), nk)))
         return gval(n);  /* that's it */
       else n = gnext(n);
     } while (n);
@@ -453,13 +491,22 @@ const TValue *luaH_getnum (Table *t, int key) {
 ** search function for strings
 */
 const TValue *luaH_getstr (Table *t, TString *key) {
+  Node *n = luaH_getstrnode(t, key);
+  return (n != NULL) ? gval(n) : luaO_nilobject;
+}
+
+
+/*
+** node holding string `key', or NULL
+*/
+Node *luaH_getstrnode (Table *t, TString *key) {
   Node *n = hashstr(t, key);
   do {  /* check whether `key' is somewhere in the chain */
     if (ttisstring(gkey(n)) && rawtsvalue(gkey(n)) == key)
-      return gval(n);  /* that's it */
+      return n;  /* that's it */
     else n = gnext(n);
   } while (n);
-  return luaO_nilobject;
+  return NULL;
 }
 
 
@@ -472,9 +519,12 @@ const TValue *luaH_get (Table *t, const TValue *key) {
     case LUA_TSTRING: return luaH_getstr(t, rawtsvalue(key));
     case LUA_TNUMBER: {
       int k;
-      lua_Number n = nvalue(key);
+      lua_Number n;
+      if (ttisint(key))
+        return luaH_getnum(t, ivalue(key));
+      n = fltvalue(key);
       lua_number2int(k, n);
-      if (luai_numeq(cast_num(k), nvalue(key))) /* index is int? */
+      if (luai_numeq(cast_num(k), n)) /* index is int? */
         return luaH_getnum(t, k);  /* use specialized version */
       /* else go through */
     }
@@ -505,13 +555,32 @@ TValue *luaH_set (lua_State *L, Table *t, const TValue *key) {
 }
 
 
+/*
+** slot for `key' in a table filled only with non-nil values, such as a
+** template being loaded: a key whose main position is still free cannot
+** be in the table, so it goes there without a search
+*/
+TValue *luaH_insert (lua_State *L, Table *t, const TValue *key) {
+  if (ttisstring(key) || ttisboolean(key)) {
+    Node *mp = mainposition(t, key);
+    if (ttisnil(gval(mp)) && mp != dummynode) {
+      t->flags = 0;
+      setobj2t(L, key2tval(mp), key);
+      luaC_barriert(L, t, key);
+      return gval(mp);
+    }
+  }
+  return luaH_set(L, t, key);
+}
+
+
 TValue *luaH_setnum (lua_State *L, Table *t, int key) {
   const TValue *p = luaH_getnum(t, key);
   if (p != luaO_nilobject)
     return cast(TValue *, p);
   else {
     TValue k;
-    setnvalue(&k, cast_num(key));
+    setivalue(&k, key);
     return newkey(L, t, &k);
   }
 }
@@ -46,6 +46,8 @@ static void print_usage (void) {
   "  -e stat  execute string " LUA_QL("stat") "\n"
   "  -l name  require library " LUA_QL("name") "\n"
   "  -i       enter interactive mode after executing " LUA_QL("script") "\n"
+  "  -s file  start from the state image " LUA_QL("file") "\n"
+  "  -w file  write a state image to " LUA_QL("file") " at the end\n"
   "  -v       show version information\n"
   "  --       stop handling options\n"
   "  -        execute stdin and stop handling options\n"
@@ -258,7 +260,8 @@ static int handle_script (lua_State *L, char **argv, int n) {
 #define notail(x)	{if ((x)[2] != '\0') return -1;}
 
 
-static int collectargs (char **argv, int *pi, int *pv, int *pe) {
+static int collectargs (char **argv, int *pi, int *pv, int *pe,
+                        const char **ps, const char **pw) {
   int i;
   for (i = 1; argv[i] != NULL; i++) {
     if (argv[i][0] != '-')  /* not an option? */
@@ -284,6 +287,16 @@ static int collectargs (char **argv, int *pi, int *pv, int *pe) {
           if (argv[i] == NULL) return -1;
         }
         break;
+      case 's':
+      case 'w': {
+        const char **pf = (argv[i][1] == 's') ? ps : pw;
+        *pf = argv[i] + 2;
+        if (**pf == '\0') {
+          *pf = argv[++i];
+          if (*pf == NULL) return -1;
+        }
+        break;
+      }
       default: return -1;  /* invalid option */
     }
   }
@@ -313,6 +326,11 @@ static int runargs (lua_State *L, char **argv, int n) {
           return 1;  /* stop if file fails */
         break;
       }
+      case 's':
+      case 'w': {
+        if (argv[i][2] == '\0') i++;  /* skip file name (done in `pmain') */
+        break;
+      }
       default: break;
     }
   }
@@ -320,6 +338,27 @@ static int runargs (lua_State *L, char **argv, int n) {
 }
 
 
+static int writer (lua_State *L, const void *p, size_t size, void *u) {
+  (void)L;
+  return (fwrite(p, size, 1, (FILE *)u) != 1) && (size != 0);
+}
+
+
+static int saveimage (lua_State *L, const char *name) {
+  int status, top = lua_gettop(L);
+  FILE *f = fopen(name, "wb");
+  if (f == NULL)
+    status = 1;
+  else {
+    status = lua_dumpstate(L, writer, f);
+    if (fclose(f) != 0) status = 1;
+  }
+  if (status && lua_gettop(L) == top)  /* no message? */
+    lua_pushfstring(L, "cannot write %s", name);
+  return report(L, status);
+}
+
+
 static int handle_luainit (lua_State *L) {
   const char *init = getenv(LUA_INIT);
   if (init == NULL) return 0;  /* status OK */
@@ -342,25 +381,35 @@ static int pmain (lua_State *L) {
   char **argv = s->argv;
   int script;
   int has_i = 0, has_v = 0, has_e = 0;
+  const char *image = NULL, *save = NULL;
   globalL = L;
   if (argv[0] && argv[0][0]) progname = argv[0];
   lua_gc(L, LUA_GCSTOP, 0);  /* stop collector during initialization */
   luaL_openlibs(L);  /* open libraries */
   lua_gc(L, LUA_GCRESTART, 0);
-  s->status = handle_luainit(L);
-  if (s->status != 0) return 0;
-  script = collectargs(argv, &has_i, &has_v, &has_e);
+  script = collectargs(argv, &has_i, &has_v, &has_e, &image, &save);
   if (script < 0) {  /* invalid args? */
     print_usage();
     s->status = 1;
     return 0;
   }
+  if (image != NULL || save != NULL)
+    luaL_setpermanents(L);  /* images refer to the libraries by name */
+  if (image != NULL) {
+    s->status = report(L, luaL_loadstatefile(L, image));
+    if (s->status != 0) return 0;
+  }
+  s->status = handle_luainit(L);
+  if (s->status != 0) return 0;
   if (has_v) print_version();
   s->status = runargs(L, argv, (script > 0) ? script : s->argc);
   if (s->status != 0) return 0;
   if (script)
     s->status = handle_script(L, argv, script);
   if (s->status != 0) return 0;
+  if (save != NULL)
+    s->status = saveimage(L, save);
+  if (s->status != 0) return 0;
   if (has_i)
     dotty(L);
   else if (script == 0 && !has_e && !has_v) {
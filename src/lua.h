@@ -203,8 +203,44 @@ LUA_API int   (lua_pcall) (lua_State *L, int nargs, int nresults, int errfunc);
 LUA_API int   (lua_cpcall) (lua_State *L, lua_CFunction func, void *ud);
 LUA_API int   (lua_load) (lua_State *L, lua_Reader reader, void *dt,
                                         const char *chunkname);
+LUA_API int   (lua_loadimage) (lua_State *L, const char *buff, size_t size,
+                                             const char *chunkname);
 
 LUA_API int (lua_dump) (lua_State *L, lua_Writer writer, void *data);
+LUA_API int (lua_dumpx) (lua_State *L, lua_Writer writer, void *data,
+                                       int options);
+
+
+/*
+** options for `lua_dumpx'
+*/
+#define LUA_DUMP_STRIP		1	/* strip debug information */
+#define LUA_DUMP_ALIGN		2	/* extended format with aligned vectors */
+#define LUA_DUMP_STRPOOL	4	/* share strings through a string pool */
+#define LUA_DUMP_LAZY		8	/* load nested functions on first use */
+#define LUA_DUMP_COMPACT	16	/* variable-length ints, delta lineinfo */
+#define LUA_DUMP_COMPRESS	32	/* compress the chunk */
+#define LUA_DUMP_DIGEST		64	/* add a SHA-256 digest of the chunk */
+#define LUA_DUMP_DEBUG		128	/* debug info loaded only when needed */
+#define LUA_DUMP_HASHES		256	/* store string hashes, to skip rehashing */
+
+/*
+** chunks whose digest is a key (a 32-byte string) with a true value in
+** this registry table load without bytecode verification
+*/
+#define LUA_TRUSTED	"_TRUSTED"
+
+
+/*
+** images of a whole state: objects that are values of this registry
+** table (name -> object) are saved by name, and found by name on loading
+** (see luaL_setpermanents)
+*/
+#define LUA_PERMANENTS	"_PERMANENTS"
+
+LUA_API int (lua_dumpstate) (lua_State *L, lua_Writer writer, void *data);
+LUA_API int (lua_loadstate) (lua_State *L, lua_Reader reader, void *data,
+                                          const char *chunkname);
 
 
 /*
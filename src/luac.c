@@ -14,12 +14,15 @@
 
 #include "lua.h"
 #include "lauxlib.h"
+#include "lualib.h"
 
+#include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
 #include "lmem.h"
 #include "lobject.h"
 #include "lopcodes.h"
+#include "lopt.h"
 #include "lstring.h"
 #include "lundump.h"
 
@@ -27,8 +30,19 @@
 #define	OUTPUT		PROGNAME ".out"	/* default output file */
 
 static int listing=0;			/* list bytecodes? */
+static int archiving=0;			/* write a module archive? */
 static int dumping=1;			/* dump bytecodes? */
+static int optimizing=0;		/* optimize bytecodes? */
 static int stripping=0;			/* strip debug information? */
+static int mappable=0;			/* use extended format with aligned vectors? */
+static int pooling=0;			/* share strings through a string pool? */
+static int deferring=0;			/* load nested functions on first use? */
+static int compact=0;			/* use the compact encoding? */
+static int compressing=0;		/* compress the output? */
+static int digesting=0;			/* add and print a digest? */
+static int splitting=0;			/* debug information in its own section? */
+static int hashing=0;			/* store string hashes? */
+static int threads=1;			/* number of threads parsing inputs */
 static char Output[]={ OUTPUT };	/* default output file name */
 static const char* output=Output;	/* actual output file name */
 static const char* progname=PROGNAME;	/* actual program name */
@@ -55,11 +69,22 @@ static void usage(const char* message)
  "usage: %s [options] [filenames].\n"
  "Available options are:\n"
  "  -        process stdin\n"
+ "  -a       write a module archive (arguments are files or name=file)\n"
+ "  -c       use the compact encoding (varints, delta-coded line info)\n"
+ "  -d       defer loading of nested functions until first use\n"
+ "  -g       keep debug information apart, loaded only when needed\n"
+ "  -h       store string hashes, so that loading does not rehash strings\n"
+ "  -j n     parse input files on n threads\n"
+ "  -k       add a digest (for trusted loading) and print it\n"
  "  -l       list\n"
+ "  -m       emit mappable bytecode (extended format, aligned vectors)\n"
  "  -o name  output to file " LUA_QL("name") " (default is \"%s\")\n"
+ "  -O       optimize (thread jumps, remove dead code, fold concatenations)\n"
  "  -p       parse only\n"
  "  -s       strip debug information\n"
+ "  -t       write strings once, in a string pool\n"
  "  -v       show version information\n"
+ "  -z       compress the output\n"
  "  --       stop handling options\n",
  progname,Output);
  exit(EXIT_FAILURE);
@@ -84,20 +109,46 @@ static int doargs(int argc, char* argv[])
   }
   else if (IS("-"))			/* end of options; use stdin */
    break;
+  else if (IS("-a"))			/* module archive */
+   archiving=1;
+  else if (IS("-c"))			/* compact encoding */
+   compact=1;
+  else if (IS("-d"))			/* lazy nested functions */
+   deferring=1;
+  else if (IS("-g"))			/* debug section */
+   splitting=1;
+  else if (IS("-h"))			/* string hashes */
+   hashing=1;
+  else if (IS("-j"))			/* parallel parsing */
+  {
+   const char* n=argv[++i];
+   if (n==NULL || (threads=atoi(n))<1)
+    usage(LUA_QL("-j") " needs a positive argument");
+  }
+  else if (IS("-k"))			/* digest */
+   digesting=1;
   else if (IS("-l"))			/* list */
    ++listing;
+  else if (IS("-m"))			/* mappable output */
+   mappable=1;
   else if (IS("-o"))			/* output file */
   {
    output=argv[++i];
    if (output==NULL || *output==0) usage(LUA_QL("-o") " needs argument");
    if (IS("-")) output=NULL;
   }
+  else if (IS("-O"))			/* optimize */
+   optimizing=1;
   else if (IS("-p"))			/* parse only */
    dumping=0;
   else if (IS("-s"))			/* strip debug information */
    stripping=1;
+  else if (IS("-t"))			/* string pool */
+   pooling=1;
   else if (IS("-v"))			/* show version */
    ++version;
+  else if (IS("-z"))			/* compress */
+   compressing=1;
   else					/* unknown option */
    usage(argv[i]);
  }
@@ -144,12 +195,358 @@ static const Proto* combine(lua_State* L, int n)
  }
 }
 
+static void optimize(lua_State* L, Proto* f)
+{
+ if (!luaK_optimize(L,f))
+  fatal(lua_pushfstring(L,"optimizer made bad code for %s",getstr(f->source)));
+}
+
 static int writer(lua_State* L, const void* p, size_t size, void* u)
 {
  UNUSED(L);
  return (fwrite(p,size,1,(FILE*)u)!=1) && (size!=0);
 }
 
+typedef struct
+{
+ char* b;
+ size_t size;
+ size_t allocated;
+} Buffer;
+
+static int bufwriter(lua_State* L, const void* p, size_t size, void* u)
+{
+ Buffer* B=(Buffer*)u;
+ UNUSED(L);
+ if (B->size+size>B->allocated)
+ {
+  size_t n=2*B->allocated+size;
+  char* b=(char*)realloc(B->b,n);
+  if (b==NULL) return 1;
+  B->b=b;
+  B->allocated=n;
+ }
+ memcpy(B->b+B->size,p,size);
+ B->size+=size;
+ return 0;
+}
+
+/* file named by an input argument; NULL for stdin */
+static const char* inputfile(const char* arg)
+{
+ const char* e= archiving ? strchr(arg,'=') : NULL;
+ if (e!=NULL) arg=e+1;
+ return (strcmp(arg,"-")==0) ? NULL : arg;
+}
+
+/*
+** parallel parsing: worker threads, each with a private state, parse
+** the inputs and dump them to memory; the main state then loads these
+** chunks in input order, so that the output is the same as without -j
+*/
+
+typedef struct
+{
+ const char* filename;
+ Buffer chunk;				/* dumped main function */
+ char* error;				/* why it could not be parsed */
+} Job;
+
+static Job* jobs=NULL;			/* one per input, if parsed in parallel */
+
+#if defined(LUA_USE_PTHREADS)
+
+#include <pthread.h>
+
+static int njobs=0;
+static int nextjob=0;
+static pthread_mutex_t joblock=PTHREAD_MUTEX_INITIALIZER;
+
+static int pparse(lua_State* L)
+{
+ Job* j=(Job*)lua_touserdata(L,1);
+ Proto* f;
+ if (luaL_loadfile(L,j->filename)!=0) lua_error(L);
+ f=toproto(L,-1);
+ luaU_materializeall(L,f);
+ lua_lock(L);
+ if (luaU_dump(L,f,bufwriter,&j->chunk,0)!=0)
+  luaG_runerror(L,"not enough memory for %s",j->filename);
+ lua_unlock(L);
+ return 0;
+}
+
+static char* copystring(const char* s)
+{
+ char* c=(char*)malloc(strlen(s)+1);
+ if (c==NULL) fatal("not enough memory for error message");
+ return strcpy(c,s);
+}
+
+static void* worker(void* u)
+{
+ lua_State* L=lua_open();
+ UNUSED(u);
+ for (;;)
+ {
+  Job* j=NULL;
+  pthread_mutex_lock(&joblock);
+  if (nextjob<njobs) j=&jobs[nextjob++];
+  pthread_mutex_unlock(&joblock);
+  if (j==NULL) break;
+  if (L==NULL)
+   j->error=copystring("not enough memory for state");
+  else if (lua_cpcall(L,pparse,j)!=0)
+  {
+   j->error=copystring(lua_tostring(L,-1));
+   lua_pop(L,1);
+  }
+ }
+ if (L!=NULL) lua_close(L);
+ return NULL;
+}
+
+static void parseall(int argc, char* argv[])
+{
+ pthread_t* t;
+ int i,n= (threads<argc) ? threads : argc;
+ jobs=(Job*)calloc(argc,sizeof(Job));
+ t=(pthread_t*)calloc(n,sizeof(pthread_t));
+ if (jobs==NULL || t==NULL) fatal("not enough memory for threads");
+ for (i=0; i<argc; i++) jobs[i].filename=inputfile(argv[i]);
+ njobs=argc;
+ for (i=0; i<n; i++)
+  if (pthread_create(&t[i],NULL,worker,NULL)!=0) fatal("cannot create thread");
+ for (i=0; i<n; i++) pthread_join(t[i],NULL);
+ free(t);
+}
+
+#else
+
+static void parseall(int argc, char* argv[])	/* no threads; parse later */
+{
+ UNUSED(argc); UNUSED(argv);
+}
+
+#endif
+
+/* load the i-th input, or its chunk parsed in parallel */
+static void load(lua_State* L, int i, const char* filename)
+{
+ if (jobs==NULL)
+ {
+  if (luaL_loadfile(L,filename)!=0) fatal(lua_tostring(L,-1));
+ }
+ else
+ {
+  Job* j=&jobs[i];
+  if (j->error!=NULL) fatal(j->error);
+  if (luaL_loadbuffer(L,j->chunk.b,j->chunk.size,"=?")!=0)
+   fatal(lua_tostring(L,-1));
+  free(j->chunk.b);
+  j->chunk.b=NULL;
+ }
+}
+
+static int dumpoptions(void)
+{
+ return (stripping ? LUA_DUMP_STRIP : 0) |
+        (mappable ? LUA_DUMP_ALIGN : 0) |
+        (pooling ? LUA_DUMP_STRPOOL : 0) |
+        (deferring ? LUA_DUMP_LAZY : 0) |
+        (compact ? LUA_DUMP_COMPACT : 0) |
+        (compressing ? LUA_DUMP_COMPRESS : 0) |
+        (digesting ? LUA_DUMP_DIGEST : 0) |
+        (splitting ? LUA_DUMP_DEBUG : 0) |
+        (hashing ? LUA_DUMP_HASHES : 0);
+}
+
+typedef struct
+{
+ size_t pos;				/* bytes written so far */
+ unsigned char digest[LUAC_DIGESTSIZE];
+} Digest;
+
+static int digestwriter(lua_State* L, const void* p, size_t size, void* u)
+{
+ Digest* d=(Digest*)u;
+ const unsigned char* b=(const unsigned char*)p;
+ size_t i;
+ UNUSED(L);
+ for (i=0; i<size; i++, d->pos++)
+  if (d->pos>=LUAC_HEADERSIZE_X && d->pos<LUAC_HEADERSIZE_X+LUAC_DIGESTSIZE)
+   d->digest[d->pos-LUAC_HEADERSIZE_X]=b[i];
+ return 0;
+}
+
+/* print the digest of f like sha256sum does; it follows the header */
+static void printdigest(lua_State* L, const Proto* f, const char* name)
+{
+ Digest d;
+ int i;
+ FILE* P= (output==NULL) ? stderr : stdout;
+ d.pos=0;
+ lua_lock(L);
+ luaU_dump(L,f,digestwriter,&d,dumpoptions() & ~LUA_DUMP_COMPRESS);
+ lua_unlock(L);
+ for (i=0; i<LUAC_DIGESTSIZE; i++) fprintf(P,"%02x",d.digest[i]);
+ fprintf(P,"  %s\n",name);
+}
+
+/*
+** module archives; see loadlib.c for their layout
+*/
+
+#define AR_HEADER	16		/* signature plus counts */
+#define AR_ENTRY	20		/* size of a module entry */
+
+typedef struct
+{
+ const char* name;			/* module name */
+ size_t length;				/* length of name */
+ size_t hash;
+ Buffer chunk;				/* dumped chunk */
+} Module;
+
+/* FNV-1a; must match archivehash in loadlib.c */
+static size_t archivehash(const char* s, size_t l)
+{
+ unsigned long h=2166136261UL;
+ for (; l>0; l--, s++) h=((h^(unsigned char)*s)*16777619UL) & 0xFFFFFFFFUL;
+ return (size_t)h;
+}
+
+static void writeword(size_t x, FILE* D)
+{
+ unsigned char b[4];
+ b[0]=(unsigned char)(x & 0xFF);
+ b[1]=(unsigned char)((x>>8) & 0xFF);
+ b[2]=(unsigned char)((x>>16) & 0xFF);
+ b[3]=(unsigned char)((x>>24) & 0xFF);
+ fwrite(b,4,1,D);
+}
+
+/*
+** module name of an argument: either name=file or a file name, from
+** which a leading "./", the ".lua" extension and a trailing "/init" are
+** removed and whose directory separators become dots; leaves the name
+** on the stack
+*/
+static const char* modname(lua_State* L, const char* arg, const char** filename)
+{
+ const char* e=strchr(arg,'=');
+ size_t l;
+ if (e!=NULL)
+ {
+  *filename= (strcmp(e+1,"-")==0) ? NULL : e+1;
+  lua_pushlstring(L,arg,e-arg);
+ }
+ else
+ {
+  *filename= (strcmp(arg,"-")==0) ? NULL : arg;
+  if (*filename==NULL) fatal("module archives need named modules (name=-)");
+  if (strncmp(arg,"." LUA_DIRSEP,2)==0) arg+=2;
+  l=strlen(arg);
+  if (l>4 && strcmp(arg+l-4,".lua")==0) l-=4;
+  lua_pushlstring(L,arg,l);
+  luaL_gsub(L,lua_tostring(L,-1),LUA_DIRSEP,".");
+  lua_remove(L,-2);
+  l=lua_objlen(L,-1);
+  if (l>5 && strcmp(lua_tostring(L,-1)+l-5,".init")==0)
+  {
+   lua_pushlstring(L,lua_tostring(L,-1),l-5);
+   lua_remove(L,-2);
+  }
+ }
+ return lua_tostring(L,-1);
+}
+
+static void archive(lua_State* L, int argc, char* argv[])
+{
+ Module* m=(Module*)calloc(argc,sizeof(Module));
+ unsigned int* slots;
+ size_t nslots=1,offset,mask;
+ int i,j;
+ FILE* D;
+ if (m==NULL) fatal("not enough memory for archive");
+ for (i=0; i<argc; i++)
+ {
+  const char* filename;
+  const Proto* f;
+  m[i].name=modname(L,argv[i],&filename);	/* stays on the stack */
+  m[i].length=lua_objlen(L,-1);
+  m[i].hash=archivehash(m[i].name,m[i].length);
+  load(L,i,filename);
+  f=toproto(L,-1);
+  luaU_materializeall(L,(Proto*)f);
+  if (optimizing) optimize(L,(Proto*)f);
+  if (listing) luaU_print(f,listing>1);
+  if (dumping)
+  {
+   lua_lock(L);
+   if (luaU_dump(L,f,bufwriter,&m[i].chunk,dumpoptions())!=0)
+    fatal("not enough memory for archive");
+   lua_unlock(L);
+   if (digesting) printdigest(L,f,m[i].name);
+  }
+  lua_pop(L,1);
+ }
+ if (!dumping) return;
+ while (nslots<2*(size_t)argc) nslots*=2;
+ mask=nslots-1;
+ slots=(unsigned int*)calloc(nslots,sizeof(unsigned int));
+ if (slots==NULL) fatal("not enough memory for archive");
+ for (i=0; i<argc; i++)
+ {
+  size_t k;
+  for (k=m[i].hash & mask; slots[k]!=0; k=(k+1) & mask)
+  {
+   const Module* o=&m[slots[k]-1];
+   if (o->length==m[i].length && memcmp(o->name,m[i].name,o->length)==0)
+    fatal(lua_pushfstring(L,"duplicate module " LUA_QS,m[i].name));
+  }
+  slots[k]=i+1;
+ }
+ D= (output==NULL) ? stdout : fopen(output,"wb");
+ if (D==NULL) cannot("open");
+ fwrite(LUA_ARCHIVESIG,sizeof(LUA_ARCHIVESIG)-1,1,D);
+ for (j=sizeof(LUA_ARCHIVESIG)-1; j<8; j++) fputc(0,D);
+ writeword(argc,D);
+ writeword(nslots,D);
+ for (offset=0; offset<nslots; offset++) writeword(slots[offset],D);
+ offset=AR_HEADER+4*nslots+AR_ENTRY*argc;
+ for (i=0; i<argc; i++) offset+=m[i].length;
+ offset=(offset+7) & ~(size_t)7;		/* chunks start at multiples of 8 */
+ for (i=0; i<argc; i++)
+ {
+  size_t name=AR_HEADER+4*nslots+AR_ENTRY*argc;
+  for (j=0; j<i; j++) name+=m[j].length;
+  writeword(m[i].hash,D);
+  writeword(name,D);
+  writeword(m[i].length,D);
+  writeword(offset,D);
+  writeword(m[i].chunk.size,D);
+  offset=(offset+m[i].chunk.size+7) & ~(size_t)7;
+ }
+ offset=AR_HEADER+4*nslots+AR_ENTRY*argc;
+ for (i=0; i<argc; i++)
+ {
+  fwrite(m[i].name,m[i].length,1,D);
+  offset+=m[i].length;
+ }
+ for (i=0; i<argc; i++)
+ {
+  for (; offset & 7; offset++) fputc(0,D);
+  fwrite(m[i].chunk.b,m[i].chunk.size,1,D);
+  offset+=m[i].chunk.size;
+  free(m[i].chunk.b);
+ }
+ if (ferror(D)) cannot("write");
+ if (fclose(D)) cannot("close");
+ free(slots);
+ free(m);
+}
+
 struct Smain {
  int argc;
  char** argv;
@@ -162,23 +559,27 @@ static int pmain(lua_State* L)
  char** argv=s->argv;
  const Proto* f;
  int i;
- if (!lua_checkstack(L,argc)) fatal("too many input files");
- for (i=0; i<argc; i++)
+ if (!lua_checkstack(L,argc+LUA_MINSTACK)) fatal("too many input files");
+ if (archiving)
  {
-  const char* filename=IS("-") ? NULL : argv[i];
-  if (luaL_loadfile(L,filename)!=0) fatal(lua_tostring(L,-1));
+  archive(L,argc,argv);
+  return 0;
  }
+ for (i=0; i<argc; i++) load(L,i,inputfile(argv[i]));
  f=combine(L,argc);
+ luaU_materializeall(L,(Proto*)f);	/* binary inputs may be lazy */
+ if (optimizing) optimize(L,(Proto*)f);
  if (listing) luaU_print(f,listing>1);
  if (dumping)
  {
   FILE* D= (output==NULL) ? stdout : fopen(output,"wb");
   if (D==NULL) cannot("open");
   lua_lock(L);
-  luaU_dump(L,f,writer,D,stripping);
+  luaU_dump(L,f,writer,D,dumpoptions());
   lua_unlock(L);
   if (ferror(D)) cannot("write");
   if (fclose(D)) cannot("close");
+  if (digesting) printdigest(L,f,(output==NULL) ? "stdout" : output);
  }
  return 0;
 }
@@ -190,6 +591,7 @@ int main(int argc, char* argv[])
  int i=doargs(argc,argv);
  argc-=i; argv+=i;
  if (argc<=0) usage("no input files given");
+ if (threads>1) parseall(argc,argv);
  L=lua_open();
  if (L==NULL) fatal("not enough memory for state");
  s.argc=argc;
@@ -56,19 +56,26 @@
 #define LUA_USE_ISATTY
 #define LUA_USE_POPEN
 #define LUA_USE_ULONGJMP
+#define LUA_USE_MMAP
+#define LUA_USE_PTHREADS	/* needs an extra library: -lpthread */
 #endif
 
 
 /*
-@@ LUA_PATH and LUA_CPATH are the names of the environment variables that
-@* Lua check to set its paths.
+@@ LUA_PATH, LUA_CPATH and LUA_ARCHIVE are the names of the environment
+@* variables that Lua check to set its paths.
 @@ LUA_INIT is the name of the environment variable that Lua
 @* checks for initialization code.
+@@ LUA_BYTECODECACHE is the name of the environment variable that sets
+@* package.bytecodecache, the directory of the bytecode cache used by
+@* luaL_loadfile.
 ** CHANGE them if you want different names.
 */
 #define LUA_PATH        "LUA_PATH"
 #define LUA_CPATH       "LUA_CPATH"
+#define LUA_ARCHIVE     "LUA_ARCHIVE"
 #define LUA_INIT	"LUA_INIT"
+#define LUA_BYTECODECACHE	"LUA_BYTECODECACHE"
 
 
 /*
@@ -104,6 +111,12 @@
 	"./?.so;"  LUA_CDIR"?.so;" LUA_CDIR"loadall.so"
 #endif
 
+/*
+@@ LUA_ARCHIVE_DEFAULT is the default list of module archives (written
+@* by luac -a) that Lua searches before LUA_PATH.
+*/
+#define LUA_ARCHIVE_DEFAULT	""
+
 
 /*
 @@ LUA_DIRSEP is the directory separator (for submodules).
@@ -382,6 +395,21 @@
 #endif
 
 
+/*
+@@ LUA_USE_JUMPTABLE makes the interpreter dispatch each instruction
+@* through a table of labels instead of a switch.
+** CHANGE it to 0 if your compiler takes labels as values (a GNU
+** extension) but you want the portable switch anyway.
+*/
+#if !defined(LUA_USE_JUMPTABLE)
+#if defined(__GNUC__) && !defined(LUA_ANSI)
+#define LUA_USE_JUMPTABLE	1
+#else
+#define LUA_USE_JUMPTABLE	0
+#endif
+#endif
+
+
 /*
 @@ LUAI_BITSINT defines the number of bits in an int.
 ** CHANGE here if Lua cannot automatically detect the number of bits of
@@ -511,6 +539,46 @@
 #define LUAI_UACNUMBER	double
 
 
+/*
+@@ LUA_NANBOX packs each value in 8 bytes, keeping the type of anything
+@* but a number inside the bits of a NaN (see lobject.h).
+@@ LUAI_UINT64 is an unsigned integer type with exactly 64 bits.
+** CHANGE it (define LUA_NANBOX) to halve the size of the stack, of
+** tables and of constants, but only if numbers are doubles and all
+** addresses fit in 47 bits: objects from the allocator and light
+** userdata too. This holds on 32-bit machines and on usual 64-bit ones
+** (e.g. x86-64 and ARM64 Linux user space).
+*/
+/* #define LUA_NANBOX */
+
+#if defined(LUA_NANBOX)
+#if !defined(LUA_NUMBER_DOUBLE)
+#error "LUA_NANBOX needs LUA_NUMBER to be double"
+#endif
+#define LUAI_UINT64	unsigned long long
+#endif
+
+
+/*
+@@ LUA_USE_JIT compiles the functions that run often to machine code.
+@@ LUAI_JITHOT is the number of calls plus loop iterations after which
+@* a function is compiled.
+** CHANGE it (define LUA_USE_JIT) to speed up numeric loops on x86-64
+** POSIX systems (see ljit.c). It needs numbers to be doubles and works
+** only with the default layout of values (not with LUA_NANBOX).
+*/
+/* #define LUA_USE_JIT */
+#define LUAI_JITHOT	64
+
+#if defined(LUA_USE_JIT)
+#if !defined(__x86_64__) || !defined(LUA_USE_POSIX)
+#error "LUA_USE_JIT needs an x86-64 POSIX system"
+#elif !defined(LUA_NUMBER_DOUBLE) || defined(LUA_NANBOX)
+#error "LUA_USE_JIT needs double numbers and no LUA_NANBOX"
+#endif
+#endif
+
+
 /*
 @@ LUA_NUMBER_SCAN is the format for reading numbers.
 @@ LUA_NUMBER_FMT is the format for writing numbers.
@@ -728,6 +796,22 @@ union luai_Cast { double l_d; long l_l; };
 #define luai_userstateyield(L,n)	((void)L)
 
 
+/*
+@@ luai_imageref/luai_imageunref increment/decrement the reference
+@* count of a shared code image (see luaL_newimage) and return the new
+@* count.
+** CHANGE them if states using the same image run in different threads
+** and your compiler has no __sync builtins.
+*/
+#if defined(__GNUC__)
+#define luai_imageref(n)	__sync_add_and_fetch(&(n), 1)
+#define luai_imageunref(n)	__sync_sub_and_fetch(&(n), 1)
+#else
+#define luai_imageref(n)	(++(n))
+#define luai_imageunref(n)	(--(n))
+#endif
+
+
 /*
 @@ LUA_INTFRMLEN is the length modifier for integer conversions
 @* in 'string.format'.
@@ -39,6 +39,12 @@ LUALIB_API int (luaopen_debug) (lua_State *L);
 #define LUA_LOADLIBNAME	"package"
 LUALIB_API int (luaopen_package) (lua_State *L);
 
+#define LUA_MARSHALLIBNAME	"marshal"
+LUALIB_API int (luaopen_marshal) (lua_State *L);
+
+/* signature of module archives (see loadlib.c) */
+#define LUA_ARCHIVESIG	"\033LuaA\1"
+
 
 /* open all previous libraries */
 LUALIB_API void (luaL_openlibs) (lua_State *L); 
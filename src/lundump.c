@@ -16,19 +16,51 @@
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
+#include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lstate.h"
 #include "lstring.h"
+#include "ltable.h"
 #include "lundump.h"
 #include "lzio.h"
 
-typedef struct {
+typedef struct LoadState {
  lua_State* L;
  ZIO* Z;
  Mbuffer* b;
  const char* name;
+ size_t pos;			/* bytes read so far */
+ int extended;			/* extended portable format? */
+ int options;			/* options from the extended header */
+ Table* pool;			/* string pool (or NULL) */
+ int lazy;			/* loading a deferred body at run time? */
+ int trusted;			/* skip code verification? */
+ Sha256* sha;			/* hash of what is read (or NULL) */
+ GCObject* dsection;		/* debug section (or NULL) */
+ GCObject* downer;		/* object holding the bytes of `dsection' */
+ /* readers for the byte order of this machine (see setup_load_funcs) */
+ int (*load_int)(struct LoadState* S);
+ size_t (*load_size_t)(struct LoadState* S);
+ void (*load_byte4_vector)(struct LoadState* S, uint32_t ** pv, int * pn, int * pborrowed);
+ lua_Number (*load_number)(struct LoadState* S);
 } LoadState;
 
+/*
+* the debug section of a chunk, kept in a userdata: where its records
+* are and where each one starts; when the chunk is not an in-memory
+* image, the records are copied into the userdata, after the offsets
+*/
+typedef struct DebugSection {
+    const char* b;		/* records */
+    size_t pos;			/* offset of `b' from the start of the chunk */
+    int options;		/* options from the chunk header */
+    int n;			/* number of records */
+    int offsets[1];		/* n+1 offsets into `b' */
+} DebugSection;
+
+#define tosection(o)	((DebugSection*)(rawgco2u(o) + 1))
+
 #ifdef LUAC_TRUST_BINARIES
 #define IF(c,s)
 #define error(S,s)
@@ -38,6 +70,7 @@ typedef struct {
 static void error(LoadState* S, const char* why)
 {
  luaO_pushfstring(S->L,"%s: %s in precompiled chunk",S->name,why);
+ if (S->lazy) luaG_errormsg(S->L);
  luaD_throw(S->L,LUA_ERRSYNTAX);
 }
 #endif
@@ -51,6 +84,8 @@ static void LoadBlock(LoadState* S, void* b, size_t size)
 {
  size_t r=luaZ_read(S->Z,b,size);
  IF (r!=0, "unexpected end");
+ if (S->sha!=NULL) luaU_sha256update(S->sha,b,size);
+ S->pos+=size;
 }
 
 static int LoadChar(LoadState* S)
@@ -99,6 +134,64 @@ static void LoadCode(LoadState* S, Proto* f)
 
 static Proto* LoadFunction(LoadState* S, TString* p);
 
+static void LoadConstant(LoadState* S, TValue* o);
+
+/*
+* table template (see DumpTable); keys must be valid table keys that a
+* constructor could have stored, and nesting is bounded as in the parser
+*/
+static void LoadTable(LoadState* S, TValue* o)
+{
+ lua_State* L=S->L;
+ Table* t;
+ TValue k,v;
+ int i,n,na,nh;
+ IF (++L->nCcalls>LUAI_MAXCCALLS, "bad constant");
+ na=LoadInt(S);
+ nh=LoadInt(S);
+ n=LoadInt(S);
+ IF (na<0 || nh<0 || n<0 || n>nh, "bad constant");
+ t=luaH_new(L,na,nh);
+ sethvalue(L,o,t);
+ for (i=0; i<na; i++) LoadConstant(S,&t->array[i]);
+ for (i=0; i<n; i++)
+ {
+  LoadConstant(S,&k);
+  IF (!(ttisboolean(&k) || ttisstring(&k) ||
+       (ttisnumber(&k) && !luai_numisnan(nvalue(&k)))), "bad constant");
+  LoadConstant(S,&v);
+  IF (ttisnil(&v), "bad constant");
+  setobj2t(L,luaH_insert(L,t,&k),&v);
+ }
+ L->nCcalls--;
+}
+
+static void LoadConstant(LoadState* S, TValue* o)
+{
+ int t=LoadChar(S);
+ switch (t)
+ {
+  case LUA_TNIL:
+   setnilvalue(o);
+   break;
+  case LUA_TBOOLEAN:
+   setbvalue(o,LoadChar(S)!=0);
+   break;
+  case LUA_TNUMBER:
+   luaO_setnumber(o,LoadNumber(S));
+   break;
+  case LUA_TSTRING:
+   setsvalue2n(S->L,o,LoadString(S));
+   break;
+  case LUA_TTABLE:
+   LoadTable(S,o);
+   break;
+  default:
+   error(S,"bad constant");
+   break;
+ }
+}
+
 static void LoadConstants(LoadState* S, Proto* f)
 {
  int i,n;
@@ -106,29 +199,7 @@ static void LoadConstants(LoadState* S, Proto* f)
  f->k=luaM_newvector(S->L,n,TValue);
  f->sizek=n;
  for (i=0; i<n; i++) setnilvalue(&f->k[i]);
- for (i=0; i<n; i++)
- {
-  TValue* o=&f->k[i];
-  int t=LoadChar(S);
-  switch (t)
-  {
-   case LUA_TNIL:
-    setnilvalue(o);
-    break;
-   case LUA_TBOOLEAN:
-    setbvalue(o,LoadChar(S)!=0);
-    break;
-   case LUA_TNUMBER:
-    setnvalue(o,LoadNumber(S));
-    break;
-   case LUA_TSTRING:
-    setsvalue2n(S->L,o,LoadString(S));
-    break;
-   default:
-    error(S,"bad constant");
-    break;
-  }
- }
+ for (i=0; i<n; i++) LoadConstant(S,&f->k[i]);
  n=LoadInt(S);
  f->p=luaM_newvector(S->L,n,Proto*);
  f->sizep=n;
@@ -176,26 +247,44 @@ static Proto* LoadFunction(LoadState* S, TString* p)
  LoadCode(S,f);
  LoadConstants(S,f);
  LoadDebug(S,f);
- IF (!luaG_checkcode(f), "bad code");
+ IF (!luaG_checkcode(S->L,f), "bad code");
  S->L->top--;
  S->L->nCcalls--;
  return f;
 }
 
-static int check_header(LoadState* S) {
-    char h[LUAC_HEADERSIZE];
-    char s[LUAC_HEADERSIZE];
+/*
+* returns 0 for the official format, 1 for the portable ones and 2 for a
+* compressed container; reads the options word of the extended portable
+* format
+*/
+static int check_header(LoadState* S, int container) {
+    char h[LUAC_HEADERSIZE_X];
+    unsigned char s[LUAC_HEADERSIZE_X];
 
     LoadBlock(S,s,LUAC_HEADERSIZE);
 
     luaU_header_p(h);
     if (memcmp(h, s, LUAC_HEADERSIZE) == 0) {
         return 1;
-    } else {
-        luaU_header(h);
-        IF (memcmp(h,s,LUAC_HEADERSIZE)!=0, "bad header");
-        return 0;
     }
+    luaU_header_x(h, 0);
+    if (memcmp(h, s, LUAC_HEADERSIZE) == 0) {
+        LoadBlock(S, s + LUAC_HEADERSIZE, 4);
+        S->extended = 1;
+        S->options  = (int)((uint32_t)s[12]         | ((uint32_t)s[13] << 8) |
+                            ((uint32_t)s[14] << 16) | ((uint32_t)s[15] << 24));
+        IF (S->options & ~LUAC_X_KNOWN, "unsupported options");
+        return 1;
+    }
+    luaU_header_z(h);
+    if (memcmp(h, s, LUAC_HEADERSIZE) == 0) {
+        IF (!container, "nested compressed chunk");
+        return 2;
+    }
+    luaU_header(h);
+    IF (memcmp(h,s,LUAC_HEADERSIZE)!=0, "bad header");
+    return 0;
 }
 
 /*
@@ -216,13 +305,11 @@ void luaU_header (char* h)
  *h++=(char)(((lua_Number)0.5)==0);     /* is lua_Number integral? */
 }
 
-#define MY_LUAC_FORMAT 0x66
-
-void luaU_header_p (char* h) {
+static void make_header_p (char* h, int format) {
     memcpy(h,LUA_SIGNATURE,sizeof(LUA_SIGNATURE)-1);
     h   += sizeof(LUA_SIGNATURE)-1;
     *h++ =(char)LUAC_VERSION;
-    *h++ =(char)MY_LUAC_FORMAT;
+    *h++ =(char)format;
 
     *h++ = (char)1; // endianness
     *h++ = (char)4; // sizeof int
@@ -233,10 +320,36 @@ void luaU_header_p (char* h) {
     *h++ = (char)(((lua_Number)0.5)==0);
 }
 
-static int (*load_int)(LoadState* S) = NULL;
-static size_t (*load_size_t)(LoadState* S) = NULL;
-static uint32_t*  (*load_byte4_vector)(LoadState* S, int * pn) = NULL;
-static lua_Number (*load_number)(LoadState* S) = NULL;
+void luaU_header_p (char* h) {
+    make_header_p(h, MY_LUAC_FORMAT);
+}
+
+/*
+* make header of a compressed container, which holds a whole chunk
+*/
+void luaU_header_z (char* h) {
+    make_header_p(h, MY_LUAC_FORMAT_Z);
+}
+
+/*
+* make extended header: the portable header followed by the options
+* word, little-endian
+*/
+void luaU_header_x (char* h, int options) {
+    uint32_t x = (uint32_t)options;
+    make_header_p(h, MY_LUAC_FORMAT_X);
+    h += LUAC_HEADERSIZE;
+    *h++ = (char)(x & 0xFF);
+    *h++ = (char)((x >> 8) & 0xFF);
+    *h++ = (char)((x >> 16) & 0xFF);
+    *h++ = (char)((x >> 24) & 0xFF);
+}
+
+/* kept in the LoadState, as threads may load at the same time (luac -j) */
+#define load_int(S)			((S)->load_int(S))
+#define load_size_t(S)			((S)->load_size_t(S))
+#define load_byte4_vector(S,pv,pn,pb)	((S)->load_byte4_vector(S,pv,pn,pb))
+#define load_number(S)			((S)->load_number(S))
 
 static int load_int_o(LoadState* S) {
     int32_t x;
@@ -266,14 +379,130 @@ static size_t load_size_t_s(LoadState* S) {
     return (size_t)x;
 }
 
+static size_t load_varint(LoadState* S) {
+    size_t x = 0;
+    int shift = 0;
+    int b;
+    do {
+        IF (shift >= (int)(8*sizeof(size_t)), "bad varint");
+        b = LoadByte(S);
+        x |= (size_t)(b & 0x7F) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return x;
+}
+
+/* see dump_integer and dump_delta in ldump.c */
+static int load_integer(LoadState* S) {
+    if (S->options & LUAC_X_COMPACT) {
+        size_t x = load_varint(S);
+        IF (x > (size_t)MAX_INT, "bad integer");
+        return (int)x;
+    }
+    return load_int(S);
+}
+
+static int load_delta(LoadState* S, int prev) {
+    size_t z = load_varint(S);
+    IF (z > 0xFFFFFFFFu, "bad integer");
+    int32_t d = (int32_t)(((uint32_t)z >> 1) ^ (0u - ((uint32_t)z & 1)));
+    return (int)(int32_t)((uint32_t)prev + (uint32_t)d);
+}
+
+/*
+* read the string pool into the array part of a table, which stays on
+* the stack (to keep the strings alive) until the chunk is loaded
+*/
+/* see dump_hash in ldump.c */
+static lu_int32 load_hash(LoadState* S) {
+    unsigned char b[4];
+    if (!(S->options & LUAC_X_HASHES)) return 0;
+    LoadBlock(S, b, 4);
+    return (lu_int32)b[0] | ((lu_int32)b[1] << 8) |
+           ((lu_int32)b[2] << 16) | ((lu_int32)b[3] << 24);
+}
+
+/*
+* intern a string read from the chunk; a stored hash saves hashing it,
+* and is taken on trust for new strings only in trusted chunks whose
+* digest was already checked (lazy bodies): until then (S->sha != NULL)
+* a forged chunk could still put strings with wrong hashes in the table
+*/
+static TString* new_string(LoadState* S, const char* s, size_t len, lu_int32 h) {
+    if (S->options & LUAC_X_HASHES) {
+        int check = !S->trusted || S->sha != NULL;
+        return luaS_newhlstr(S->L, s, len, (unsigned int)h, check);
+    }
+    return luaS_newlstr(S->L, s, len);
+}
+
+static void load_pool(LoadState* S) {
+    int i;
+    size_t n = load_varint(S);
+    IF (n > (size_t)MAX_INT, "bad string pool");
+    S->pool = luaH_new(S->L, (int)n, 0);
+    sethvalue2s(S->L, S->L->top, S->pool); incr_top(S->L);
+    for (i = 0; i < (int)n; i++) {
+        size_t len = load_varint(S);
+        lu_int32 h = load_hash(S);
+        char* s = luaZ_openspace(S->L, S->b, len);
+        LoadBlock(S, s, len);
+        setsvalue2n(S->L, &S->pool->array[i], new_string(S, s, len, h));
+    }
+}
+
+/*
+* read the digest of the chunk, trust the chunk if the digest is a key
+* of the registry table LUA_TRUSTED, and start hashing it to check the
+* digest once it is loaded (functions are never run before that)
+*/
+static void load_digest(LoadState* S, unsigned char* digest, Sha256* sha) {
+    char h[LUAC_HEADERSIZE_X];
+    const TValue* t;
+    LoadBlock(S, digest, LUAC_DIGESTSIZE);
+    t = luaH_getstr(hvalue(registry(S->L)), luaS_newliteral(S->L, LUA_TRUSTED));
+    if (ttistable(t)) {
+        TString* d = luaS_newlstr(S->L, (const char*)digest, LUAC_DIGESTSIZE);
+        S->trusted = !l_isfalse(luaH_getstr(hvalue(t), d));
+    }
+    luaU_sha256init(sha);
+    luaU_header_x(h, S->options);
+    luaU_sha256update(sha, h, LUAC_HEADERSIZE_X);
+    S->sha = sha;
+}
+
+static void check_digest(LoadState* S, const unsigned char* digest) {
+    unsigned char d[LUAC_DIGESTSIZE];
+    luaU_sha256final(S->sha, d);
+    S->sha = NULL;
+    IF (memcmp(d, digest, LUAC_DIGESTSIZE) != 0, "digest mismatch");
+}
+
 static TString* load_string(LoadState* S) {
+    if (S->pool != NULL) {
+        size_t i = load_varint(S);
+        IF (i > (size_t)S->pool->sizearray, "bad string index");
+        return (i == 0) ? NULL : rawtsvalue(&S->pool->array[i-1]);
+    }
+    if (S->options & LUAC_X_COMPACT) {  /* no trailing '\0' */
+        size_t size = load_varint(S);
+        if (size == 0) {
+            return NULL;
+        } else {
+            lu_int32 h = load_hash(S);
+            char* s=luaZ_openspace(S->L,S->b,size-1);
+            LoadBlock(S,s,size-1);
+            return new_string(S,s,size-1,h);
+        }
+    }
     uint64_t size = load_size_t(S);
     if (size==0) {
         return NULL;
     } else {
+        lu_int32 h = load_hash(S);
         char* s=luaZ_openspace(S->L,S->b,size);
         LoadBlock(S,s,size);
-        return luaS_newlstr(S->L,s,size-1);
+        return new_string(S,s,size-1,h);
     }
 }
 
@@ -293,189 +522,730 @@ static lua_Number load_number_s(LoadState* S) {
     return (lua_Number)du.d;
 }
 
-static uint32_t * load_byte4_vector_o(LoadState* S, int * pn) {
-    *pn = load_int(S);
-    uint32_t * ds = luaM_newvector(S->L,*pn,uint32_t);
-    LoadVector(S,ds,*pn,sizeof(uint32_t));
-    return ds;
+/*
+* in the extended format, vectors of 4-byte items start at offsets that
+* are multiples of 4 from the beginning of the chunk
+*/
+static void load_align(LoadState* S) {
+    char pad[4];
+    if (S->extended && (S->pos & 3) != 0) {
+        LoadBlock(S, pad, 4 - (S->pos & 3));
+    }
+}
+
+/*
+* borrow the next `size' bytes straight from the in-memory image being
+* loaded, when there is one and they are aligned; NULL otherwise
+*/
+static const void * load_direct(LoadState* S, size_t size) {
+    const char * p;
+    if (S->Z->owner == NULL || ((size_t)S->Z->p & 3) != 0) {
+        return NULL;
+    }
+    p = luaZ_direct(S->Z, size);
+    if (p != NULL) {
+        if (S->sha != NULL) luaU_sha256update(S->sha, p, size);
+        S->pos += size;
+    }
+    return p;
+}
+
+/*
+* the vector is stored in *pv and *pn before it is filled, so that it
+* is freed with the Proto owning them if loading fails
+*/
+static void load_byte4_vector_o(LoadState* S, uint32_t ** pv, int * pn, int * pborrowed) {
+    int n = load_integer(S);
+    load_align(S);
+    uint32_t * ds = (uint32_t *)load_direct(S, (size_t)n * sizeof(uint32_t));
+    *pborrowed = (ds != NULL);
+    if (ds == NULL) {
+        ds = luaM_newvector(S->L,n,uint32_t);
+    }
+    *pv = ds;
+    *pn = n;
+    if (!*pborrowed) {
+        LoadVector(S,ds,n,sizeof(uint32_t));
+    }
+}
+
+static void load_byte4_vector_s(LoadState* S, uint32_t ** pv, int * pn, int * pborrowed) {
+    int n = load_integer(S);
+    load_align(S);
+    *pborrowed = 0;
+    uint32_t * ds = luaM_newvector(S->L,n,uint32_t);
+    *pv = ds;
+    *pn = n;
+    LoadVector(S,ds,n,sizeof(uint32_t));
+    luaU_swap4((lu_int32 *)ds, (const lu_int32 *)ds, (size_t)n);
 }
 
-static uint32_t * load_byte4_vector_s(LoadState* S, int *pn) {
-    *pn = load_int(S);
-    uint32_t * ds = luaM_newvector(S->L,*pn,uint32_t);
-    LoadVector(S,ds,*pn,sizeof(uint32_t));
-    for (int i = 0; i < *pn; i++) {
-        ds[i] = BSWAP_32(ds[i]);
+/*
+* the loop body is four independent swaps with no aliasing between
+* iterations, which compilers turn into vector byte shuffles (AltiVec,
+* NEON, SSSE3) on targets that have them
+*/
+void luaU_swap4 (lu_int32* d, const lu_int32* s, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        lu_int32 a = s[i], b = s[i+1], c = s[i+2], e = s[i+3];
+        d[i]   = BSWAP_32(a);
+        d[i+1] = BSWAP_32(b);
+        d[i+2] = BSWAP_32(c);
+        d[i+3] = BSWAP_32(e);
+    }
+    for (; i < n; i++) {
+        d[i] = BSWAP_32(s[i]);
     }
-    return ds;
 }
 
 static void setup_load_funcs(LoadState* S) {
-    if (load_int == NULL) {
-        int x = 0x1;
-        if (*(int8_t *)&x) {
-            load_int          = load_int_o;
-            load_size_t       = load_size_t_o;
-            load_byte4_vector = load_byte4_vector_o;
-        } else {
-            load_int          = load_int_s;
-            load_size_t       = load_size_t_s;
-            load_byte4_vector = load_byte4_vector_s;
-        }
+    int x = 0x1;
+    double d = 1.2344999991522893623141499119810760021209716796875;
+    if (*(int8_t *)&x) {
+        S->load_int          = load_int_o;
+        S->load_size_t       = load_size_t_o;
+        S->load_byte4_vector = load_byte4_vector_o;
+    } else {
+        S->load_int          = load_int_s;
+        S->load_size_t       = load_size_t_s;
+        S->load_byte4_vector = load_byte4_vector_s;
     }
-    if (load_number == NULL) {
-        double d = 1.2344999991522893623141499119810760021209716796875;
-        if (memcmp(&d, "\x78\x56\x34\x12\x83\xC0\xF3\x3F", 8) == 0) {
-            load_number = load_number_o;
-        } else if (memcmp(&d, "\x3F\xF3\xC0\x83\x12\x34\x56\x78", 8) == 0) {
-            load_number = load_number_s;
-        } else {
-            luaO_pushfstring(S->L,"load: unknown number format");
-            luaD_throw(S->L, LUA_ERRERR);
-        }
+
+    if (memcmp(&d, "\x78\x56\x34\x12\x83\xC0\xF3\x3F", 8) == 0) {
+        S->load_number = load_number_o;
+    } else if (memcmp(&d, "\x3F\xF3\xC0\x83\x12\x34\x56\x78", 8) == 0) {
+        S->load_number = load_number_s;
+    } else {
+        luaO_pushfstring(S->L,"load: unknown number format");
+        luaD_throw(S->L, LUA_ERRERR);
     }
 }
 
 
 
 static void load_code(LoadState* S, Proto* f) {
-    int n;
-    uint32_t * v = load_byte4_vector(S, &n);
+    int n, borrowed;
 
     if (sizeof(Instruction) == sizeof(uint32_t)) {
-        f->sizecode = n;
-        f->code     = (Instruction *)v;
+        load_byte4_vector(S, (uint32_t **)&f->code, &f->sizecode, &borrowed);
+        if (borrowed) {
+            f->image     = S->Z->owner;
+            f->borrowed |= PROTO_BCODE;
+        }
     } else {
+        uint32_t * v;
+        load_byte4_vector(S, &v, &n, &borrowed);
         f->sizecode = n;
         f->code     = luaM_newvector(S->L,n,Instruction);
         Instruction * pi = f->code;
         for (int i = 0; i < n; i++) {
             *pi++ = (Instruction)v[i];
         }
-        luaM_freearray(S->L, v, n, uint32_t);
+        if (!borrowed) {
+            luaM_freearray(S->L, v, n, uint32_t);
+        }
     }
 }
 
 static Proto* load_function(LoadState* S, TString* p);
+static Proto* load_stub(LoadState* S, TString* p);
+
+static void load_constant(LoadState* S, TValue* o);
+
+/* table template, with the checks of LoadTable */
+static void load_table(LoadState* S, TValue* o) {
+    lua_State* L = S->L;
+    Table* t;
+    TValue k, v;
+    int i, n, na, nh;
+    IF (++L->nCcalls > LUAI_MAXCCALLS, "bad constant");
+    na = load_integer(S);
+    nh = load_integer(S);
+    n = load_integer(S);
+    IF (na < 0 || nh < 0 || n < 0 || n > nh, "bad constant");
+    t = luaH_new(L, na, nh);
+    sethvalue(L, o, t);
+    for (i = 0; i < na; i++) {
+        load_constant(S, &t->array[i]);
+    }
+    for (i = 0; i < n; i++) {
+        load_constant(S, &k);
+        IF (!(ttisboolean(&k) || ttisstring(&k) ||
+              (ttisnumber(&k) && !luai_numisnan(nvalue(&k)))), "bad constant");
+        load_constant(S, &v);
+        IF (ttisnil(&v), "bad constant");  /* dumps hold none (see luaH_insert) */
+        setobj2t(L, luaH_insert(L, t, &k), &v);
+    }
+    L->nCcalls--;
+}
+
+static void load_constant(LoadState* S, TValue* o) {
+    int t=LoadChar(S);
+    switch (t) {
+        case LUA_TNIL:
+            setnilvalue(o);
+            break;
+        case LUA_TBOOLEAN:
+            setbvalue(o,LoadChar(S)!=0);
+            break;
+        case LUA_TNUMBER:
+            luaO_setnumber(o,load_number(S));
+            break;
+        case LUA_TSTRING: {
+            TString* s = load_string(S);
+            IF (s == NULL, "bad constant");
+            setsvalue2n(S->L,o,s);
+            break;
+        }
+        case LUA_TTABLE:
+            load_table(S, o);
+            break;
+        default:
+            error(S,"bad constant");
+            break;
+    }
+}
 
 static void load_constants(LoadState* S, Proto* f) {
     int i,n;
-    n=load_int(S);
+    n=load_integer(S);
     f->k=luaM_newvector(S->L,n,TValue);
     f->sizek=n;
     for (i=0; i<n; i++) setnilvalue(&f->k[i]);
     for (i=0; i<n; i++) {
-        TValue* o=&f->k[i];
-        int t=LoadChar(S);
-        switch (t) {
-            case LUA_TNIL:
-                setnilvalue(o);
-                break;
-            case LUA_TBOOLEAN:
-                setbvalue(o,LoadChar(S)!=0);
-                break;
-            case LUA_TNUMBER:
-                setnvalue(o,load_number(S));
-                break;
-            case LUA_TSTRING:
-                setsvalue2n(S->L,o,load_string(S));
-                break;
-            default:
-                error(S,"bad constant");
-                break;
-        }
+        load_constant(S, &f->k[i]);
     }
-    n=load_int(S);
+    n=load_integer(S);
     f->p=luaM_newvector(S->L,n,Proto*);
     f->sizep=n;
     for (i=0; i<n; i++) f->p[i]=NULL;
-    for (i=0; i<n; i++) f->p[i]=load_function(S,f->source);
+    for (i=0; i<n; i++) {
+        f->p[i] = (S->options & LUAC_X_LAZY) ? load_stub(S, f->source)
+                                             : load_function(S, f->source);
+    }
 }
 
-static void load_debug(LoadState* S, Proto* f) {
-    int i,n;
+/* compact lineinfo: differences from the previous line */
+static void load_lineinfo_compact(LoadState* S, Proto* f) {
+    int i, prev = f->linedefined;
+    int n = load_integer(S);
+    f->lineinfo=luaM_newvector(S->L,n,int);
+    f->sizelineinfo=n;
+    for (i=0; i<n; i++) {
+        f->lineinfo[i] = prev = load_delta(S, prev);
+    }
+}
 
-    int32_t * v = (int32_t*)load_byte4_vector(S, &n);
+static void load_debug(LoadState* S, Proto* f) {
+    int i,n,borrowed,prev;
 
-    f->sizelineinfo = n;
-    if (sizeof(int) == sizeof(int32_t) ) {
-        f->lineinfo = (int*)v;
+    if (S->options & LUAC_X_COMPACT) {
+        load_lineinfo_compact(S, f);
+    } else if (sizeof(int) == sizeof(int32_t) ) {
+        load_byte4_vector(S, (uint32_t **)&f->lineinfo, &f->sizelineinfo, &borrowed);
+        if (borrowed) {
+            f->image     = S->Z->owner;
+            f->borrowed |= PROTO_BLINEINFO;
+        }
     } else {
+        uint32_t * v;
+        load_byte4_vector(S, &v, &n, &borrowed);
+        f->sizelineinfo = n;
         f->lineinfo = luaM_newvector(S->L,n,int);
         int *pi = f->lineinfo;
         for (int i = 0; i<n; i++) {
-            *pi++ = (int)v[i];
+            *pi++ = (int)(int32_t)v[i];
+        }
+        if (!borrowed) {
+            luaM_freearray(S->L,v,n,uint32_t);
         }
-        luaM_freearray(S->L,v,n,int32_t);
     }
 
-    n = load_int(S);
+    n = load_integer(S);
     f->locvars=luaM_newvector(S->L,n,LocVar);
     f->sizelocvars=n;
 
     for (i=0; i<n; i++) f->locvars[i].varname=NULL;
+    prev = 0;
     for (i=0; i<n; i++) {
         f->locvars[i].varname=load_string(S);
-        f->locvars[i].startpc=load_int(S);
-        f->locvars[i].endpc=load_int(S);
+        if (S->options & LUAC_X_COMPACT) {
+            f->locvars[i].startpc = prev = load_delta(S, prev);
+            f->locvars[i].endpc   = load_delta(S, prev);
+            IF (f->locvars[i].startpc < 0 || f->locvars[i].endpc < 0, "bad integer");
+        } else {
+            f->locvars[i].startpc=load_int(S);
+            f->locvars[i].endpc=load_int(S);
+        }
     }
-    n=load_int(S);
+    n=load_integer(S);
     f->upvalues=luaM_newvector(S->L,n,TString*);
     f->sizeupvalues=n;
     for (i=0; i<n; i++) f->upvalues[i]=NULL;
     for (i=0; i<n; i++) f->upvalues[i]=load_string(S);
 }
 
-static Proto* load_function(LoadState* S, TString* p) {
-    Proto* f;
-    if (++S->L->nCcalls > LUAI_MAXCCALLS) error(S,"code too deep");
-
-    f=luaF_newproto(S->L);
-    setptvalue2s(S->L,S->L->top,f); incr_top(S->L);
+static void load_function_header(LoadState* S, Proto* f, TString* p) {
+    f->source=load_string(S); if (f->source==NULL) f->source=p;
 
-    f->source=LoadString(S); if (f->source==NULL) f->source=p;
-
-    f->linedefined     = load_int(S);
-    f->lastlinedefined = load_int(S);
+    f->linedefined     = load_integer(S);
+    f->lastlinedefined = load_integer(S);
     f->nups            = LoadByte(S);
     f->numparams       = LoadByte(S);
     f->is_vararg       = LoadByte(S);
     f->maxstacksize    = LoadByte(S);
+}
+
+/* reference to the debug record of `f', loaded by luaU_loaddebug */
+static void load_debugref(LoadState* S, Proto* f) {
+    int i = load_integer(S);
+    DebugRef* d;
+    IF (S->dsection == NULL || i >= tosection(S->dsection)->n, "bad debug index");
+    d = luaM_new(S->L, DebugRef);
+    d->section = S->dsection;
+    d->owner   = S->downer;
+    d->pool    = (S->pool != NULL) ? obj2gco(S->pool) : NULL;
+    d->index   = i;
+    f->debug   = d;
+}
 
+static void load_body(LoadState* S, Proto* f) {
     load_code(S,f);
     load_constants(S,f);
-    load_debug(S,f);
+    if (S->options & LUAC_X_DEBUG) {
+        load_debugref(S,f);
+    } else {
+        load_debug(S,f);
+    }
+
+    IF (!S->trusted && !luaG_checkcode(S->L, f), "bad code");
+}
 
-    IF (!luaG_checkcode(f), "bad code");
+static Proto* load_function(LoadState* S, TString* p) {
+    Proto* f;
+    if (++S->L->nCcalls > LUAI_MAXCCALLS) error(S,"code too deep");
+
+    f=luaF_newproto(S->L);
+    setptvalue2s(S->L,S->L->top,f); incr_top(S->L);
+
+    load_function_header(S, f, p);
+    if (S->options & LUAC_X_LAZY) {
+        size_t size = (size_t)load_int(S);
+        size_t start = S->pos;
+        load_body(S, f);
+        IF (S->pos - start != size, "bad function size");
+    } else {
+        load_body(S, f);
+    }
 
     S->L->top--;
     S->L->nCcalls--;
     return f;
 }
 
-
 /*
-** load precompiled chunk
+* load only the header of a nested function and keep its encoded body
+* for luaU_materialize: in place when loading from an in-memory image,
+* else copied into a userdata laid out like the image would be
 */
-Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name) {
-    LoadState S;
+static Proto* load_stub(LoadState* S, TString* p) {
+    Proto* f;
+    LazyBody* lb;
+    size_t size;
+
+    f=luaF_newproto(S->L);
+    setptvalue2s(S->L,S->L->top,f); incr_top(S->L);
+
+    load_function_header(S, f, p);
+    size = (size_t)load_int(S);
+    IF (size == 0, "bad function size");
+
+    lb = luaM_new(S->L, LazyBody);
+    lb->owner   = NULL;
+    lb->pool    = (S->pool != NULL) ? obj2gco(S->pool) : NULL;
+    lb->b       = NULL;
+    lb->size    = size;
+    lb->pos     = S->pos;
+    lb->options = S->options;
+    lb->trusted = (lu_byte)S->trusted;
+    lb->dsection = S->dsection;
+    lb->downer  = S->downer;
+    f->lazy = lb;
+
+    if (S->Z->owner != NULL) {
+        lb->b = luaZ_direct(S->Z, size);
+        IF (lb->b == NULL, "unexpected end");
+        if (S->sha != NULL) luaU_sha256update(S->sha, lb->b, size);
+        lb->owner = S->Z->owner;
+        lb->trusted = 0;  /* bytes may change before they are decoded */
+        S->pos += size;
+    } else {
+        Udata* u = luaS_newudata(S->L, size + 3, hvalue(gt(S->L)));
+        char* b = (char*)(u + 1) + (S->pos & 3);
+        lb->owner = obj2gco(u);
+        LoadBlock(S, b, size);
+        lb->b = b;
+    }
+
+    S->L->top--;
+    return f;
+}
+
+static void load_debug_section(LoadState* S) {
+    int i, n = load_integer(S);
+    int* offsets;
+    size_t size, hsize;
+    Udata* u;
+    DebugSection* ds;
+
+    IF (n <= 0 || (size_t)n >= MAX_SIZET/sizeof(int) - 1, "bad debug section");
+    offsets = (int*)luaZ_openspace(S->L, S->b, (size_t)(n + 1) * sizeof(int));
+    for (i = 0; i <= n; i++) {
+        offsets[i] = load_int(S);
+        IF ((i == 0) ? offsets[i] != 0 : offsets[i] < offsets[i-1], "bad debug section");
+    }
+    size = (size_t)offsets[n];
+    hsize = (offsetof(DebugSection, offsets) + (size_t)(n + 1) * sizeof(int) + 7) & ~(size_t)7;
+    u = luaS_newudata(S->L, hsize + ((S->Z->owner != NULL) ? 0 : size + 3), hvalue(gt(S->L)));
+    setuvalue(S->L, S->L->top, u); incr_top(S->L);
+    ds = (DebugSection*)(u + 1);
+    memcpy(ds->offsets, offsets, (size_t)(n + 1) * sizeof(int));
+    ds->n = n;
+    ds->options = S->options;
+    ds->pos = S->pos;
+    if (S->Z->owner != NULL) {
+        ds->b = luaZ_direct(S->Z, size);
+        IF (ds->b == NULL, "unexpected end");
+        if (S->sha != NULL) luaU_sha256update(S->sha, ds->b, size);
+        S->pos += size;
+        S->downer = S->Z->owner;
+    } else {
+        char* b = (char*)ds + hsize + (S->pos & 3);
+        LoadBlock(S, b, size);
+        ds->b = b;
+        S->downer = obj2gco(u);
+    }
+    S->dsection = obj2gco(u);
+}
 
+static const char* chunk_name(const char* name) {
     if (*name=='@' || *name=='=')
-        S.name = name+1;
+        return name+1;
     else if (*name==LUA_SIGNATURE[0])
-        S.name = "binary string";
+        return "binary string";
     else
-        S.name = name;
+        return name;
+}
+
+/*
+** load the deferred body of the i-th function nested in `f'; the loaded
+** function replaces the stub in f->p
+*/
+Proto* luaU_materialize (lua_State* L, Proto* f, int i) {
+    Proto* stub = f->p[i];
+    LazyBody* lb = stub->lazy;
+    Proto* nf;
+    LoadState S;
+    ZIO z;
+
+    lua_assert(lb != NULL);
+    luaZ_initimage(L, &z, lb->b, lb->size, lb->owner);
+    S.name = chunk_name(getstr(stub->source));
+    S.L = L;
+    S.Z = &z;
+    S.b = &G(L)->buff;
+    S.pos = lb->pos;
+    S.extended = 1;
+    S.options = lb->options;
+    S.pool = (lb->pool != NULL) ? gco2h(lb->pool) : NULL;
+    S.lazy = 1;
+    S.trusted = lb->trusted;
+    S.sha = NULL;
+    S.dsection = lb->dsection;
+    S.downer = lb->downer;
+    setup_load_funcs(&S);
+
+    if (++L->nCcalls > LUAI_MAXCCALLS) error(&S,"code too deep");
+    nf = luaF_newproto(L);
+    setptvalue2s(L,L->top,nf); incr_top(L);
+    nf->source          = stub->source;
+    nf->linedefined     = stub->linedefined;
+    nf->lastlinedefined = stub->lastlinedefined;
+    nf->nups            = stub->nups;
+    nf->numparams       = stub->numparams;
+    nf->is_vararg       = stub->is_vararg;
+    nf->maxstacksize    = stub->maxstacksize;
+    load_body(&S, nf);
+    if (S.pos - lb->pos != lb->size) error(&S, "bad function size");
+
+    f->p[i] = nf;
+    luaC_objbarrier(L, f, nf);
+    L->top--;
+    L->nCcalls--;
+    return nf;
+}
+
+void luaU_materializeall (lua_State* L, Proto* f) {
+    int i;
+    luaU_checkdebug(L, f);
+    for (i = 0; i < f->sizep; i++) {
+        if (f->p[i]->lazy != NULL) {
+            luaU_materialize(L, f, i);
+        }
+        luaU_materializeall(L, f->p[i]);
+    }
+}
+
+
+/* debug record being loaded into a scratch function (see luaU_loaddebug) */
+typedef struct DebugLoad {
+    LoadState S;
+    Proto t;                    /* takes the vectors until they check out */
+    size_t size;                /* size of the record */
+    int sizecode;               /* of the function that owns the record */
+} DebugLoad;
+
+static void f_loaddebug(lua_State* L, void* ud) {
+    DebugLoad* dl = (DebugLoad*)ud;
+    size_t start = dl->S.pos;
+    UNUSED(L);
+    load_debug(&dl->S, &dl->t);
+    if (dl->S.pos - start != dl->size ||
+        (dl->t.sizelineinfo != dl->sizecode && dl->t.sizelineinfo != 0)) {
+        error(&dl->S, "bad debug information");
+    }
+}
+
+/*
+** load the debug information of `f' from the debug section of its chunk;
+** its vectors stay in the section when they can be borrowed. They go to
+** `f' only once the whole record checks out: on errors `f' keeps its
+** reference to the record and no debug information at all
+*/
+void luaU_loaddebug (lua_State* L, Proto* f) {
+    DebugRef* d = f->debug;
+    DebugSection* ds = tosection(d->section);
+    GCObject* owner = d->owner;
+    int i = d->index;
+    DebugLoad dl;
+    LoadState* S = &dl.S;
+    ZIO z;
+    int status;
+
+    /* no GC can run while loading, so the section outlives this call */
+    if (f->image != NULL && f->image != owner) {
+        owner = NULL;  /* vectors already borrowed from elsewhere: copy */
+    }
+    luaZ_initimage(L, &z, ds->b + ds->offsets[i],
+                   (size_t)(ds->offsets[i+1] - ds->offsets[i]), owner);
+    S->name = chunk_name(getstr(f->source));
+    S->L = L;
+    S->Z = &z;
+    S->b = &G(L)->buff;
+    S->pos = ds->pos + (size_t)ds->offsets[i];
+    S->extended = 1;
+    S->options = ds->options;
+    S->pool = (d->pool != NULL) ? gco2h(d->pool) : NULL;
+    S->lazy = 1;
+    S->trusted = 0;
+    S->sha = NULL;
+    S->dsection = NULL;
+    S->downer = NULL;
+    setup_load_funcs(S);
+    memset(&dl.t, 0, sizeof(dl.t));
+    dl.t.linedefined = f->linedefined;
+    dl.size = (size_t)(ds->offsets[i+1] - ds->offsets[i]);
+    dl.sizecode = f->sizecode;
+
+    status = luaD_rawrunprotected(L, f_loaddebug, &dl);
+    if (status != 0) {  /* drop what was loaded; `f' stays as it was */
+        if (dl.t.lineinfo != NULL && !(dl.t.borrowed & PROTO_BLINEINFO))
+            luaM_freearray(L, dl.t.lineinfo, dl.t.sizelineinfo, int);
+        luaM_freearray(L, dl.t.locvars, dl.t.sizelocvars, LocVar);
+        luaM_freearray(L, dl.t.upvalues, dl.t.sizeupvalues, TString*);
+        luaD_throw(L, status);
+    }
+    f->lineinfo = dl.t.lineinfo;
+    f->sizelineinfo = dl.t.sizelineinfo;
+    if (dl.t.borrowed & PROTO_BLINEINFO) {
+        f->image = dl.t.image;
+        f->borrowed |= PROTO_BLINEINFO;
+    }
+    f->locvars = dl.t.locvars;
+    f->sizelocvars = dl.t.sizelocvars;
+    f->upvalues = dl.t.upvalues;
+    f->sizeupvalues = dl.t.sizeupvalues;
+    luaM_free(L, d);
+    f->debug = NULL;
+    for (i = 0; i < f->sizelocvars; i++) {
+        if (f->locvars[i].varname) luaC_objbarrier(L, f, f->locvars[i].varname);
+    }
+    for (i = 0; i < f->sizeupvalues; i++) {
+        if (f->upvalues[i]) luaC_objbarrier(L, f, f->upvalues[i]);
+    }
+}
+
+
+/*
+** SHA-256 (FIPS 180-4)
+*/
+
+static const lu_int32 sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x,n)  (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(Sha256* c, const unsigned char* p) {
+    lu_int32 w[64], a, b, d, e, f, g, h, cc;
+    int i;
+    for (i = 0; i < 16; i++) {
+        w[i] = ((lu_int32)p[4*i] << 24) | ((lu_int32)p[4*i+1] << 16) |
+               ((lu_int32)p[4*i+2] << 8) | (lu_int32)p[4*i+3];
+    }
+    for (i = 16; i < 64; i++) {
+        lu_int32 s0 = ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^ (w[i-15] >> 3);
+        lu_int32 s1 = ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    a = c->h[0]; b = c->h[1]; cc = c->h[2]; d = c->h[3];
+    e = c->h[4]; f = c->h[5]; g = c->h[6]; h = c->h[7];
+    for (i = 0; i < 64; i++) {
+        lu_int32 t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+                      ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        lu_int32 t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+                      ((a & b) ^ (a & cc) ^ (b & cc));
+        h = g; g = f; f = e; e = d + t1;
+        d = cc; cc = b; b = a; a = t1 + t2;
+    }
+    c->h[0] += a; c->h[1] += b; c->h[2] += cc; c->h[3] += d;
+    c->h[4] += e; c->h[5] += f; c->h[6] += g; c->h[7] += h;
+}
+
+void luaU_sha256init (Sha256* c) {
+    static const lu_int32 h0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(c->h, h0, sizeof(h0));
+    c->n = 0;
+}
+
+void luaU_sha256update (Sha256* c, const void* p, size_t n) {
+    const unsigned char* s = (const unsigned char*)p;
+    size_t used = c->n & 63;
+    if (n == 0) return;  /* `p' may then be NULL */
+    c->n += n;
+    if (used > 0) {
+        size_t m = 64 - used;
+        if (n < m) {
+            memcpy(c->b + used, s, n);
+            return;
+        }
+        memcpy(c->b + used, s, m);
+        sha256_block(c, c->b);
+        s += m;
+        n -= m;
+    }
+    for (; n >= 64; s += 64, n -= 64) {
+        sha256_block(c, s);
+    }
+    memcpy(c->b, s, n);
+}
+
+void luaU_sha256final (Sha256* c, unsigned char* digest) {
+    uint64_t bits = (uint64_t)c->n * 8;
+    unsigned char pad[72];
+    size_t used = c->n & 63;
+    size_t npad = (used < 56) ? 56 - used : 120 - used;
+    int i;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++) {
+        pad[npad + i] = (unsigned char)(bits >> (56 - 8*i));
+    }
+    luaU_sha256update(c, pad, npad + 8);
+    for (i = 0; i < 8; i++) {
+        digest[4*i]   = (unsigned char)(c->h[i] >> 24);
+        digest[4*i+1] = (unsigned char)(c->h[i] >> 16);
+        digest[4*i+2] = (unsigned char)(c->h[i] >> 8);
+        digest[4*i+3] = (unsigned char)c->h[i];
+    }
+}
+
+
+static Proto* undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name,
+                      int container) {
+    LoadState S;
+    Sha256 sha;
+    unsigned char digest[LUAC_DIGESTSIZE];
+    int format;
+
+    S.name = chunk_name(name);
     S.L = L;
     S.Z = Z;
     S.b = buff;
+    S.pos = 0;
+    S.extended = 0;
+    S.options = 0;
+    S.pool = NULL;
+    S.lazy = 0;
+    S.trusted = 0;
+    S.sha = NULL;
+    S.dsection = NULL;
+    S.downer = NULL;
 
-    if (check_header(&S)) {
+    format = check_header(&S, container);
+    if (format == 2) {  /* undump the chunk inside */
+        Proto* f;
+        ZIO z;
+        luaZ_initlz(L, &z, Z, S.name);
+        f = undump(L, &z, buff, name, 0);
+        L->top--;  /* buffers of z */
+        return f;
+    } else if (format == 1) {
+        Proto* f;
         setup_load_funcs(&S);
-        return load_function(&S,luaS_newliteral(L,"=?"));
+        if (S.options & LUAC_X_DIGEST) {
+            load_digest(&S, digest, &sha);
+        }
+        if (S.options & LUAC_X_STRPOOL) {
+            load_pool(&S);
+        }
+        if (S.options & LUAC_X_DEBUG) {
+            load_debug_section(&S);
+        }
+        f = load_function(&S,luaS_newliteral(L,"=?"));
+        if (S.sha != NULL) {
+            check_digest(&S, digest);
+        }
+        if (S.dsection != NULL) {
+            L->top--;  /* debug section */
+        }
+        if (S.pool != NULL) {
+            L->top--;  /* pool */
+        }
+        return f;
     } else {
         return LoadFunction(&S,luaS_newliteral(L,"=?"));
     }
+}
 
+/*
+** load precompiled chunk
+*/
+Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name) {
+    return undump(L, Z, buff, name, 1);
 }
 
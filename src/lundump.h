@@ -13,16 +13,30 @@
 /* load one chunk; from lundump.c */
 LUAI_FUNC Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name);
 
+/* load deferred nested functions; from lundump.c */
+LUAI_FUNC Proto* luaU_materialize (lua_State* L, Proto* f, int i);
+LUAI_FUNC void luaU_materializeall (lua_State* L, Proto* f);
+
+/* load deferred debug information; from lundump.c */
+LUAI_FUNC void luaU_loaddebug (lua_State* L, Proto* f);
+
+#define luaU_checkdebug(L,f)	{ if ((f)->debug != NULL) luaU_loaddebug(L,f); }
+
 /* make header; from lundump.c */
 LUAI_FUNC void luaU_header (char* h);
 LUAI_FUNC void luaU_header_p (char* h);
+LUAI_FUNC void luaU_header_x (char* h, int options);
+LUAI_FUNC void luaU_header_z (char* h);
 
+#if defined(__GNUC__)
+#define BSWAP_32(x)     __builtin_bswap32((uint32_t)(x))
+#define BSWAP_64(x)     __builtin_bswap64((uint64_t)(x))
+#else
 #define BSWAP_32(x)     (((uint32_t)(x) << 24) | \
                         (((uint32_t)(x) <<  8)  & 0xFF0000) | \
                         (((uint32_t)(x) >>  8)  & 0xFF00) | \
                         ((uint32_t)(x)  >> 24))
 
-
 #define BSWAP_64(x)     (((uint64_t)(x) << 56) | \
                         (((uint64_t)(x) << 40) & 0xFF000000000000ULL) | \
                         (((uint64_t)(x) << 24) & 0xFF0000000000ULL) | \
@@ -31,9 +45,28 @@ LUAI_FUNC void luaU_header_p (char* h);
                         (((uint64_t)(x) >> 24) & 0xFF0000ULL) | \
                         (((uint64_t)(x) >> 40) & 0xFF00ULL) | \
                         ((uint64_t)(x)  >> 56))
+#endif
+
+/* byte-swap a vector of 4-byte items, possibly in place; from lundump.c */
+LUAI_FUNC void luaU_swap4 (lu_int32* d, const lu_int32* s, size_t n);
+
+/* SHA-256, for chunks with a digest; from lundump.c */
+typedef struct Sha256 {
+  lu_int32 h[8];
+  size_t n;			/* bytes hashed so far */
+  unsigned char b[64];		/* pending block */
+} Sha256;
+
+LUAI_FUNC void luaU_sha256init (Sha256* c);
+LUAI_FUNC void luaU_sha256update (Sha256* c, const void* p, size_t n);
+LUAI_FUNC void luaU_sha256final (Sha256* c, unsigned char* digest);
 
 /* dump one chunk; from ldump.c */
-LUAI_FUNC int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip);
+LUAI_FUNC int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int options);
+
+/* save and load images of a whole state; from lsnapshot.c */
+LUAI_FUNC int luaU_dumpstate (lua_State* L, lua_Writer w, void* data);
+LUAI_FUNC int luaU_loadstate (lua_State* L, ZIO* Z, const char* name);
 
 #ifdef luac_c
 /* print one chunk; from print.c */
@@ -49,4 +82,28 @@ LUAI_FUNC void luaU_print (const Proto* f, int full);
 /* size of header of binary files */
 #define LUAC_HEADERSIZE		12
 
+/* for header of binary files -- revisions of the portable format */
+#define MY_LUAC_FORMAT		0x66	/* little-endian, fixed sizes */
+#define MY_LUAC_FORMAT_X	0x67	/* same, plus options, aligned vectors */
+#define MY_LUAC_FORMAT_Z	0x68	/* compressed container of a chunk */
+#define MY_LUAC_FORMAT_S	0x69	/* image of a whole state (native) */
+
+/* size of header of extended portable files (header + options word) */
+#define LUAC_HEADERSIZE_X	(LUAC_HEADERSIZE+4)
+
+/* options stored in the extended header */
+#define LUAC_X_STRPOOL		1	/* strings are indices into a pool */
+#define LUAC_X_LAZY		2	/* function bodies are prefixed by their size */
+#define LUAC_X_COMPACT		4	/* varint ints, delta-coded lineinfo */
+#define LUAC_X_DIGEST		8	/* header is followed by a digest */
+#define LUAC_X_DEBUG		16	/* debug info is in a section of its own */
+#define LUAC_X_HASHES		32	/* strings are preceded by their hashes */
+
+/* options stored in the extended header that this loader understands */
+#define LUAC_X_KNOWN		(LUAC_X_STRPOOL|LUAC_X_LAZY|LUAC_X_COMPACT|\
+				 LUAC_X_DIGEST|LUAC_X_DEBUG|LUAC_X_HASHES)
+
+/* size of the digest (SHA-256 of the header and everything after it) */
+#define LUAC_DIGESTSIZE		32
+
 #endif
@@ -18,12 +18,14 @@
 #include "ldo.h"
 #include "lfunc.h"
 #include "lgc.h"
+#include "ljit.h"
 #include "lobject.h"
 #include "lopcodes.h"
 #include "lstate.h"
 #include "lstring.h"
 #include "ltable.h"
 #include "ltm.h"
+#include "lundump.h"
 #include "lvm.h"
 
 
@@ -68,7 +70,9 @@ static void traceexec (lua_State *L, const Instruction *pc) {
   if (mask & LUA_MASKLINE) {
     Proto *p = ci_func(L->ci)->l.p;
     int npc = pcRel(pc, p);
-    int newline = getline(p, npc);
+    int newline;
+    luaU_checkdebug(L, p);
+    newline = getline(p, npc);
     /* call linehook when enter a new function, when jump back (loop),
        or when enter a new line */
     if (npc == 0 || pc <= oldpc || newline != getline(p, pcRel(oldpc, p)))
@@ -224,7 +228,9 @@ static int l_strcmp (const TString *ls, const TString *rs) {
 
 int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
   int res;
-  if (ttype(l) != ttype(r))
+  if (ttisint(l) && ttisint(r))
+    return ivalue(l) < ivalue(r);
+  else if (ttype(l) != ttype(r))
     return luaG_ordererror(L, l, r);
   else if (ttisnumber(l))
     return luai_numlt(nvalue(l), nvalue(r));
@@ -238,7 +244,9 @@ int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
 
 static int lessequal (lua_State *L, const TValue *l, const TValue *r) {
   int res;
-  if (ttype(l) != ttype(r))
+  if (ttisint(l) && ttisint(r))
+    return ivalue(l) <= ivalue(r);
+  else if (ttype(l) != ttype(r))
     return luaG_ordererror(L, l, r);
   else if (ttisnumber(l))
     return luai_numle(nvalue(l), nvalue(r));
@@ -342,7 +350,7 @@ static void Arith (lua_State *L, StkId ra, const TValue *rb,
 ** some macros for common tasks in `luaV_execute'
 */
 
-#define runtime_check(L, c)	{ if (!(c)) break; }
+#define runtime_check(L, c)	{ if (!(c)) vmbreak; }
 
 #define RA(i)	(base+GETARG_A(i))
 /* to be used after possible stack reallocation */
@@ -355,12 +363,142 @@ static void Arith (lua_State *L, StkId ra, const TValue *rb,
 #define KBx(i)	check_exp(getBMode(GET_OPCODE(i)) == OpArgK, k+GETARG_Bx(i))
 
 
-#define dojump(L,pc,i)	{(pc) += (i); luai_threadyield(L);}
+/*
+** jumps, calls that return to this function and function entries are
+** the safe points where the interpreter notices that line or count
+** hooks were turned on or off (see `vmsafepoint')
+*/
+#define dojump(L,pc,i)	{(pc) += (i); luai_threadyield(L); vmsafepoint(L);}
+
+#define hookson(L)	((L)->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT))
+
+
+/*
+** call the line and count hooks for the instruction just fetched
+*/
+#define vmhook()	{ \
+  if (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE) { \
+    traceexec(L, pc); \
+    if (L->status == LUA_YIELD) {  /* did hook yield? */ \
+      L->savedpc = pc - 1; \
+      return; \
+    } \
+    base = L->base; \
+  } }
+
+
+/*
+** fetch the next instruction into `i' and its register A into `ra';
+** the hooks are only called while `hooked' is set, so that a state
+** without hooks pays a test of a local variable per instruction
+*/
+#define vmfetch()	{ \
+  i = *pc++; \
+  vmtrace(); \
+  /* warning!! several calls may realloc the stack and invalidate `ra' */ \
+  ra = RA(i); \
+  lua_assert(base == L->base && L->base == L->ci->base); \
+  lua_assert(base <= L->top && L->top <= L->stack + L->stacksize); \
+  lua_assert(L->top == L->ci->top || luaG_checkopenop(i)); }
+
+
+/*
+** dispatch of an instruction: by default a switch, with `vmbreak' going
+** back to the top of the main loop; ljumptab.h redefines them
+*/
+#define vmsafepoint(L)	{ hooked = hookson(L); }
+#define vmtrace()	{ if (hooked) vmhook(); }
+#define vmdispatch(o)	switch (o)
+#define vmcase(l)	case l:
+#define vmbreak		continue
+#define vmhookcase	/* empty */
 
 
 #define Protect(x)	{ L->savedpc = pc; {x;}; base = L->base; }
 
 
+#if defined(LUA_USE_JIT)
+/*
+** count a call or a loop iteration of the running function, which gets
+** compiled (with its inline caches, which compiled code goes through)
+** when hot; while no hook is on, a compiled function runs its machine
+** code from `pc' up to an instruction it leaves to the interpreter (see
+** ljit.c)
+*/
+#define vmjit(L)	{ \
+  if (cl->p->jit == NULL && --cl->p->hotcount == 0) { \
+    if (cl->p->cache == NULL) Protect(luaF_initcache(L, cl->p)); \
+    luaJ_compile(L, cl->p); \
+  } \
+  if (cl->p->jit != NULL && !hookson(L)) { \
+    pc = luaJ_run(L, cl, pc); \
+    vmsafepoint(L); \
+  } }
+#else
+#define vmjit(L)	/* empty */
+#endif
+
+
+/*
+** slot of the constant string `key' in `h' for the instruction just
+** fetched, found through the inline cache of that instruction; NULL if
+** `h' has no such key. Caches cost more than the code they serve, so a
+** function gets them only once it has run more lookups than it has
+** instructions (code that runs once, such as data files, never does);
+** until then, NULL sends every lookup down the general path.
+*/
+static TValue *cachedslot (lua_State *L, const LClosure *cl,
+                           const Instruction *pc, Table *h, TString *key) {
+  Proto *p = cl->p;
+  ICache *c;
+  if (p->cache == NULL) {
+    if (++p->lookups <= p->sizecode) return NULL;
+    L->savedpc = pc;
+    luaF_initcache(L, p);
+  }
+  c = &p->cache[pc - p->code - 1];
+  if (c->t != h || c->layout != h->layout) {  /* cache miss? */
+    Node *n = luaH_getstrnode(h, key);
+    if (n == NULL) return NULL;
+    c->t = h;
+    c->n = n;
+    c->layout = h->layout;
+  }
+  return gval(c->n);
+}
+
+
+/*
+** R(A) := t[key] and t[key] := v, going straight to the slot of a
+** constant string key (`isk') already present in table `t'; anything
+** else (absent keys, nil values, metamethods) takes the general path
+*/
+#define gettablek(t,key,isk) { \
+        const TValue *slot; \
+        if ((isk) && ttistable(t) && ttisstring(key) && \
+            (slot = cachedslot(L, cl, pc, hvalue(t), rawtsvalue(key))) != NULL \
+            && !ttisnil(slot)) { \
+          setobj2s(L, ra, slot); \
+        } \
+        else \
+          Protect(luaV_gettable(L, t, key, ra)); \
+      }
+
+#define settablek(t,key,isk,v) { \
+        TValue *slot; \
+        if ((isk) && ttistable(t) && ttisstring(key) && \
+            (slot = cachedslot(L, cl, pc, hvalue(t), rawtsvalue(key))) != NULL \
+            && !ttisnil(slot)) { \
+          Table *h = hvalue(t); \
+          setobj2t(L, slot, v); \
+          h->flags = 0; \
+          luaC_barriert(L, h, v); \
+        } \
+        else \
+          Protect(luaV_settable(L, t, key, v)); \
+      }
+
+
 #define arith_op(op,tm) { \
         TValue *rb = RKB(i); \
         TValue *rc = RKC(i); \
@@ -373,153 +511,238 @@ static void Arith (lua_State *L, StkId ra, const TValue *rb,
       }
 
 
+/*
+** arithmetic with a shortcut for two ints: `iop' stores in `ra' the
+** same value `op' would give, as an int whenever it is one
+*/
+#define arith_iop(iop,op,tm) { \
+        TValue *rb = RKB(i); \
+        TValue *rc = RKC(i); \
+        if (ttisint(rb) && ttisint(rc)) { \
+          int ib = ivalue(rb), ic = ivalue(rc); \
+          iop(ib, ic, op); \
+        } \
+        else if (ttisnumber(rb) && ttisnumber(rc)) { \
+          lua_Number nb = nvalue(rb), nc = nvalue(rc); \
+          setnvalue(ra, op(nb, nc)); \
+        } \
+        else \
+          Protect(Arith(L, ra, rb, rc, tm)); \
+      }
+
+/* addition and subtraction wrap around as unsigned, checking overflow */
+#define int_add(a,b,op) { \
+        int r = cast_int(cast(unsigned int, a) + cast(unsigned int, b)); \
+        if ((((a) ^ r) & ((b) ^ r)) < 0) {  /* overflow? */ \
+          setnvalue(ra, op(cast_num(a), cast_num(b))); \
+        } \
+        else { setivalue(ra, r); } \
+      }
+
+#define int_sub(a,b,op) { \
+        int r = cast_int(cast(unsigned int, a) - cast(unsigned int, b)); \
+        if ((((a) ^ (b)) & ((a) ^ r)) < 0) {  /* overflow? */ \
+          setnvalue(ra, op(cast_num(a), cast_num(b))); \
+        } \
+        else { setivalue(ra, r); } \
+      }
+
+/* a product in `int' range is exact as a float; 0 may need to be -0 */
+#define int_mul(a,b,op) { \
+        lua_Number r = op(cast_num(a), cast_num(b)); \
+        if (luai_numle(-cast_num(MAX_INT), r) && \
+            luai_numle(r, cast_num(MAX_INT)) && \
+            (r != 0 || ((a) | (b)) >= 0)) { \
+          setivalue(ra, cast_int(r)); \
+        } \
+        else { setnvalue(ra, r); } \
+      }
+
+/* `a - floor(a/b)*b' is never -0; x % 0 is not a number */
+#define int_mod(a,b,op) { \
+        if ((b) == 0) { \
+          setnvalue(ra, op(cast_num(a), cast_num(b))); \
+        } \
+        else if ((b) == -1) {  /* (avoids overflow of `MIN_INT % -1') */ \
+          setivalue(ra, 0); \
+        } \
+        else { \
+          int r = (a) % (b); \
+          if (r != 0 && (r ^ (b)) < 0) r += (b);  /* round to -inf */ \
+          setivalue(ra, r); \
+        } \
+      }
+
+
 
 void luaV_execute (lua_State *L, int nexeccalls) {
   LClosure *cl;
   StkId base;
   TValue *k;
   const Instruction *pc;
+  Instruction i;
+  StkId ra;
+#if LUA_USE_JUMPTABLE
+#include "ljumptab.h"
+#else
+  int hooked;  /* line or count hooks on? */
+#endif
  reentry:  /* entry point */
   lua_assert(isLua(L->ci));
   pc = L->savedpc;
   cl = &clvalue(L->ci->func)->l;
   base = L->base;
   k = cl->p->k;
+  vmsafepoint(L);
+  if (pc == cl->p->code)  /* function entry? */
+    vmjit(L);
   /* main loop of interpreter */
   for (;;) {
-    const Instruction i = *pc++;
-    StkId ra;
-    if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) &&
-        (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) {
-      traceexec(L, pc);
-      if (L->status == LUA_YIELD) {  /* did hook yield? */
-        L->savedpc = pc - 1;
-        return;
-      }
-      base = L->base;
-    }
-    /* warning!! several calls may realloc the stack and invalidate `ra' */
-    ra = RA(i);
-    lua_assert(base == L->base && L->base == L->ci->base);
-    lua_assert(base <= L->top && L->top <= L->stack + L->stacksize);
-    lua_assert(L->top == L->ci->top || luaG_checkopenop(i));
-    switch (GET_OPCODE(i)) {
-      case OP_MOVE: {
+    vmfetch();
+    vmdispatch (GET_OPCODE(i)) {
+      vmhookcase
+      vmcase(OP_MOVE) {
         setobjs2s(L, ra, RB(i));
-        continue;
+        vmbreak;
       }
-      case OP_LOADK: {
+      vmcase(OP_LOADK) {
         setobj2s(L, ra, KBx(i));
-        continue;
+        vmbreak;
       }
-      case OP_LOADBOOL: {
+      vmcase(OP_LOADBOOL) {
         setbvalue(ra, GETARG_B(i));
         if (GETARG_C(i)) pc++;  /* skip next instruction (if C) */
-        continue;
+        vmbreak;
       }
-      case OP_LOADNIL: {
+      vmcase(OP_LOADNIL) {
         TValue *rb = RB(i);
         do {
           setnilvalue(rb--);
         } while (rb >= ra);
-        continue;
+        vmbreak;
       }
-      case OP_GETUPVAL: {
+      vmcase(OP_GETUPVAL) {
         int b = GETARG_B(i);
         setobj2s(L, ra, cl->upvals[b]->v);
-        continue;
+        vmbreak;
       }
-      case OP_GETGLOBAL: {
+      vmcase(OP_GETGLOBAL) {
         TValue g;
         TValue *rb = KBx(i);
         sethvalue(L, &g, cl->env);
         lua_assert(ttisstring(rb));
-        Protect(luaV_gettable(L, &g, rb, ra));
-        continue;
+        gettablek(&g, rb, 1);
+        vmbreak;
       }
-      case OP_GETTABLE: {
-        Protect(luaV_gettable(L, RB(i), RKC(i), ra));
-        continue;
+      vmcase(OP_GETTABLE) {
+        TValue *rb = RB(i);
+        TValue *rc = RKC(i);
+        const TValue *v;
+        if (ttistable(rb) && ttisint(rc) &&
+            !ttisnil(v = luaH_getnum(hvalue(rb), ivalue(rc)))) {
+          setobj2s(L, ra, v);
+        }
+        else gettablek(rb, rc, ISK(GETARG_C(i)));
+        vmbreak;
       }
-      case OP_SETGLOBAL: {
+      vmcase(OP_SETGLOBAL) {
         TValue g;
         sethvalue(L, &g, cl->env);
         lua_assert(ttisstring(KBx(i)));
-        Protect(luaV_settable(L, &g, KBx(i), ra));
-        continue;
+        settablek(&g, KBx(i), 1, ra);
+        vmbreak;
       }
-      case OP_SETUPVAL: {
+      vmcase(OP_SETUPVAL) {
         UpVal *uv = cl->upvals[GETARG_B(i)];
         setobj(L, uv->v, ra);
         luaC_barrier(L, uv, ra);
-        continue;
+        vmbreak;
       }
-      case OP_SETTABLE: {
-        Protect(luaV_settable(L, ra, RKB(i), RKC(i)));
-        continue;
+      vmcase(OP_SETTABLE) {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        TValue *v;
+        if (ttistable(ra) && ttisint(rb) &&
+            !ttisnil(v = cast(TValue *, luaH_getnum(hvalue(ra), ivalue(rb))))) {
+          setobj2t(L, v, rc);  /* (an int key is never a metamethod name) */
+          luaC_barriert(L, hvalue(ra), rc);
+        }
+        else settablek(ra, rb, ISK(GETARG_B(i)), rc);
+        vmbreak;
       }
-      case OP_NEWTABLE: {
+      vmcase(OP_NEWTABLE) {
         int b = GETARG_B(i);
         int c = GETARG_C(i);
         sethvalue(L, ra, luaH_new(L, luaO_fb2int(b), luaO_fb2int(c)));
         Protect(luaC_checkGC(L));
-        continue;
+        vmbreak;
       }
-      case OP_SELF: {
+      vmcase(OP_SELF) {
         StkId rb = RB(i);
+        TValue *rc = RKC(i);
         setobjs2s(L, ra+1, rb);
-        Protect(luaV_gettable(L, rb, RKC(i), ra));
-        continue;
+        gettablek(rb, rc, ISK(GETARG_C(i)));
+        vmbreak;
       }
-      case OP_ADD: {
-        arith_op(luai_numadd, TM_ADD);
-        continue;
+      vmcase(OP_ADD) {
+        arith_iop(int_add, luai_numadd, TM_ADD);
+        vmbreak;
       }
-      case OP_SUB: {
-        arith_op(luai_numsub, TM_SUB);
-        continue;
+      vmcase(OP_SUB) {
+        arith_iop(int_sub, luai_numsub, TM_SUB);
+        vmbreak;
       }
-      case OP_MUL: {
-        arith_op(luai_nummul, TM_MUL);
-        continue;
+      vmcase(OP_MUL) {
+        arith_iop(int_mul, luai_nummul, TM_MUL);
+        vmbreak;
       }
-      case OP_DIV: {
+      vmcase(OP_DIV) {
         arith_op(luai_numdiv, TM_DIV);
-        continue;
+        vmbreak;
       }
-      case OP_MOD: {
-        arith_op(luai_nummod, TM_MOD);
-        continue;
+      vmcase(OP_MOD) {
+        arith_iop(int_mod, luai_nummod, TM_MOD);
+        vmbreak;
       }
-      case OP_POW: {
+      vmcase(OP_POW) {
         arith_op(luai_numpow, TM_POW);
-        continue;
+        vmbreak;
       }
-      case OP_UNM: {
+      vmcase(OP_UNM) {
         TValue *rb = RB(i);
-        if (ttisnumber(rb)) {
+        int ib;
+        if (ttisint(rb) && (ib = ivalue(rb)) != 0 && ib >= -MAX_INT) {
+          setivalue(ra, -ib);  /* (-0 and -MIN_INT are not ints) */
+        }
+        else if (ttisnumber(rb)) {
           lua_Number nb = nvalue(rb);
           setnvalue(ra, luai_numunm(nb));
         }
         else {
           Protect(Arith(L, ra, rb, rb, TM_UNM));
         }
-        continue;
+        vmbreak;
       }
-      case OP_NOT: {
+      vmcase(OP_NOT) {
         int res = l_isfalse(RB(i));  /* next assignment may change this value */
         setbvalue(ra, res);
-        continue;
+        vmbreak;
       }
-      case OP_LEN: {
+      vmcase(OP_LEN) {
         const TValue *rb = RB(i);
         switch (ttype(rb)) {
           case LUA_TTABLE: {
-            setnvalue(ra, cast_num(luaH_getn(hvalue(rb))));
+            setivalue(ra, luaH_getn(hvalue(rb)));
             break;
           }
           case LUA_TSTRING: {
-            setnvalue(ra, cast_num(tsvalue(rb)->len));
+            size_t len = tsvalue(rb)->len;
+            if (len <= cast(size_t, MAX_INT)) {
+              setivalue(ra, cast_int(len));
+            }
+            else {
+              setnvalue(ra, cast_num(len));
+            }
             break;
           }
           default: {  /* try metamethod */
@@ -529,20 +752,22 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             )
           }
         }
-        continue;
+        vmbreak;
       }
-      case OP_CONCAT: {
+      vmcase(OP_CONCAT) {
         int b = GETARG_B(i);
         int c = GETARG_C(i);
         Protect(luaV_concat(L, c-b+1, c); luaC_checkGC(L));
         setobjs2s(L, RA(i), base+b);
-        continue;
+        vmbreak;
       }
-      case OP_JMP: {
+      vmcase(OP_JMP) {
         dojump(L, pc, GETARG_sBx(i));
-        continue;
+        if (GETARG_sBx(i) < 0)  /* loop? */
+          vmjit(L);
+        vmbreak;
       }
-      case OP_EQ: {
+      vmcase(OP_EQ) {
         TValue *rb = RKB(i);
         TValue *rc = RKC(i);
         Protect(
@@ -550,40 +775,40 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_LT: {
+      vmcase(OP_LT) {
         Protect(
           if (luaV_lessthan(L, RKB(i), RKC(i)) == GETARG_A(i))
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_LE: {
+      vmcase(OP_LE) {
         Protect(
           if (lessequal(L, RKB(i), RKC(i)) == GETARG_A(i))
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_TEST: {
+      vmcase(OP_TEST) {
         if (l_isfalse(ra) != GETARG_C(i))
           dojump(L, pc, GETARG_sBx(*pc));
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_TESTSET: {
+      vmcase(OP_TESTSET) {
         TValue *rb = RB(i);
         if (l_isfalse(rb) != GETARG_C(i)) {
           setobjs2s(L, ra, rb);
           dojump(L, pc, GETARG_sBx(*pc));
         }
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_CALL: {
+      vmcase(OP_CALL) {
         int b = GETARG_B(i);
         int nresults = GETARG_C(i) - 1;
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
@@ -597,14 +822,15 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             /* it was a C function (`precall' called it); adjust results */
             if (nresults >= 0) L->top = L->ci->top;
             base = L->base;
-            continue;
+            vmsafepoint(L);  /* it may have set or cleared a hook */
+            vmbreak;
           }
           default: {
             return;  /* yield */
           }
         }
       }
-      case OP_TAILCALL: {
+      vmcase(OP_TAILCALL) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
         L->savedpc = pc;
@@ -629,14 +855,15 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           }
           case PCRC: {  /* it was a C function (`precall' called it) */
             base = L->base;
-            continue;
+            vmsafepoint(L);
+            vmbreak;
           }
           default: {
             return;  /* yield */
           }
         }
       }
-      case OP_RETURN: {
+      vmcase(OP_RETURN) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b-1;
         if (L->openupval) luaF_close(L, base);
@@ -651,23 +878,51 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           goto reentry;
         }
       }
-      case OP_FORLOOP: {
-        lua_Number step = nvalue(ra+2);
-        lua_Number idx = luai_numadd(nvalue(ra), step); /* increment index */
-        lua_Number limit = nvalue(ra+1);
-        if (luai_numlt(0, step) ? luai_numle(idx, limit)
-                                : luai_numle(limit, idx)) {
-          dojump(L, pc, GETARG_sBx(i));  /* jump back */
-          setnvalue(ra, idx);  /* update internal index... */
-          setnvalue(ra+3, idx);  /* ...and external index */
+      vmcase(OP_FORLOOP) {
+        if (ttisint(ra)) {  /* loop over ints? (see OP_FORPREP) */
+          int idx = ivalue(ra);
+          int limit = ivalue(ra+1);
+          int step = ivalue(ra+2);
+          /* `idx' has not passed `limit'; does adding `step' pass it? */
+          if (step > 0 ? cast(unsigned int, limit) - cast(unsigned int, idx)
+                             >= cast(unsigned int, step)
+                       : cast(unsigned int, idx) - cast(unsigned int, limit)
+                             >= 0u - cast(unsigned int, step)) {
+            idx += step;
+            dojump(L, pc, GETARG_sBx(i));  /* jump back */
+            setivalue(ra, idx);
+            setivalue(ra+3, idx);
+            vmjit(L);
+          }
+        }
+        else {
+          lua_Number step = nvalue(ra+2);
+          lua_Number idx = luai_numadd(nvalue(ra), step); /* increment index */
+          lua_Number limit = nvalue(ra+1);
+          if (luai_numlt(0, step) ? luai_numle(idx, limit)
+                                  : luai_numle(limit, idx)) {
+            dojump(L, pc, GETARG_sBx(i));  /* jump back */
+            setnvalue(ra, idx);  /* update internal index... */
+            setnvalue(ra+3, idx);  /* ...and external index */
+            vmjit(L);
+          }
         }
-        continue;
+        vmbreak;
       }
-      case OP_FORPREP: {
+      vmcase(OP_FORPREP) {
         const TValue *init = ra;
         const TValue *plimit = ra+1;
         const TValue *pstep = ra+2;
         L->savedpc = pc;  /* next steps may throw errors */
+        if (ttisint(init) && ttisint(plimit) && ttisint(pstep)) {
+          /* loop over ints: enter the body directly, if at all */
+          int idx = ivalue(init);
+          if (ivalue(pstep) > 0 ? idx > ivalue(plimit) : idx < ivalue(plimit))
+            dojump(L, pc, GETARG_sBx(i) + 1)  /* skip the loop */
+          else
+            setivalue(ra+3, idx);
+          vmbreak;
+        }
         if (!tonumber(init, ra))
           luaG_runerror(L, LUA_QL("for") " initial value must be a number");
         else if (!tonumber(plimit, ra+1))
@@ -676,9 +931,9 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           luaG_runerror(L, LUA_QL("for") " step must be a number");
         setnvalue(ra, luai_numsub(nvalue(ra), nvalue(pstep)));
         dojump(L, pc, GETARG_sBx(i));
-        continue;
+        vmbreak;
       }
-      case OP_TFORLOOP: {
+      vmcase(OP_TFORLOOP) {
         StkId cb = ra + 3;  /* call base */
         setobjs2s(L, cb+2, ra+2);
         setobjs2s(L, cb+1, ra+1);
@@ -689,12 +944,14 @@ void luaV_execute (lua_State *L, int nexeccalls) {
         cb = RA(i) + 3;  /* previous call may change the stack */
         if (!ttisnil(cb)) {  /* continue loop? */
           setobjs2s(L, cb-1, cb);  /* save control variable */
-          dojump(L, pc, GETARG_sBx(*pc));  /* jump back */
+          dojump(L, pc, GETARG_sBx(*pc) + 1);  /* jump back */
+          vmjit(L);
         }
-        pc++;
-        continue;
+        else
+          pc++;
+        vmbreak;
       }
-      case OP_SETLIST: {
+      vmcase(OP_SETLIST) {
         int n = GETARG_B(i);
         int c = GETARG_C(i);
         int last;
@@ -714,17 +971,21 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           setobj2t(L, luaH_setnum(L, h, last--), val);
           luaC_barriert(L, h, val);
         }
-        continue;
+        vmbreak;
       }
-      case OP_CLOSE: {
+      vmcase(OP_CLOSE) {
         luaF_close(L, ra);
-        continue;
+        vmbreak;
       }
-      case OP_CLOSURE: {
+      vmcase(OP_CLOSURE) {
         Proto *p;
         Closure *ncl;
         int nup, j;
         p = cl->p->p[GETARG_Bx(i)];
+        if (p->lazy != NULL) {  /* body not loaded yet? */
+          Protect(p = luaU_materialize(L, cl->p, GETARG_Bx(i)));
+          ra = RA(i);
+        }
         nup = p->nups;
         ncl = luaF_newLclosure(L, nup, cl->env);
         ncl->l.p = p;
@@ -738,9 +999,9 @@ void luaV_execute (lua_State *L, int nexeccalls) {
         }
         setclvalue(L, ra, ncl);
         Protect(luaC_checkGC(L));
-        continue;
+        vmbreak;
       }
-      case OP_VARARG: {
+      vmcase(OP_VARARG) {
         int b = GETARG_B(i) - 1;
         int j;
         CallInfo *ci = L->ci;
@@ -759,7 +1020,12 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             setnilvalue(ra + j);
           }
         }
-        continue;
+        vmbreak;
+      }
+      vmcase(OP_TEMPLATE) {
+        sethvalue(L, ra, luaH_copy(L, hvalue(KBx(i))));
+        Protect(luaC_checkGC(L));
+        vmbreak;
       }
     }
   }
@@ -12,9 +12,12 @@
 
 #include "lua.h"
 
+#include "ldo.h"
 #include "llimits.h"
 #include "lmem.h"
+#include "lobject.h"
 #include "lstate.h"
+#include "lstring.h"
 #include "lzio.h"
 
 
@@ -51,6 +54,23 @@ void luaZ_init (lua_State *L, ZIO *z, lua_Reader reader, void *data) {
   z->data = data;
   z->n = 0;
   z->p = NULL;
+  z->owner = NULL;
+}
+
+
+static const char *getnothing (lua_State *L, void *ud, size_t *size) {
+  (void)L; (void)ud;
+  *size = 0;
+  return NULL;
+}
+
+
+void luaZ_initimage (lua_State *L, ZIO *z, const char *b, size_t size,
+                     union GCObject *owner) {
+  luaZ_init(L, z, getnothing, NULL);
+  z->n = size;
+  z->p = b;
+  z->owner = owner;
 }
 
 
@@ -70,6 +90,18 @@ size_t luaZ_read (ZIO *z, void *b, size_t n) {
   return 0;
 }
 
+/*
+** return a pointer to the next `n' bytes of the current buffer (and skip
+** them) if they are all there; NULL otherwise
+*/
+const char *luaZ_direct (ZIO *z, size_t n) {
+  const char *p = z->p;
+  if (n == 0 || z->n < n) return NULL;
+  z->n -= n;
+  z->p += n;
+  return p;
+}
+
 /* ------------------------------------------------------------------------ */
 char *luaZ_openspace (lua_State *L, Mbuffer *buff, size_t n) {
   if (n > buff->buffsize) {
@@ -80,3 +112,185 @@ char *luaZ_openspace (lua_State *L, Mbuffer *buff, size_t n) {
 }
 
 
+/* ------------------------------------------------------- compression --- */
+
+/*
+** A block is a sequence of LZ77 sequences. Each sequence is a token byte
+** (literal length in the high nibble, match length minus LZ_MINMATCH in
+** the low one; 15 means that more length bytes follow, each added until
+** one is not 255), the literals, a 2-byte little-endian offset and the
+** extra match length bytes. The last sequence has literals only.
+*/
+
+#define LZ_MINMATCH	4
+#define LZ_MAXOFFSET	65535
+
+#define lzread4(p)	((lu_int32)(p)[0] | ((lu_int32)(p)[1] << 8) | \
+			 ((lu_int32)(p)[2] << 16) | ((lu_int32)(p)[3] << 24))
+
+#define lzhash(v)	(((v) * 2654435761u) >> (32 - LUAZ_LZHASHBITS))
+
+
+static unsigned char *lzlength (unsigned char *d, size_t len) {
+  for (; len >= 255; len -= 255) *d++ = 255;
+  *d++ = cast(unsigned char, len);
+  return d;
+}
+
+
+static unsigned char *lzsequence (unsigned char *d, const unsigned char *lit,
+                                  size_t nlit, size_t offset, size_t len) {
+  unsigned char *token = d++;
+  size_t m = (len == 0) ? 0 : len - LZ_MINMATCH;
+  *token = cast(unsigned char, ((nlit < 15) ? nlit : 15) << 4);
+  if (nlit >= 15) d = lzlength(d, nlit - 15);
+  memcpy(d, lit, nlit);
+  d += nlit;
+  if (len == 0) return d;  /* last sequence */
+  *token |= cast(unsigned char, (m < 15) ? m : 15);
+  *d++ = cast(unsigned char, offset & 0xFF);
+  *d++ = cast(unsigned char, offset >> 8);
+  if (m >= 15) d = lzlength(d, m - 15);
+  return d;
+}
+
+
+/*
+** compress `n' bytes (at most LUAZ_LZBLOCK) of `src' into `dst', which
+** must have room for LUAZ_LZBOUND(n) bytes; `hash' is a work area of
+** LUAZ_LZHASHSIZE ints. Returns the size of the compressed block
+*/
+size_t luaZ_lzcompress (const char *src, size_t n, char *dst, int *hash) {
+  const unsigned char *s = cast(const unsigned char *, src);
+  unsigned char *d = cast(unsigned char *, dst);
+  size_t i = 0, anchor = 0;
+  int j;
+  lua_assert(n <= LUAZ_LZBLOCK);
+  for (j = 0; j < LUAZ_LZHASHSIZE; j++) hash[j] = -1;
+  while (i + LZ_MINMATCH <= n) {
+    lu_int32 v = lzread4(s + i);
+    lu_int32 h = lzhash(v);
+    int c = hash[h];
+    hash[h] = cast_int(i);
+    if (c >= 0 && i - c <= LZ_MAXOFFSET && lzread4(s + c) == v) {
+      size_t len = LZ_MINMATCH;
+      while (i + len < n && s[c + len] == s[i + len]) len++;
+      d = lzsequence(d, s + anchor, i - anchor, i - c, len);
+      i += len;
+      anchor = i;
+    }
+    else i++;
+  }
+  d = lzsequence(d, s + anchor, n - anchor, 0, 0);
+  return cast(size_t, d - cast(unsigned char *, dst));
+}
+
+
+static int lzgetlength (const unsigned char **p, const unsigned char *e,
+                        size_t *len) {
+  int b;
+  do {
+    if (*p >= e) return 0;
+    b = *(*p)++;
+    *len += b;
+  } while (b == 255);
+  return 1;
+}
+
+
+/*
+** decompress the block of `n' bytes in `src' into `dst', which must then
+** hold exactly `size' bytes. Returns 0 if the block is malformed
+*/
+int luaZ_lzdecompress (const char *src, size_t n, char *dst, size_t size) {
+  const unsigned char *p = cast(const unsigned char *, src);
+  const unsigned char *e = p + n;
+  size_t o = 0;
+  for (;;) {
+    size_t nlit, len, offset;
+    int token;
+    if (p >= e) return 0;
+    token = *p++;
+    nlit = token >> 4;
+    if (nlit == 15 && !lzgetlength(&p, e, &nlit)) return 0;
+    if (nlit > cast(size_t, e - p) || nlit > size - o) return 0;
+    memcpy(dst + o, p, nlit);
+    p += nlit;
+    o += nlit;
+    if (p == e) break;  /* last sequence */
+    if (e - p < 2) return 0;
+    offset = p[0] | (cast(size_t, p[1]) << 8);
+    p += 2;
+    len = token & 15;
+    if (len == 15 && !lzgetlength(&p, e, &len)) return 0;
+    len += LZ_MINMATCH;
+    if (offset == 0 || offset > o || len > size - o) return 0;
+    for (; len > 0; len--, o++)  /* byte by byte: copies may overlap */
+      dst[o] = dst[o - offset];
+  }
+  return o == size;
+}
+
+
+/*
+** compressed streams are blocks, each one a 4-byte little-endian
+** uncompressed size (0 ends the stream), a 4-byte compressed size (0 for
+** a block stored as is) and the data
+*/
+typedef struct LZStream {
+  ZIO *src;  /* compressed stream */
+  const char *name;  /* chunk name, for error messages */
+  char block[LUAZ_LZBLOCK];  /* current decompressed block */
+  char in[LUAZ_LZBLOCK];  /* current compressed block */
+} LZStream;
+
+
+static void lzerror (lua_State *L, LZStream *lz, const char *why) {
+  luaO_pushfstring(L, "%s: %s in compressed chunk", lz->name, why);
+  luaD_throw(L, LUA_ERRSYNTAX);
+}
+
+
+static const char *getlzblock (lua_State *L, void *ud, size_t *size) {
+  LZStream *lz = cast(LZStream *, ud);
+  unsigned char h[8];
+  size_t raw, comp;
+  lua_lock(L);
+  if (luaZ_read(lz->src, h, 8) != 0) lzerror(L, lz, "unexpected end");
+  raw = lzread4(h);
+  comp = lzread4(h + 4);
+  if (raw == 0) {  /* end of stream */
+    lua_unlock(L);
+    *size = 0;
+    return NULL;
+  }
+  if (raw > LUAZ_LZBLOCK || comp >= raw) lzerror(L, lz, "bad block");
+  if (comp == 0) {  /* stored */
+    if (luaZ_read(lz->src, lz->block, raw) != 0)
+      lzerror(L, lz, "unexpected end");
+  }
+  else {
+    if (luaZ_read(lz->src, lz->in, comp) != 0)
+      lzerror(L, lz, "unexpected end");
+    if (!luaZ_lzdecompress(lz->in, comp, lz->block, raw))
+      lzerror(L, lz, "bad block");
+  }
+  lua_unlock(L);
+  *size = raw;
+  return lz->block;
+}
+
+
+/*
+** init `z' to read what compressed stream `src' holds; the buffers live
+** in a userdata left on the stack, which the caller pops when done
+*/
+void luaZ_initlz (lua_State *L, ZIO *z, ZIO *src, const char *name) {
+  Udata *u = luaS_newudata(L, sizeof(LZStream), hvalue(gt(L)));
+  LZStream *lz = cast(LZStream *, u + 1);
+  setuvalue(L, L->top, u);
+  incr_top(L);
+  lz->src = src;
+  lz->name = name;
+  luaZ_init(L, z, getlzblock, lz);
+}
@@ -17,6 +17,8 @@
 
 typedef struct Zio ZIO;
 
+union GCObject;
+
 #define char2int(c)	cast(int, cast(unsigned char, (c)))
 
 #define zgetc(z)  (((z)->n--)>0 ?  char2int(*(z)->p++) : luaZ_fill(z))
@@ -46,10 +48,27 @@ typedef struct Mbuffer {
 LUAI_FUNC char *luaZ_openspace (lua_State *L, Mbuffer *buff, size_t n);
 LUAI_FUNC void luaZ_init (lua_State *L, ZIO *z, lua_Reader reader,
                                         void *data);
+LUAI_FUNC void luaZ_initimage (lua_State *L, ZIO *z, const char *b,
+                               size_t size, union GCObject *owner);
 LUAI_FUNC size_t luaZ_read (ZIO* z, void* b, size_t n);	/* read next n bytes */
+LUAI_FUNC const char *luaZ_direct (ZIO *z, size_t n);
 LUAI_FUNC int luaZ_lookahead (ZIO *z);
 
 
+/* compressed streams */
+#define LUAZ_LZBLOCK	65536	/* maximum size of an uncompressed block */
+#define LUAZ_LZBOUND(n)	((n) + (n)/255 + 16)	/* maximum compressed size */
+#define LUAZ_LZHASHBITS	12
+#define LUAZ_LZHASHSIZE	(1 << LUAZ_LZHASHBITS)
+
+LUAI_FUNC size_t luaZ_lzcompress (const char *src, size_t n, char *dst,
+                                  int *hash);
+LUAI_FUNC int luaZ_lzdecompress (const char *src, size_t n, char *dst,
+                                 size_t size);
+LUAI_FUNC void luaZ_initlz (lua_State *L, ZIO *z, ZIO *src,
+                            const char *name);
+
+
 
 /* --------- Private Part ------------------ */
 
@@ -59,6 +78,7 @@ struct Zio {
   lua_Reader reader;
   void* data;			/* additional data */
   lua_State *L;			/* Lua state (for reader) */
+  union GCObject *owner;	/* object keeping an in-memory image alive */
 };
 
 
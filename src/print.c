@@ -65,6 +65,9 @@ static void PrintConstant(const Proto* f, int i)
   case LUA_TSTRING:
 	PrintString(rawtsvalue(o));
 	break;
+  case LUA_TTABLE:
+	printf("{...}");
+	break;
   default:				/* cannot happen */
 	printf("? type=%d",ttype(o));
 	break;
@@ -105,6 +108,7 @@ static void PrintCode(const Proto* f)
   switch (o)
   {
    case OP_LOADK:
+   case OP_TEMPLATE:
     printf("\t; "); PrintConstant(f,bx);
     break;
    case OP_GETUPVAL:
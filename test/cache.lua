@@ -0,0 +1,15 @@
+-- inline caches of field accesses must follow keys that come and go
+
+local function get(t) return t.x end
+local function set(t, v) t.x = v end
+
+for i = 1, 200 do			-- enough to make both functions hot
+ local t = {x = 1}
+ assert(get(t) == 1)
+ t.x = nil
+ t.y = 2				-- may take the node `x' left
+ assert(get(t) == nil)
+ set(t, 3)
+ assert(t.x == 3 and t.y == 2)
+end
+print("inline caches ok")
@@ -0,0 +1,29 @@
+-- every string.dump option, alone or combined, must load back the same code
+
+local function f(n, ...)
+ local t = {n = n, s = "str", list = {1, 2, 3}}
+ local function g(x) return x * 2 + #t.list end
+ local r = 0
+ for i = 1, n do r = r + g(i) end
+ return r, t.s, select("#", ...)
+end
+
+local options = "smtdczkgh"
+local function check(opts)
+ local s = string.dump(f, opts)
+ local l = assert(loadstring(s, "=dump"))
+ local a, b, c = l(10, nil, nil)
+ assert(a == f(10) and b == "str" and c == 2, opts)
+ local ok, err = pcall(l, "x")			-- error messages still work
+ assert(not ok and string.find(err, "'for' limit"), opts)
+end
+check("")
+for i = 1, #options do				-- each option alone, and with each other
+ for j = i, #options do
+  check(string.sub(options, i, i) .. string.sub(options, j, j))
+ end
+end
+check(options)
+assert(not pcall(string.dump, f, "?"))
+assert(not pcall(string.dump, print))
+print("string.dump ok")
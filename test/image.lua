@@ -0,0 +1,43 @@
+-- a state saved with `lua -w' must come back whole with `lua -s'
+-- usage: lua image.lua
+
+local lua = arg[-1]
+local image = os.tmpname()
+
+local function run(options, code)
+ local p = assert(io.popen(lua .. " " .. options .. " -e '" .. code .. "' 2>&1"))
+ local out = p:read("*a")
+ p:close()
+ return out
+end
+
+local setup = [[
+ local shared = {n = 0}
+ counter = function() shared.n = shared.n + 1 return shared.n end
+ peek = function() return shared.n end
+ data = {1, 2.5, "three", {four = 4}, [true] = false}
+ data.self = data
+ setmetatable(data, {__index = function(t, k) return k .. "?" end})
+ string.twice = function(s) return s .. s end
+ counter(); counter()
+]]
+assert(run("-w " .. image, setup) == "")
+
+local check = [[
+ assert(counter() == 3 and peek() == 3)
+ assert(data[1] == 1 and data[2] == 2.5 and data[3] == "three")
+ assert(data[4].four == 4 and data[true] == false and data.self == data)
+ assert(data.missing == "missing?")
+ assert(("ab"):twice() == "abab")
+ assert(io.write and string.format("%d", 7) == "7")
+ io.write("ok")
+]]
+assert(run("-s " .. image, check) == "ok")
+assert(run("-s " .. image, check) == "ok")	-- the image is not changed
+
+local f = assert(io.open(image, "wb"))		-- a broken image is refused
+f:write("junk")
+f:close()
+assert(run("-s " .. image, "print(1)") ~= "1\n")
+os.remove(image)
+print("state images ok")
@@ -0,0 +1,45 @@
+-- numbers kept as ints must behave exactly as the floats they stand for
+
+local function float(x) return (x + 0.5) - 0.5 end	-- same value, as a float
+local function same(a, b)
+ return a == b and 1/a == 1/b and tostring(a) == tostring(b)
+end
+
+local max, min = 2147483647, -2147483648
+assert(same(max + 1, float(max) + 1) and max + 1 == 2^31)
+assert(same(min - 1, float(min) - 1) and min - 1 == -2^31 - 1)
+assert(same(-min, 2^31) and same(max * max, float(max) * max))
+assert(same(min * -1, 2^31) and same(min / -1, 2^31))
+assert(same(min % -1, float(min) % -1) and same(7 % -3, -2))
+assert(same(5 / 2, 2.5) and same(max + max, 2^32 - 2))
+local x = max
+x = x + 1
+assert(x > max and tostring(x) == "2147483648")
+
+-- -0 is a float: it must not become 0
+local z, nz = 0, -float(0)		-- literal -0.0 would share the constant 0
+assert(same(-z, nz) and tostring(-z) == "-0" and 1/-z == -1/0)
+assert(same(z * -1, nz) and same(z / -5, nz) and same(-5 % 5, 0))
+assert(same(-z + 0, 0) and -z == 0)
+local t = {}
+t[-z] = "zero"
+assert(t[0] == "zero")
+
+-- numeric for loops that reach the edges of the range
+local function count(a, b, c)
+ local n, last = 0
+ for i = a, b, c do n = n + 1; last = i; if n > 10 then break end end
+ return n, last
+end
+for _, c in ipairs{{max - 3, max, 1}, {max - 3, max, 2}, {min + 3, min, -1},
+                   {min, max, max}, {max, min, min}, {max, max, max}} do
+ local n1, l1 = count(c[1], c[2], c[3])
+ local n2, l2 = count(float(c[1]), float(c[2]), float(c[3]))
+ assert(n1 == n2 and l1 == l2, table.concat(c, ","))
+end
+
+-- constants keep their kind in bytecode
+local f = loadstring(string.dump(function() return -0, 2147483647 + 1, -2147483648 end))
+local a, b, c = f()
+assert(same(a, nz) and b == 2^31 and c == min)
+print("int ok")
@@ -0,0 +1,59 @@
+-- hot functions must give the same results when hooks, coroutines and
+-- the collector interrupt them (compiled code falls back to the VM)
+
+local function sum(n)
+ local s = 0
+ for i = 1, n do s = s + i end
+ return s
+end
+
+for i = 1, 200 do assert(sum(100) == 5050) end	-- hot by now
+
+-- hooks set while hot code runs
+local lines, count = 0, 0
+debug.sethook(function() lines = lines + 1 end, "l")
+assert(sum(100) == 5050)
+debug.sethook()
+assert(lines > 100)
+debug.sethook(function() count = count + 1 end, "", 10)
+assert(sum(1000) == 500500)
+debug.sethook()
+assert(count > 0)
+local ok, err = pcall(function()
+ debug.sethook(function() debug.sethook() error("stop") end, "", 1000)
+ while true do end
+end)
+assert(not ok and string.find(err, "stop"))
+assert(sum(100) == 5050)				-- and without hooks again
+
+-- yields from inside hot loops
+local function gen(n)
+ for i = 1, n do coroutine.yield(i) end
+ return "done"
+end
+for r = 1, 20 do
+ local co = coroutine.wrap(gen)
+ local s = 0
+ for i = 1, 100 do s = s + co(100) end
+ assert(s == 5050 and co() == "done")
+end
+
+-- the collector running while hot code makes garbage
+collectgarbage("setpause", 1)
+collectgarbage("setstepmul", 400)
+local keep = {}
+local function fill(r)
+ for i = 1, 500 do
+  local t = {i + r, tostring(i)}
+  keep[i] = t
+ end
+ return function() return keep[r % 500 + 1][1] end
+end
+for r = 1, 100 do
+ local f = fill(r)
+ for i = 1, 500 do assert(keep[i][1] == i + r and keep[i][2] == tostring(i)) end
+ assert(f() == r % 500 + 1 + r)
+end
+collectgarbage("setpause", 200)
+collectgarbage("setstepmul", 200)
+print("jit fallback ok")
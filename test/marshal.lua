@@ -0,0 +1,37 @@
+-- marshal must keep shared and cyclic tables and refuse bad input
+
+local m = marshal
+
+local t = {1, 2, x = "y"}
+t.self = t
+t.sub = {back = t}
+t[3] = t.sub
+local u = m.decode(m.encode(t))
+assert(u ~= t and u.self == u and u.sub.back == u and u[3] == u.sub)
+assert(u[1] == 1 and u[2] == 2 and u.x == "y")
+
+local k = {}
+local w = m.decode(m.encode({[k] = k}))		-- table as key and value
+local key, value = next(w)
+assert(key == value and type(key) == "table")
+
+local up = 0
+local function inc() up = up + 1 return up end
+local f = m.decode(m.encode({inc, inc}))
+assert(f[1] == f[2] and f[1]() == 1 and f[2]() == 2 and up == 0)
+
+assert(not pcall(m.encode, print))		-- C functions
+assert(not pcall(m.encode, coroutine.create(inc)))
+assert(not pcall(m.encode, io.stdout))
+
+local good = m.encode({1, "two", {3}, n = inc})
+assert(not pcall(m.decode, ""))
+assert(not pcall(m.decode, "junk"))
+assert(not pcall(m.decode, good .. "x"))
+for i = 1, #good do				-- must fail or decode, never crash
+ pcall(m.decode, string.sub(good, 1, i - 1))
+ for _, b in ipairs{0, 1, 127, 128, 255} do
+  pcall(m.decode, string.sub(good, 1, i - 1) .. string.char(b) .. string.sub(good, i + 1))
+ end
+end
+print("marshal ok")
@@ -0,0 +1,55 @@
+-- code optimized by `luac -O' must do what the plain code does
+-- usage: lua optimize.lua [luac]
+
+local lua = arg[-1]
+local luac = arg[1] or string.gsub(lua, "lua$", "luac")
+local source, plain, optimized = os.tmpname(), os.tmpname(), os.tmpname()
+
+local f = assert(io.open(source, "w"))
+f:write([[
+local function fib(n) if n < 2 then return n end return fib(n-1) + fib(n-2) end
+local t, s = {}, 0
+for i = 1, 20 do t[i] = fib(i) end
+for i = #t, 1, -1 do s = s + t[i] * (i % 3 == 0 and -1 or 1) end
+local a, b, c = 1, nil, "x"
+if not b and (a > 0 or c) then a = a + 1 end
+while a < 100 do a = a * 3 end
+repeat local x = a; a = a - 7 until a < 0 or x == 0
+local w = {}
+for k, v in pairs{x = 1, y = 2} do w[#w + 1] = k .. v end
+table.sort(w)
+local function va(...) return select("#", ...), ... end
+print(s, a, b, c, table.concat(w, ","), va(1, nil, 3))
+print(string.format("%5.2f", 10 / 3), 2^10, -0.5 % 1, #"abc" .. "d")
+if 1 < 2 then print("a" .. "b" .. "c") else print("never") end	-- work for -O
+while 2 == 3 do print("never") end
+local e = "x" == "x" and ("y" .. "z") or 1
+local stop
+for i = 1, 3 do if i == 2 then stop = i break end end
+print(e, stop)
+print(pcall(function() local x = nil; return x.y end))
+]])
+f:close()
+
+local function run(command)
+ local p = assert(io.popen(command .. " 2>&1"))
+ local out = p:read("*a")
+ p:close()
+ return out
+end
+
+assert(run(luac .. " -o " .. plain .. " " .. source) == "")
+assert(run(luac .. " -O -o " .. optimized .. " " .. source) == "")
+local function size(name)
+ local f = assert(io.open(name, "rb"))
+ local n = f:seek("end")
+ f:close()
+ return n
+end
+assert(size(optimized) < size(plain))		-- the pass did change the code
+local expected = run(lua .. " " .. plain)
+assert(string.find(expected, "x1,y2"), expected)
+assert(run(lua .. " " .. optimized) == expected)
+assert(run(lua .. " " .. source) == expected)
+os.remove(source); os.remove(plain); os.remove(optimized)
+print("luac -O ok")